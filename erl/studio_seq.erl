@@ -4,10 +4,36 @@
          list_patterns/1,
          save_pattern/2,
          load_pattern/2,
+         load_patterns/2,
+         clear_pattern/2,
          set_clock_div/2,
          pattern_unpack/1,
          pattern_pack/1,
-         save/1
+         save/1,
+         snapshot/2,
+         stats/1, stats/2,
+         jack_load/1, jack_load/2,
+         set_record_mode/3,
+         midi_outs/1,
+         set_route/4,
+         set_cv_slew/3,
+         set_groove/3,
+         set_pattern_groove/3,
+         clock_est/1,
+         scene_set/3,
+         scene_switch/3,
+         rotate_pattern/3,
+         scale_pattern/4,
+         reverse_pattern/2,
+         transpose_pattern/3,
+         smf_save/4,
+         smf_load/2,
+         midi_in_handlers/1,
+         midi_ins/1,
+         midi_in_add/4,
+         midi_in_del/2,
+         midi_out_add/2,
+         set_through/2
         ]).
 
 %% Sequences are [{Timestamp, Stuff}].
@@ -77,6 +103,203 @@ save_pattern(HubPid, Pattern) ->
 load_pattern(HubPid, Bin) when is_binary(Bin) ->
     {[0, PatNb], <<>>} = tag_u32:call(HubPid, [load_pattern], Bin),
     PatNb.
+%% Load a list of patterns with a single request, which waits for the
+%% JACK thread once instead of once per pattern.  Returns the pattern
+%% numbers in list order, with error for a pattern that didn't fit.
+load_patterns(HubPid, Bins) when is_list(Bins) ->
+    Batch = [<<(byte_size(Bin)):32, Bin/binary>> || Bin <- Bins],
+    {[0], Nbs} = tag_u32:call(HubPid, [load_patterns], iolist_to_binary(Batch)),
+    [case Nb of 16#FFFF -> error; _ -> Nb end || <<Nb:16/little>> <= Nbs].
+
+clear_pattern(HubPid, Pattern) ->
+    case tag_u32:call(HubPid, [clear_pattern, Pattern]) of
+        {[0], <<>>} -> ok;
+        _ -> error
+    end.
+
+%% Write the full sequencer state to a file.  Pass the file name as
+%% argument to hub to restore it at startup.
+snapshot(HubPid, Path) ->
+    case tag_u32:call(HubPid, [snapshot], iolist_to_binary(Path)) of
+        {[0, NbBytes], <<>>} ->
+            {ok, NbBytes};
+        _ ->
+            error
+    end.
+
+%% Sequencer instrumentation, see handle_stats() in hub.c.  The two
+%% histograms are log2 buckets of events per tick and of microseconds
+%% per tick.
+stats(HubPid) -> stats(HubPid, false).
+stats(HubPid, Reset) ->
+    R = case Reset of true -> 1; false -> 0 end,
+    {[0, NbTicks, NbEvents, MaxEvents, MaxChain,
+      TimerNb, MaxTimerNb,
+      FreeSteps, MinFreeSteps, FreePatterns, MinFreePatterns,
+      TickMaxUs, TickOverBudget], Bin} =
+        tag_u32:call(HubPid, [stats, R]),
+    {EventsHist, TickUsHist} = lists:split(8, [N || <<N:32/little>> <= Bin]),
+    #{nb_ticks => NbTicks, nb_events => NbEvents,
+      max_events => MaxEvents, max_chain => MaxChain,
+      timer_nb => TimerNb, max_timer_nb => MaxTimerNb,
+      free_steps => FreeSteps, min_free_steps => MinFreeSteps,
+      free_patterns => FreePatterns, min_free_patterns => MinFreePatterns,
+      tick_max_us => TickMaxUs, tick_over_budget => TickOverBudget,
+      events_hist => EventsHist, tick_us_hist => TickUsHist}.
+
+%% Process callback load, for hub and clock.  Bucket N of the
+%% histogram counts cycles that took less than 2^N us.
+jack_load(Pid) -> jack_load(Pid, false).
+jack_load(Pid, Reset) ->
+    R = case Reset of true -> 1; false -> 0 end,
+    {[0, NbCycles, MaxUs, NbXruns, NFrames, Rate], Bin} =
+        tag_u32:call(Pid, [jack_load, R]),
+    #{nb_cycles => NbCycles, max_us => MaxUs, nb_xruns => NbXruns,
+      nframes => NFrames, rate => Rate,
+      period_us => (NFrames * 1000000) div max(Rate, 1),
+      hist => [N || <<N:32/little>> <= Bin]}.
+
+%% Overdub merges all loop passes into one pattern.  Grid is in MIDI
+%% clocks, 0 for no quantization.  Takes effect at the next recording.
+set_record_mode(HubPid, Overdub, Grid) ->
+    O = case Overdub of true -> 1; false -> 0 end,
+    tag_u32:call(HubPid, [record_mode, O, Grid]).
+
+%% Output routing.  Kind is midi (PAT_MIDI_TAG port) or cv (PAT_CV_TAG
+%% channel), Out is an output name from midi_outs/1, or none.
+midi_outs(HubPid) ->
+    {[0], Bin} = tag_u32:call(HubPid, [midi_outs]),
+    [binary_to_atom(N) || N <- binary:split(Bin, <<"\n">>, [global, trim])].
+%% MIDI port registry.  Ports can be added while the hub is running.
+%% Each input is processed by a handler from midi_in_handlers/1, e.g.
+%% erl to only forward to Erlang, tagged with ErlPort.  New outputs
+%% are appended to midi_outs/1 and can be used with set_route/4.
+midi_in_handlers(HubPid) ->
+    {[0], Bin} = tag_u32:call(HubPid, [midi_in_handlers]),
+    [binary_to_atom(N) || N <- binary:split(Bin, <<"\n">>, [global, trim])].
+midi_ins(HubPid) ->
+    {[0], Bin} = tag_u32:call(HubPid, [midi_ins]),
+    Handlers = midi_in_handlers(HubPid),
+    [begin
+         [Name, H] = binary:split(Line, <<" ">>),
+         {binary_to_atom(Name), lists:nth(binary_to_integer(H) + 1, Handlers)}
+     end || Line <- binary:split(Bin, <<"\n">>, [global, trim])].
+midi_in_add(HubPid, Name, Handler, ErlPort) ->
+    Handlers = midi_in_handlers(HubPid),
+    HandlerNb = length(lists:takewhile(fun(H) -> H =/= Handler end, Handlers)),
+    case tag_u32:call(HubPid, [midi_in_add, HandlerNb, ErlPort], atom_to_binary(Name)) of
+        {[0, _Index], <<>>} -> ok;
+        _ -> error
+    end.
+midi_in_del(HubPid, Name) ->
+    tag_u32:call(HubPid, [midi_in_del], atom_to_binary(Name)).
+midi_out_add(HubPid, Name) ->
+    case tag_u32:call(HubPid, [midi_out_add], atom_to_binary(Name)) of
+        {[0, Index], <<>>} -> {ok, Index};
+        _ -> error
+    end.
+%% MIDI through.  Replaces the rule set, each rule a map:
+%%   in        input name, need not be registered yet
+%%   out       output name from midi_outs/1
+%%   chans     list of channels 0-15, default all
+%%   status    list of note_off, note_on, poly_at, cc, program,
+%%             chan_at, bend, default all
+%%   chan      output channel, default keep
+%%   transpose semitones, default 0
+%%   curve     linear (default), soft or hard
+%%   vel       {Min, Max} note on velocity range, default {0, 127}
+set_through(HubPid, Rules) ->
+    Outs = midi_outs(HubPid),
+    Status = [note_off, note_on, poly_at, cc, program, chan_at, bend],
+    Index = fun(X, L) -> length(lists:takewhile(fun(Y) -> Y =/= X end, L)) end,
+    Mask = fun(all, _) -> 16#FFFF;
+              (L, F) -> lists:foldl(fun(X, M) -> M bor (1 bsl F(X)) end, 0, L)
+           end,
+    Bin =
+        iolist_to_binary(
+          [begin
+               In = atom_to_binary(maps:get(in, R)),
+               Chan = case maps:get(chan, R, keep) of keep -> 16#FF; C -> C end,
+               {VelMin, VelMax} = maps:get(vel, R, {0, 127}),
+               <<(size(In)), In/binary,
+                 (Index(maps:get(out, R), Outs)),
+                 (Mask(maps:get(chans, R, all), fun(C1) -> C1 end)):16,
+                 ((Mask(maps:get(status, R, all), fun(S) -> Index(S, Status) end)) band 16#7F),
+                 Chan,
+                 (maps:get(transpose, R, 0)):8/signed,
+                 (Index(maps:get(curve, R, linear), [linear, soft, hard])),
+                 VelMin, VelMax>>
+           end || R <- Rules]),
+    tag_u32:call(HubPid, [midi_through], Bin).
+
+set_route(HubPid, Kind, Index, Out) ->
+    Outs = midi_outs(HubPid),
+    OutNb = case Out of
+                none -> length(Outs);
+                _ -> length(lists:takewhile(fun(O) -> O =/= Out end, Outs))
+            end,
+    KindNb = case Kind of midi -> 0; cv -> 1 end,
+    tag_u32:call(HubPid, [route, KindNb, Index, OutNb]).
+
+%% Slew time of CV output Index in ms for a full scale change, 0 for
+%% stepped output.
+set_cv_slew(HubPid, Index, Ms) ->
+    tag_u32:call(HubPid, [cv_slew, Index, Ms]).
+
+%% Groove templates: a list of up to 16 delays in frames, one per 16th
+%% note of the bar.  Template 0 is used by all patterns by default.
+set_groove(HubPid, Template, Offsets) ->
+    lists:foreach(
+      fun({Slot, Frames}) ->
+              {[0], <<>>} = tag_u32:call(HubPid, [groove, Template, Slot, Frames])
+      end,
+      lists:zip(lists:seq(0, length(Offsets) - 1), Offsets)),
+    ok.
+set_pattern_groove(HubPid, Pattern, Template) ->
+    tag_u32:call(HubPid, [pattern_groove, Pattern, Template]).
+
+%% Clock input tempo estimate.  Period and jitter are in frames.
+clock_est(HubPid) ->
+    case tag_u32:call(HubPid, [clock_est]) of
+        {[0, 1, Period, Jitter, Bpm100], <<>>} ->
+            #{period => Period / 256, jitter => Jitter / 256, bpm => Bpm100 / 100};
+        {[0, 0], <<>>} ->
+            unlocked
+    end.
+
+%% Scenes: the list of patterns that play, all others are muted.
+%% Switching happens at the next multiple of Quantum sequencer ticks
+%% since start, e.g. 96 for the next bar at 24 ppqn.
+scene_set(HubPid, Scene, Patterns) ->
+    Bin = iolist_to_binary([<<P:16/little>> || P <- Patterns]),
+    tag_u32:call(HubPid, [scene_set, Scene], Bin).
+scene_switch(HubPid, Scene, Quantum) ->
+    tag_u32:call(HubPid, [scene_switch, Scene, Quantum]).
+
+%% In-place pattern transforms, done by the hub without a round trip
+%% through save_pattern/load_pattern.  Ticks are sequencer ticks.
+rotate_pattern(HubPid, Pattern, Ticks) ->
+    tag_u32:call(HubPid, [pattern_rotate, Pattern, Ticks]).
+scale_pattern(HubPid, Pattern, Num, Den) ->
+    tag_u32:call(HubPid, [pattern_scale, Pattern, Num, Den]).
+reverse_pattern(HubPid, Pattern) ->
+    tag_u32:call(HubPid, [pattern_reverse, Pattern]).
+transpose_pattern(HubPid, Pattern, Semitones) ->
+    tag_u32:call(HubPid, [pattern_transpose, Pattern, Semitones band 16#FFFFFFFF]).
+
+%% Standard MIDI Files, read and written by the hub directly.  Format
+%% is 0 or 1.  smf_save returns the file size, smf_load the number of
+%% the new pattern.
+smf_save(HubPid, Pattern, Format, Path) ->
+    case tag_u32:call(HubPid, [smf_save, Pattern, Format], iolist_to_binary(Path)) of
+        {[0, NbBytes], <<>>} -> {ok, NbBytes};
+        _ -> error
+    end.
+smf_load(HubPid, Path) ->
+    case tag_u32:call(HubPid, [smf_load], iolist_to_binary(Path)) of
+        {[0, Pattern], <<>>} -> {ok, Pattern};
+        _ -> error
+    end.
 
 save(HubPid) ->
     Patterns = list_patterns(HubPid),
@@ -37,6 +37,5 @@ t1(HubPid) ->
     studio_seq:load_pattern(HubPid, StepsBin).
     
 t2(HubPid) ->
-    [studio_seq:load_pattern(HubPid, StepsBin)
-     || StepsBin <- bin_patterns()].
+    studio_seq:load_patterns(HubPid, bin_patterns()).
 
@@ -0,0 +1,157 @@
+#ifndef MOD_MIDI_THROUGH
+#define MOD_MIDI_THROUGH
+
+/* MIDI through routing matrix.
+
+   A rule matches channel messages on one input by channel and status,
+   and sends a possibly modified copy to one output: channel remap,
+   transpose of the note number and a velocity curve on note on.
+
+   Rules are compiled off the RT path into a flat map, indexed by
+   input, status and channel, that lists the routes for each message.
+   The number of routes per message is at most MIDI_THROUGH_FANOUT, so
+   the per-event cost is bounded, and compilation fails if a rule set
+   exceeds it.  The map is read-only once compiled, so a new map can
+   be swapped in with a single pointer store. */
+
+#include <stdint.h>
+#include <string.h>
+
+#ifndef MIDI_THROUGH_NB_IN
+#define MIDI_THROUGH_NB_IN 32
+#endif
+#ifndef MIDI_THROUGH_NB_ROUTES
+#define MIDI_THROUGH_NB_ROUTES 64
+#endif
+#define MIDI_THROUGH_FANOUT 4
+
+/* Status classes 0x80 to 0xE0. */
+#define MIDI_THROUGH_NB_STATUS 7
+#define MIDI_THROUGH_CHAN_KEEP 0xFF
+
+enum midi_through_curve {
+    midi_through_curve_linear,
+    midi_through_curve_soft,  // quadratic, more range at low velocity
+    midi_through_curve_hard,  // inverse of soft
+    NB_MIDI_THROUGH_CURVE
+};
+
+struct midi_through_rule {
+    uint8_t in;           // input slot, rules past MIDI_THROUGH_NB_IN are ignored
+    uint8_t out;          // output number passed to the send function
+    uint16_t chan_mask;   // bit n matches channel n
+    uint8_t status_mask;  // bit n matches status 0x80 + 0x10 * n
+    uint8_t chan;         // output channel, or MIDI_THROUGH_CHAN_KEEP
+    int8_t transpose;     // semitones, notes that end up out of range are dropped
+    uint8_t curve;
+    uint8_t vel_min;      // note on velocity range after the curve
+    uint8_t vel_max;
+};
+
+struct midi_through_route {
+    uint8_t out;
+    uint8_t chan;
+    int8_t transpose;
+    uint8_t vel[128];
+};
+struct midi_through_map {
+    /* Inputs that have at least one route. */
+    uint32_t in_mask;
+    uint8_t nb[MIDI_THROUGH_NB_IN][MIDI_THROUGH_NB_STATUS][16];
+    uint8_t route_nb[MIDI_THROUGH_NB_IN][MIDI_THROUGH_NB_STATUS][16][MIDI_THROUGH_FANOUT];
+    struct midi_through_route route[MIDI_THROUGH_NB_ROUTES];
+};
+
+static inline uint32_t midi_through_curve(uint32_t curve, uint32_t v) {
+    switch(curve) {
+    case midi_through_curve_soft: return (v * v + 63) / 127;
+    case midi_through_curve_hard: return 127 - ((127 - v) * (127 - v) + 63) / 127;
+    default: return v;
+    }
+}
+
+/* Returns 0 on success.  On failure the map is left cleared. */
+int midi_through_compile(struct midi_through_map *m,
+                         const struct midi_through_rule *rule, uint32_t nb) {
+    memset(m, 0, sizeof(*m));
+    if (nb > MIDI_THROUGH_NB_ROUTES) return -1;
+    for (uint32_t i = 0; i < nb; i++) {
+        const struct midi_through_rule *r = &rule[i];
+        if ((r->curve >= NB_MIDI_THROUGH_CURVE) ||
+            ((r->chan != MIDI_THROUGH_CHAN_KEEP) && (r->chan > 15)) ||
+            (r->vel_min > r->vel_max) || (r->vel_max > 127)) {
+            goto error;
+        }
+        struct midi_through_route *route = &m->route[i];
+        route->out = r->out;
+        route->chan = r->chan;
+        route->transpose = r->transpose;
+        /* A note on keeps a nonzero velocity, as zero means note off. */
+        for (uint32_t v = 0; v < 128; v++) {
+            uint32_t c = midi_through_curve(r->curve, v);
+            uint32_t out = r->vel_min + ((r->vel_max - r->vel_min) * c + 63) / 127;
+            route->vel[v] = (v && !out) ? 1 : out;
+        }
+        if (r->in >= MIDI_THROUGH_NB_IN) continue;
+        for (uint32_t s = 0; s < MIDI_THROUGH_NB_STATUS; s++) {
+            if (!(r->status_mask & (1 << s))) continue;
+            for (uint32_t c = 0; c < 16; c++) {
+                if (!(r->chan_mask & (1 << c))) continue;
+                uint8_t *n = &m->nb[r->in][s][c];
+                if (*n == MIDI_THROUGH_FANOUT) goto error;
+                m->route_nb[r->in][s][c][(*n)++] = i;
+                m->in_mask |= 1u << r->in;
+            }
+        }
+    }
+    return 0;
+  error:
+    memset(m, 0, sizeof(*m));
+    return -1;
+}
+
+static inline int midi_through_active(const struct midi_through_map *m, uint32_t in) {
+    return (in < MIDI_THROUGH_NB_IN) && (m->in_mask & (1u << in));
+}
+
+/* Routes one message from input slot in.  Anything that is not a
+   complete channel message is ignored.  Returns the number of copies
+   sent. */
+typedef void (*midi_through_send_fn)(void *ctx, uint32_t out, const uint8_t *msg, uint32_t len);
+static inline uint32_t midi_through_event(const struct midi_through_map *m, uint32_t in,
+                                          const uint8_t *msg, uint32_t len,
+                                          midi_through_send_fn send, void *ctx) {
+    if (!midi_through_active(m, in) || (len < 2) ||
+        (msg[0] < 0x80) || (msg[0] >= 0xF0)) {
+        return 0;
+    }
+    uint32_t status = msg[0] & 0xF0;
+    uint32_t nb_data = ((status == 0xC0) || (status == 0xD0)) ? 1 : 2;
+    if (len != 1 + nb_data) return 0;
+    uint32_t s = (status >> 4) - 8;
+    uint32_t c = msg[0] & 0x0F;
+    uint32_t nb = m->nb[in][s][c];
+    uint32_t nb_sent = 0;
+    for (uint32_t i = 0; i < nb; i++) {
+        const struct midi_through_route *r = &m->route[m->route_nb[in][s][c][i]];
+        uint8_t out[3] = {
+            status | (r->chan == MIDI_THROUGH_CHAN_KEEP ? c : r->chan),
+            msg[1],
+            nb_data == 2 ? msg[2] : 0
+        };
+        if (status <= 0xA0) {
+            /* Note off, note on and poly aftertouch carry a note. */
+            int32_t note = msg[1] + r->transpose;
+            if ((note < 0) || (note > 127)) continue;
+            out[1] = note;
+        }
+        if ((status == 0x90) && out[2]) {
+            out[2] = r->vel[out[2] & 0x7F];
+        }
+        send(ctx, r->out, out, 1 + nb_data);
+        nb_sent++;
+    }
+    return nb_sent;
+}
+
+#endif
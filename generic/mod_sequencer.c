@@ -42,7 +42,7 @@
 */
 
 
-#include "swtimer.h"
+#include "macros.h"
 #include <string.h>
 
 /* Code is split up into two parts: a collection of loops (or finite
@@ -56,6 +56,7 @@
 
 typedef uint16_t step_t;   // identifier for step event + link
 typedef uint16_t dtime_t;  // delta-time in midi clocks
+typedef uint16_t pattern_t;
 
 struct pattern_midi_note {
     uint8_t tag;  // Contains midi tag bits + port number.
@@ -126,45 +127,119 @@ CT_ASSERT(pattern_step_size, sizeof(struct pattern_step) == 8);
 #define STEP_NONE 0xFFFF
 #define STEP_DEAD 0xFFFE
 
+/* By default the pools are static arrays of STEP_POOL_SIZE and
+   PATTERN_POOL_SIZE elements, which is what the embedded targets use.
+   With SEQUENCER_POOL_ARENA, sequencer_init() takes the capacities
+   and carves the pools out of a caller-provided arena instead, once
+   at startup.  Indices are 16 bit in both cases. */
+#ifdef SEQUENCER_POOL_ARENA
+struct sequencer_arena {
+    uint8_t *buf;
+    uintptr_t size;
+    uintptr_t used;
+};
+static inline void *sequencer_arena_alloc(struct sequencer_arena *a, uintptr_t size) {
+    uintptr_t start = (a->used + 7) & ~((uintptr_t)7);
+    ASSERT(start + size <= a->size); // out-of-memory
+    a->used = start + size;
+    return a->buf + start;
+}
+#define SEQUENCER_POOL_ARRAY(type, name, size) type *name
+#else
+#define SEQUENCER_POOL_ARRAY(type, name, size) type name[size]
+#endif
+
 struct step_pool {
-    struct pattern_step step[STEP_POOL_SIZE];
+    SEQUENCER_POOL_ARRAY(struct pattern_step, step, STEP_POOL_SIZE);
+    /* Capacity */
+    uint32_t nb;
+    uint32_t nb_free;
+    /* Bumped on every change to the links, see sequencer_compact(). */
+    uint32_t gen;
     step_t free;
+#ifdef SEQUENCER_POOL_ARENA
+    /* Predecessor and owning pattern of each step, for the compactor.
+       The free list head has no predecessor.  Free steps can keep a
+       stale owner, which is harmless as a move only relinks the
+       references of used patterns to the two slots it exchanges.
+       Every change to the links keeps these up to date. */
+    step_t *prev;
+    uint16_t *owner;
+#endif
 };
+#ifdef SEQUENCER_POOL_ARENA
+/* The link of step has changed. */
+static inline void step_pool_relink_(struct step_pool *p, step_t step) {
+    step_t next = p->step[step].next;
+    if (next != STEP_NONE) p->prev[next] = step;
+}
+/* The free list head has changed. */
+static inline void step_pool_refree_(struct step_pool *p) {
+    if (p->free != STEP_NONE) p->prev[p->free] = STEP_NONE;
+}
+static inline void step_pool_own_(struct step_pool *p, step_t step, uint16_t owner) {
+    p->owner[step] = owner;
+}
+#else
+static inline void step_pool_relink_(struct step_pool *p, step_t step) { }
+static inline void step_pool_refree_(struct step_pool *p) { }
+static inline void step_pool_own_(struct step_pool *p, step_t step, uint16_t owner) { }
+#endif
 static inline void step_pool_free(struct step_pool *p, step_t index) {
     p->step[index].next = p->free;
+    step_pool_relink_(p, index);
     p->free = index;
+    step_pool_refree_(p);
+    p->nb_free++;
+    p->gen++;
 }
-/* Break loop, push it to the freelist. */
-static inline void step_pool_free_loop(struct step_pool *p, step_t last) {
+/* Break loop of nb steps, push it to the freelist. */
+static inline void step_pool_free_loop(struct step_pool *p, step_t last, uint32_t nb) {
     struct pattern_step *plast = &p->step[last];
     step_t first = plast->next;
     plast->next = p->free;
+    step_pool_relink_(p, last);
     p->free = first;
+    step_pool_refree_(p);
+    p->nb_free += nb;
+    p->gen++;
 }
 static inline uint64_t step_pool_info(struct step_pool *p) {
     uint64_t mask = 0;
     LOG("step free:");
     for(step_t i=p->free; i != STEP_NONE; i=p->step[i].next) {
         LOG(" %d", i);
-        mask |= (1 << i);
+        if (i < 64) mask |= (1ULL << i);
     }
     LOG("\n");
+    /* Membership bitmask of the first 64 steps, for testing. */
     return mask;
 }
 
+/* Check if at least n steps are available without running out of
+   memory, before a batch of allocs. */
+static inline int step_pool_has_free(struct step_pool *p, uintptr_t n) {
+    return p->nb_free >= n;
+}
 
 static inline uint16_t step_pool_alloc(struct step_pool *p) {
     uint16_t index = p->free;
     ASSERT(index != STEP_NONE); // out-of-memory
     p->free = p->step[index].next;
+    step_pool_refree_(p);
     p->step[index].next = STEP_NONE;
+    p->nb_free--;
+    p->gen++;
     return index;
 }
+/* Storage and capacity need to be set up before calling this. */
 static inline void step_pool_init(struct step_pool *p) {
-    memset(p, 0, sizeof(*p));
+    ASSERT(p->nb <= STEP_DEAD);
+    memset(p->step, 0, p->nb * sizeof(p->step[0]));
     /* Initialize the free list. */
     p->free = STEP_NONE;
-    for(int i=STEP_POOL_SIZE-1; i>=0; i--) {
+    p->nb_free = 0;
+    for(int i=p->nb-1; i>=0; i--) {
         step_pool_free(p, i);
     }
 }
@@ -190,8 +265,29 @@ struct pattern_phase {
        O(1) operations */
     step_t last;
 
+    /* Patterns are scheduled in groups that share a single timer
+       entry.  The timer refers to the first pattern in the group,
+       the others are linked through group_next.  All members are due
+       at the same time, see sequencer_group_tick().  A pattern that
+       is not merged is a group of one. */
+    pattern_t group_next;
+    /* Time of the next step, in circular timer time. */
+    dtime_t due;
+
     /* Flags */
     uint32_t mute:1;
+    /* Scratch bit for passes over the pattern pool. */
+    uint32_t mark:1;
+    /* Set while the pattern leads a group that has a timer entry. */
+    uint32_t lead:1;
+    uint32_t nb_steps:16;
+    /* Groove template, and the position of the play head in ticks
+       since the first step, modulo SEQUENCER_GROOVE_PERIOD. */
+    uint32_t groove:4;
+    uint32_t groove_pos:7;
+    /* Loop length, the sum of the step delays.  Kept up to date by
+       everything that edits the steps. */
+    uint32_t length;
 
 };
 
@@ -212,15 +308,17 @@ static inline enum pattern_phase_lifecycle pattern_phase_lifecycle(struct patter
 
 
 /* The size of the software timer is the number of simultaneous
-   patterns that can be represented. ( Note that patterns of the same
-   length could be merged. )*/
+   patterns that can be represented.  Patterns that are due at the
+   same time can share a single timer entry, see group_next. */
 #ifndef PATTERN_POOL_SIZE
 #define PATTERN_POOL_SIZE 64
 #endif
-typedef uint16_t pattern_t;
 #define PATTERN_NONE 0xffff
 struct pattern_pool {
-    struct pattern_phase pattern[PATTERN_POOL_SIZE];
+    SEQUENCER_POOL_ARRAY(struct pattern_phase, pattern, PATTERN_POOL_SIZE);
+    /* Capacity */
+    uint32_t nb;
+    uint32_t nb_free;
     pattern_t free;
 };
 
@@ -233,13 +331,14 @@ static inline void pattern_pool_free_(struct pattern_pool *p, pattern_t index) {
     /* See pattern_phase_lifecycle() */
     p->pattern[index].last = STEP_NONE;
     p->free = index;
+    p->nb_free++;
 }
 static inline pattern_t pattern_pool_alloc_(struct pattern_pool *p) {
-    LOG("pattern_pool_alloc p->free = 0x%x\n", p->free);
     uint16_t index = p->free;
     ASSERT(index != PATTERN_NONE); // out-of-memory
     p->free = p->pattern[index].head;
     p->pattern[index].head = STEP_NONE;
+    p->nb_free--;
     return index;
 }
 
@@ -249,23 +348,246 @@ static inline uint64_t pattern_pool_info(struct pattern_pool *p) {
     LOG("patn free:");
     for(pattern_t i=p->free; i != PATTERN_NONE; i=p->pattern[i].head) {
         LOG(" %d", i);
-        mask |= (1 << i);
+        if (i < 64) mask |= (1ULL << i);
     }
     LOG("\n");
-    /* Membership bitmask for testing. */
+    /* Membership bitmask of the first 64 patterns, for testing. */
     return mask;
 }
+/* Storage and capacity need to be set up before calling this. */
 static inline void pattern_pool_init(struct pattern_pool *p) {
-    memset(p, 0, sizeof(*p));
+    ASSERT(p->nb <= PATTERN_NONE);
+    memset(p->pattern, 0, p->nb * sizeof(p->pattern[0]));
     /* Initialize the free list. */
     p->free = PATTERN_NONE;
-    for(int i=PATTERN_POOL_SIZE-1; i>=0; i--) {
+    p->nb_free = 0;
+    for(int i=p->nb-1; i>=0; i--) {
         pattern_pool_free_(p, i);
     }
     //pattern_pool_info(p);
 }
 
 
+/* Pattern scheduler.  This holds the next wake-up time of each
+   pattern.  Two implementations are available, selected at compile
+   time:
+
+   - The default is the binary heap software timer from uc_tools,
+     which is compact and O(log n) per schedule/pop.  It uses 16 bit
+     circular time.
+
+   - SEQUENCER_TIMER_WHEEL selects a two level hierarchical timing
+     wheel with 32 bit time.  Schedule and pop are O(1), and entries
+     are moved from the second to the first level once every
+     SEQUENCER_WHEEL_SIZE ticks.  This uses more memory, so it is
+     meant for the host.
+
+   Both support delays up to 0xFFFF ticks. */
+#ifdef SEQUENCER_TIMER_WHEEL
+
+#define SEQUENCER_WHEEL_BITS 8
+#define SEQUENCER_WHEEL_SIZE (1 << SEQUENCER_WHEEL_BITS)
+#define SEQUENCER_WHEEL_MASK (SEQUENCER_WHEEL_SIZE - 1)
+struct sequencer_timer {
+    uint32_t now;
+    uint32_t nb;
+    /* Level 0 has one slot per tick of the current wheel revolution,
+       level 1 has one slot per revolution.  Slots are singly linked
+       lists of patterns. */
+    pattern_t slot[2][SEQUENCER_WHEEL_SIZE];
+    /* Level 0 occupancy, used to find the next deadline. */
+    uint64_t occupied[SEQUENCER_WHEEL_SIZE / 64];
+    SEQUENCER_POOL_ARRAY(pattern_t, next, PATTERN_POOL_SIZE);
+    SEQUENCER_POOL_ARRAY(uint32_t, deadline, PATTERN_POOL_SIZE);
+};
+#ifdef SEQUENCER_POOL_ARENA
+#define SEQUENCER_TIMER_BYTES(nb_patterns) \
+    ((nb_patterns) * (sizeof(pattern_t) + sizeof(uint32_t)))
+static inline void sequencer_timer_alloc(struct sequencer_timer *t,
+                                         struct sequencer_arena *a,
+                                         uint32_t nb_patterns) {
+    t->next = sequencer_arena_alloc(a, nb_patterns * sizeof(pattern_t));
+    t->deadline = sequencer_arena_alloc(a, nb_patterns * sizeof(uint32_t));
+}
+#endif
+static inline void sequencer_timer_reset(struct sequencer_timer *t) {
+    t->nb = 0;
+    for (int i=0; i<SEQUENCER_WHEEL_SIZE; i++) {
+        t->slot[0][i] = PATTERN_NONE;
+        t->slot[1][i] = PATTERN_NONE;
+    }
+    memset(t->occupied, 0, sizeof(t->occupied));
+}
+static inline void sequencer_timer_init(struct sequencer_timer *t) {
+    t->now = 0;
+    sequencer_timer_reset(t);
+}
+static inline void sequencer_timer_insert_(struct sequencer_timer *t, pattern_t p) {
+    uint32_t deadline = t->deadline[p];
+    pattern_t *head;
+    if ((deadline >> SEQUENCER_WHEEL_BITS) == (t->now >> SEQUENCER_WHEEL_BITS)) {
+        uint32_t i = deadline & SEQUENCER_WHEEL_MASK;
+        head = &t->slot[0][i];
+        t->occupied[i / 64] |= 1ULL << (i % 64);
+    }
+    else {
+        head = &t->slot[1][(deadline >> SEQUENCER_WHEEL_BITS) & SEQUENCER_WHEEL_MASK];
+    }
+    t->next[p] = *head;
+    *head = p;
+}
+static inline void sequencer_timer_schedule(struct sequencer_timer *t, dtime_t delay, pattern_t p) {
+    t->deadline[p] = t->now + delay;
+    sequencer_timer_insert_(t, p);
+    t->nb++;
+}
+/* Move the level 1 slot of the current revolution down to level 0.
+   Entries that are a full revolution ahead go back into level 1. */
+static inline void sequencer_timer_cascade_(struct sequencer_timer *t) {
+    pattern_t *head = &t->slot[1][(t->now >> SEQUENCER_WHEEL_BITS) & SEQUENCER_WHEEL_MASK];
+    pattern_t p = *head;
+    *head = PATTERN_NONE;
+    while (p != PATTERN_NONE) {
+        pattern_t next = t->next[p];
+        sequencer_timer_insert_(t, p);
+        p = next;
+    }
+}
+/* Returns next pattern that is due now, or PATTERN_NONE. */
+static inline pattern_t sequencer_timer_pop(struct sequencer_timer *t) {
+    uint32_t i = t->now & SEQUENCER_WHEEL_MASK;
+    pattern_t p = t->slot[0][i];
+    if (p == PATTERN_NONE) return PATTERN_NONE;
+    t->slot[0][i] = t->next[p];
+    if (t->slot[0][i] == PATTERN_NONE) {
+        t->occupied[i / 64] &= ~(1ULL << (i % 64));
+    }
+    t->nb--;
+    return p;
+}
+static inline void sequencer_timer_advance(struct sequencer_timer *t, uintptr_t n) {
+    t->now += n;
+    if (!(t->now & SEQUENCER_WHEEL_MASK)) {
+        sequencer_timer_cascade_(t);
+    }
+}
+/* Number of ticks until the next deadline, clipped to max.  This does
+   not look past the end of the current revolution, such that
+   sequencer_timer_advance() never skips a cascade. */
+static inline uintptr_t sequencer_timer_idle(struct sequencer_timer *t, uintptr_t max) {
+    if (t->nb == 0) return max;
+    uint32_t i0 = t->now & SEQUENCER_WHEEL_MASK;
+    uint32_t i = SEQUENCER_WHEEL_SIZE;
+    for (uint32_t w = i0 / 64; w < SEQUENCER_WHEEL_SIZE / 64; w++) {
+        uint64_t bits = t->occupied[w];
+        if (w == i0 / 64) bits &= ~0ULL << (i0 % 64);
+        if (bits) {
+            i = w * 64 + __builtin_ctzll(bits);
+            break;
+        }
+    }
+    uintptr_t idle = i - i0;
+    return idle < max ? idle : max;
+}
+static inline uint32_t sequencer_timer_now(struct sequencer_timer *t) {
+    return t->now;
+}
+static inline uint32_t sequencer_timer_nb(struct sequencer_timer *t) {
+    return t->nb;
+}
+/* Calls fn for each entry, for sequencer_check_invariants(). */
+typedef void (*sequencer_timer_fn)(void *ctx, pattern_t p);
+static inline void sequencer_timer_foreach(struct sequencer_timer *t,
+                                           sequencer_timer_fn fn, void *ctx) {
+    uint32_t n = 0;
+    for (int l=0; l<2; l++) {
+        for (int i=0; i<SEQUENCER_WHEEL_SIZE; i++) {
+            /* Level 0 slots are for the current revolution only. */
+            if (l == 0) {
+                int occupied = (t->occupied[i / 64] >> (i % 64)) & 1;
+                ASSERT(occupied == (t->slot[0][i] != PATTERN_NONE));
+            }
+            for (pattern_t p = t->slot[l][i]; p != PATTERN_NONE; p = t->next[p]) {
+                ASSERT(n++ < t->nb);
+                uint32_t d = t->deadline[p];
+                if (l == 0) {
+                    ASSERT((d >> SEQUENCER_WHEEL_BITS) == (t->now >> SEQUENCER_WHEEL_BITS));
+                    ASSERT((d & SEQUENCER_WHEEL_MASK) == i);
+                }
+                ASSERT(d - t->now <= 0xFFFF);
+                fn(ctx, p);
+            }
+        }
+    }
+    ASSERT(n == t->nb);
+}
+
+#else
+
+#include "swtimer.h"
+struct sequencer_timer {
+    struct swtimer swtimer;
+    SEQUENCER_POOL_ARRAY(struct swtimer_element, swtimer_element, PATTERN_POOL_SIZE);
+};
+#ifdef SEQUENCER_POOL_ARENA
+#define SEQUENCER_TIMER_BYTES(nb_patterns) \
+    ((nb_patterns) * sizeof(struct swtimer_element))
+static inline void sequencer_timer_alloc(struct sequencer_timer *t,
+                                         struct sequencer_arena *a,
+                                         uint32_t nb_patterns) {
+    t->swtimer_element =
+        sequencer_arena_alloc(a, nb_patterns * sizeof(struct swtimer_element));
+}
+#endif
+static inline void sequencer_timer_reset(struct sequencer_timer *t) {
+    swtimer_reset(&t->swtimer);
+}
+static inline void sequencer_timer_init(struct sequencer_timer *t) {
+    t->swtimer.arr = t->swtimer_element;
+}
+static inline void sequencer_timer_schedule(struct sequencer_timer *t, dtime_t delay, pattern_t p) {
+    swtimer_schedule(&t->swtimer, delay, p);
+}
+static inline pattern_t sequencer_timer_pop(struct sequencer_timer *t) {
+    if (t->swtimer.nb == 0) return PATTERN_NONE;
+    swtimer_element_t next = swtimer_peek(&t->swtimer);
+    if (next.time_abs != t->swtimer.now_abs) return PATTERN_NONE;
+    swtimer_pop(&t->swtimer);
+    return next.tag;
+}
+static inline void sequencer_timer_advance(struct sequencer_timer *t, uintptr_t n) {
+    t->swtimer.now_abs += n;
+}
+static inline uintptr_t sequencer_timer_idle(struct sequencer_timer *t, uintptr_t max) {
+    if (t->swtimer.nb == 0) return max;
+    swtimer_element_t next = swtimer_peek(&t->swtimer);
+    dtime_t delta = next.time_abs - t->swtimer.now_abs;
+    return delta < max ? delta : max;
+}
+static inline uint32_t sequencer_timer_now(struct sequencer_timer *t) {
+    return t->swtimer.now_abs;
+}
+static inline uint32_t sequencer_timer_nb(struct sequencer_timer *t) {
+    return t->swtimer.nb;
+}
+/* Calls fn for each entry, for sequencer_check_invariants(). */
+typedef void (*sequencer_timer_fn)(void *ctx, pattern_t p);
+static inline void sequencer_timer_foreach(struct sequencer_timer *t,
+                                           sequencer_timer_fn fn, void *ctx) {
+    struct swtimer *h = &t->swtimer;
+    for (uint32_t i=0; i<h->nb; i++) {
+        /* Heap order, relative to now. */
+        if (i > 0) {
+            dtime_t parent = h->arr[(i-1)/2].time_abs - h->now_abs;
+            ASSERT((dtime_t)(h->arr[i].time_abs - h->now_abs) >= parent);
+        }
+        fn(ctx, h->arr[i].tag);
+    }
+}
+
+#endif
+
+
 struct sequencer;
 typedef void (*sequencer_fn)(struct sequencer *s, const union pattern_event *ev);
 
@@ -278,38 +600,152 @@ struct sequencer_cursor {
     /* Duration is saved so a new pattern can be created to handle
        subsequent loop passes. */
     dtime_t duration;
+    /* Record mode, kept across recordings.  In overdub mode all loop
+       passes are merged into the same pattern, and delay holds the
+       number of MIDI clocks since the pattern header.  Overdubbed
+       events are snapped to a multiple of grid, 0 or 1 disables. */
+    uint8_t overdub;
+    dtime_t grid;
+    /* Mode of the open recording, latched when it is opened, as
+       delay means something else in each mode. */
+    uint8_t rec_overdub;
+    dtime_t rec_grid;
 };
 
 typedef void (*sequencer_pattern_event_fn)(struct sequencer *, pattern_t);
 
+/* Instrumentation, updated by sequencer_tick().  Current pool and
+   timer occupancy are not duplicated here, see sequencer_stats_*. */
+#define SEQUENCER_STATS_HIST 8
+struct sequencer_stats {
+    uint32_t nb_ticks;
+    uint32_t nb_events;
+    /* Events dispatched in a single tick. */
+    uint32_t max_events;
+    /* Steps with the same time stamp in a single pattern. */
+    uint32_t max_chain;
+    uint32_t max_timer_nb;
+    /* Low water marks of the pools. */
+    uint32_t min_free_steps;
+    uint32_t min_free_patterns;
+    /* Events per tick, log2 buckets: 0, 1, 2-3, 4-7, ... */
+    uint32_t events_hist[SEQUENCER_STATS_HIST];
+    /* Scratch: events in the current tick. */
+    uint32_t tick_events;
+};
+
+#ifdef SEQUENCER_POOL_ARENA
+/* State of the incremental step pool compactor. */
+enum sequencer_compact_phase {
+    sequencer_compact_idle = 0,
+    sequencer_compact_clear,
+    sequencer_compact_link,
+    sequencer_compact_owner,
+    sequencer_compact_move,
+};
+struct sequencer_compact {
+    /* Work units per sequencer_tick().  0 disables compaction. */
+    uint32_t budget;
+    /* step_pool.gen at the start of the pass. */
+    uint32_t gen;
+    uint32_t phase;
+    /* Position in the current phase. */
+    uint32_t i;
+    step_t step;
+    step_t dst;
+    /* Start of the current pattern's run. */
+    step_t run;
+    /* Statistics */
+    uint32_t nb_moves;
+    uint32_t nb_passes;
+};
+#endif
+
+/* Offline rendering collects time-stamped events into a
+   caller-provided buffer instead of calling dispatch. */
+struct sequencer_event {
+    uintptr_t time;
+    union pattern_event event;
+};
+struct sequencer_render {
+    struct sequencer_event *buf;
+    uintptr_t size;
+    uintptr_t nb;
+    /* Rendering stops before a tick when fewer than this number of
+       slots are free.  Set it to the maximum number of events
+       dispatched in a single tick. */
+    uintptr_t reserve;
+    /* Events that did not fit in the buffer. */
+    uintptr_t nb_drop;
+};
+
+/* Groove.  The dispatch callback gets the pattern's template and the
+   slot of the event's position in the bar as a single table index in
+   s->groove_slot.  What the offsets mean is up to the caller.  The
+   defaults give 16 slots of a 16th note at 24 ppqn. */
+#ifndef SEQUENCER_GROOVE_SLOTS
+#define SEQUENCER_GROOVE_SLOTS 16
+#endif
+#ifndef SEQUENCER_GROOVE_TICKS
+#define SEQUENCER_GROOVE_TICKS 6
+#endif
+#define SEQUENCER_GROOVE_NB 16
+#define SEQUENCER_GROOVE_PERIOD (SEQUENCER_GROOVE_SLOTS * SEQUENCER_GROOVE_TICKS)
+CT_ASSERT(groove_period, SEQUENCER_GROOVE_PERIOD <= 128);
+
+/* A pattern that is scheduled at the same time as an existing group
+   joins that group instead of taking a timer entry of its own.  The
+   groups are found through a small table indexed by due time.  An
+   entry is only a hint: a collision overwrites it, which at worst
+   costs a timer entry. */
+#define SEQUENCER_DUE_HASH 64
+
 struct sequencer {
     sequencer_fn dispatch;
+    struct sequencer_render *render;
     uintptr_t time;
     struct sequencer_cursor cursor;
-    struct swtimer swtimer;
-    struct swtimer_element swtimer_element[PATTERN_POOL_SIZE];
+    struct sequencer_timer timer;
     struct step_pool step_pool;
     struct pattern_pool pattern_pool;
+    struct sequencer_stats stats;
     sequencer_pattern_event_fn pattern_alloc_notify;
     sequencer_pattern_event_fn pattern_free_notify;
+#ifdef SEQUENCER_POOL_ARENA
+    struct sequencer_compact compact;
+#endif
+    /* Pattern and groove table index of the event being dispatched. */
+    pattern_t pattern;
+    uint16_t groove_slot;
     uint8_t verbose:1;
+    /* Group leaders by due time, see sequencer_group_find_(). */
+    pattern_t due_leader[SEQUENCER_DUE_HASH];
 };
 struct pattern_phase *sequencer_pattern(struct sequencer *s, pattern_t nb) {
-    ASSERT(nb < PATTERN_POOL_SIZE);
+    ASSERT(nb < s->pattern_pool.nb);
     return &s->pattern_pool.pattern[nb];
 }
 struct pattern_step *sequencer_step(struct sequencer *s, step_t nb) {
-    ASSERT(nb < STEP_POOL_SIZE);
+    ASSERT(nb < s->step_pool.nb);
     return &s->step_pool.step[nb];
 }
 
 // Note: don't use pattern_pool_alloc/free() directly.
 pattern_t sequencer_pattern_alloc(struct sequencer *s) {
+    if (s->verbose) { LOG("pattern_alloc free = 0x%x\n", s->pattern_pool.free); }
     pattern_t index = pattern_pool_alloc_(&s->pattern_pool);
     if (s->pattern_alloc_notify) {
         s->pattern_alloc_notify(s, index);
     }
     s->pattern_pool.pattern[index].mute = 0;
+    s->pattern_pool.pattern[index].lead = 0;
+    s->pattern_pool.pattern[index].nb_steps = 0;
+    s->pattern_pool.pattern[index].length = 0;
+    s->pattern_pool.pattern[index].groove = 0;
+    s->pattern_pool.pattern[index].groove_pos = 0;
+    if (s->pattern_pool.nb_free < s->stats.min_free_patterns) {
+        s->stats.min_free_patterns = s->pattern_pool.nb_free;
+    }
     return index;
 }
 void sequencer_pattern_free(struct sequencer *s, pattern_t index) {
@@ -319,13 +755,115 @@ void sequencer_pattern_free(struct sequencer *s, pattern_t index) {
     }
 }
 
-void sequencer_init(struct sequencer *s, sequencer_fn dispatch) {
-    memset(s,0,sizeof(*s));
+void sequencer_stats_reset(struct sequencer *s) {
+    memset(&s->stats, 0, sizeof(s->stats));
+    s->stats.min_free_steps = s->step_pool.nb_free;
+    s->stats.min_free_patterns = s->pattern_pool.nb_free;
+}
+static inline uint32_t sequencer_stats_free_steps(struct sequencer *s) {
+    return s->step_pool.nb_free;
+}
+static inline uint32_t sequencer_stats_free_patterns(struct sequencer *s) {
+    return s->pattern_pool.nb_free;
+}
+static inline uint32_t sequencer_stats_timer_nb(struct sequencer *s) {
+    return sequencer_timer_nb(&s->timer);
+}
+static inline void sequencer_init_(struct sequencer *s, sequencer_fn dispatch) {
     s->cursor.pattern = PATTERN_NONE;
+    for (int i = 0; i < SEQUENCER_DUE_HASH; i++) {
+        s->due_leader[i] = PATTERN_NONE;
+    }
     s->dispatch = dispatch;
-    s->swtimer.arr = s->swtimer_element;
+    sequencer_timer_init(&s->timer);
     step_pool_init(&s->step_pool);
     pattern_pool_init(&s->pattern_pool);
+    sequencer_stats_reset(s);
+}
+#ifdef SEQUENCER_POOL_ARENA
+/* Arena size needed for the given capacities, including alignment. */
+static inline uintptr_t sequencer_arena_bytes(uint32_t nb_steps, uint32_t nb_patterns) {
+    return nb_steps * sizeof(struct pattern_step)
+        + nb_patterns * sizeof(struct pattern_phase)
+        + SEQUENCER_TIMER_BYTES(nb_patterns)
+        + nb_steps * (sizeof(step_t) + sizeof(pattern_t))
+        + 6 * 8;
+}
+/* The pools are never returned to the arena. */
+void sequencer_init(struct sequencer *s, sequencer_fn dispatch,
+                    struct sequencer_arena *a,
+                    uint32_t nb_steps, uint32_t nb_patterns) {
+    memset(s,0,sizeof(*s));
+    s->step_pool.nb = nb_steps;
+    s->step_pool.step =
+        sequencer_arena_alloc(a, nb_steps * sizeof(struct pattern_step));
+    s->pattern_pool.nb = nb_patterns;
+    s->pattern_pool.pattern =
+        sequencer_arena_alloc(a, nb_patterns * sizeof(struct pattern_phase));
+    sequencer_timer_alloc(&s->timer, a, nb_patterns);
+    s->step_pool.prev = sequencer_arena_alloc(a, nb_steps * sizeof(step_t));
+    s->step_pool.owner = sequencer_arena_alloc(a, nb_steps * sizeof(pattern_t));
+    memset(s->step_pool.owner, 0xFF, nb_steps * sizeof(pattern_t)); // PATTERN_NONE
+    sequencer_init_(s, dispatch);
+    s->compact.gen = s->step_pool.gen;
+}
+#else
+void sequencer_init(struct sequencer *s, sequencer_fn dispatch) {
+    memset(s,0,sizeof(*s));
+    s->step_pool.nb = STEP_POOL_SIZE;
+    s->pattern_pool.nb = PATTERN_POOL_SIZE;
+    sequencer_init_(s, dispatch);
+}
+#endif
+static inline dtime_t sequencer_now(struct sequencer *s) {
+    return sequencer_timer_now(&s->timer);
+}
+/* Give the group led by p a timer entry of its own. */
+static inline void sequencer_group_schedule_(struct sequencer *s, dtime_t delay, pattern_t p) {
+    sequencer_pattern(s, p)->lead = 1;
+    s->due_leader[(dtime_t)(sequencer_now(s) + delay) % SEQUENCER_DUE_HASH] = p;
+    sequencer_timer_schedule(&s->timer, delay, p);
+}
+/* Leader of a group that is due at time due, or PATTERN_NONE.  The
+   group's timer entry has not fired yet, as that clears lead. */
+static inline pattern_t sequencer_group_find_(struct sequencer *s, dtime_t due) {
+    pattern_t p = s->due_leader[due % SEQUENCER_DUE_HASH];
+    if (p >= s->pattern_pool.nb) return PATTERN_NONE;
+    struct pattern_phase *pp = sequencer_pattern(s, p);
+    if (!pp->lead || (pp->due != due) ||
+        (pattern_phase_used != pattern_phase_lifecycle(pp))) {
+        return PATTERN_NONE;
+    }
+    return p;
+}
+/* Insert the list first .. last right after in_group, which makes
+   this safe to use while the group is being dispatched. */
+static inline void sequencer_group_splice_(struct sequencer *s, pattern_t in_group,
+                                           pattern_t first, pattern_t last) {
+    struct pattern_phase *pg = sequencer_pattern(s, in_group);
+    sequencer_pattern(s, last)->group_next = pg->group_next;
+    pg->group_next = first;
+}
+/* Add an unscheduled pattern to the group of a scheduled pattern.
+   The delay should put it at the group's due time, as a member that
+   is due later is only split off at the group's next tick. */
+static inline void sequencer_group_join(struct sequencer *s, pattern_t in_group,
+                                        dtime_t delay, pattern_t p) {
+    sequencer_pattern(s, p)->due = sequencer_now(s) + delay;
+    sequencer_group_splice_(s, in_group, p, p);
+}
+/* Schedule a pattern.  It joins a group that is due at the same
+   time, or starts a new group of one. */
+static inline void sequencer_schedule(struct sequencer *s, dtime_t delay, pattern_t p) {
+    struct pattern_phase *pp = sequencer_pattern(s, p);
+    pattern_t g = sequencer_group_find_(s, sequencer_now(s) + delay);
+    if (g != PATTERN_NONE) {
+        sequencer_group_join(s, g, delay, p);
+        return;
+    }
+    pp->group_next = PATTERN_NONE;
+    pp->due = sequencer_now(s) + delay;
+    sequencer_group_schedule_(s, delay, p);
 }
 static inline int sequencer_recording(struct sequencer *s) {
     return s->cursor.pattern != PATTERN_NONE;
@@ -353,7 +891,11 @@ void sequencer_seq_cmd(struct sequencer *s,
                until recording is turned off.  This is implemented by
                recording a new loop if the previous one had events, or
                by reusing the current empty loop. */
-            if (sequencer_pattern_is_empty(s, pattern_nb)) {
+            if (s->cursor.rec_overdub) {
+                /* Keep merging into the same pattern. */
+                s->cursor.delay = 0;
+            }
+            else if (sequencer_pattern_is_empty(s, pattern_nb)) {
                 /* Using the precondition that the cursor always
                    contains a header step, we know this is otherwise
                    empty, so re-use this pattern for the next loop. */
@@ -379,95 +921,453 @@ void sequencer_seq_cmd(struct sequencer *s,
 }
 
 
-void sequencer_tick(struct sequencer *s) {
-    int logged = 0;
-    for(;;) {
-        if (s->swtimer.nb == 0) {
-            // LOG("no more swtimer events\n");
+#ifdef SEQUENCER_POOL_ARENA
+/* Incremental step pool compactor.  Steps are allocated from the free
+   list, so after a while of recording and clearing, the steps of a
+   pattern end up scattered over the pool.  The compactor moves the
+   steps of each pattern to a contiguous run of indices in playback
+   order, so the tick and the iterators walk memory linearly.
+
+   A pass walks the patterns and swaps each step into place, using
+   the predecessor and owner maps in the step pool.  Each call
+   performs at most budget units of work, where a unit is one slot or
+   one step, so it can run from sequencer_tick() or, while stopped,
+   from the idle period.  Edits keep the maps up to date, so a pass
+   is not restarted by them.  Added steps are picked up by the walk or
+   by the next pass.  An edit that removes or reorders the steps of
+   the pattern that is being moved only restarts that pattern's run.
+   Once a pass is complete, the compactor stays idle until the next
+   change.  The maps are only rebuilt from scratch after a snapshot
+   load. */
+
+/* Exchange two step slots, relinking every reference. */
+static inline void sequencer_compact_swap_(struct sequencer *s, step_t a, step_t b) {
+    struct sequencer_compact *c = &s->compact;
+    struct step_pool *sp = &s->step_pool;
+#define SWAP_(x) ((x) == a ? b : ((x) == b ? a : (x)))
+    step_t pa = sp->prev[a], pb = sp->prev[b];
+    pattern_t oa = sp->owner[a], ob = sp->owner[b];
+    struct pattern_step tmp = sp->step[a];
+    sp->step[a] = sp->step[b];
+    sp->step[b] = tmp;
+    sp->owner[a] = ob;
+    sp->owner[b] = oa;
+    /* References into the two slots: the predecessors' links, the
+       free list head, and the play head and last step of the
+       owning patterns. */
+    if (pa != STEP_NONE) { step_t *n = &sp->step[SWAP_(pa)].next; *n = SWAP_(*n); }
+    if (pb != STEP_NONE) { step_t *n = &sp->step[SWAP_(pb)].next; *n = SWAP_(*n); }
+    if (sp->free != STEP_NONE) sp->free = SWAP_(sp->free);
+    pattern_t owner[] = { oa, (ob != oa) ? ob : PATTERN_NONE };
+    for (int i = 0; i < 2; i++) {
+        if (owner[i] == PATTERN_NONE) continue;
+        /* A stale owner can be on the free list, where head is a
+           link. */
+        struct pattern_phase *pp = sequencer_pattern(s, owner[i]);
+        if (pattern_phase_used != pattern_phase_lifecycle(pp)) continue;
+        pp->head = SWAP_(pp->head);
+        pp->last = SWAP_(pp->last);
+    }
+    sp->prev[a] = (pb == STEP_NONE) ? STEP_NONE : SWAP_(pb);
+    sp->prev[b] = (pa == STEP_NONE) ? STEP_NONE : SWAP_(pa);
+    step_pool_relink_(sp, a);
+    step_pool_relink_(sp, b);
+#undef SWAP_
+    c->nb_moves++;
+}
+void sequencer_compact(struct sequencer *s, uint32_t budget) {
+    struct sequencer_compact *c = &s->compact;
+    struct step_pool *sp = &s->step_pool;
+    while (budget > 0) {
+        switch(c->phase) {
+        case sequencer_compact_idle:
+            if (c->gen == sp->gen) return;
+            c->phase = sequencer_compact_move;
+            c->i = 0;
+            c->step = STEP_NONE;
+            c->dst = 0;
+            c->gen = sp->gen;
+            break;
+        case sequencer_compact_clear:
+            for (; (budget > 0) && (c->i < sp->nb); budget--, c->i++) {
+                sp->prev[c->i] = STEP_NONE;
+                sp->owner[c->i] = PATTERN_NONE;
+            }
+            if (c->i == sp->nb) {
+                c->phase = sequencer_compact_link;
+                c->i = 0;
+            }
+            break;
+        case sequencer_compact_link:
+            for (; (budget > 0) && (c->i < sp->nb); budget--, c->i++) {
+                step_pool_relink_(sp, c->i);
+            }
+            if (c->i == sp->nb) {
+                c->phase = sequencer_compact_owner;
+                c->i = 0;
+                c->step = STEP_NONE;
+            }
+            break;
+        case sequencer_compact_owner:
+        case sequencer_compact_move: {
+            if (c->i == s->pattern_pool.nb) {
+                if (c->phase == sequencer_compact_owner) {
+                    c->phase = sequencer_compact_move;
+                    c->i = 0;
+                    c->step = STEP_NONE;
+                    c->dst = 0;
+                    c->gen = sp->gen;
+                }
+                else {
+                    c->phase = sequencer_compact_idle;
+                    c->nb_passes++;
+                }
+                break;
+            }
+            budget--;
+            struct pattern_phase *pp = sequencer_pattern(s, c->i);
+            if (pattern_phase_used != pattern_phase_lifecycle(pp)) {
+                c->i++;
+                break;
+            }
+            if (c->step == STEP_NONE) {
+                c->step = sequencer_step(s, pp->last)->next;
+                c->run = c->dst;
+            }
+            step_t step = c->step;
+            if (c->phase == sequencer_compact_move) {
+                if (c->dst == sp->nb) {
+                    /* Steps freed earlier in the pass were reused by
+                       the patterns that follow.  Leave them to the
+                       next pass. */
+                    c->phase = sequencer_compact_idle;
+                    break;
+                }
+                if (step != c->dst) {
+                    sequencer_compact_swap_(s, c->dst, step);
+                }
+                step = c->dst++;
+            }
+            else {
+                sp->owner[step] = c->i;
+            }
+            if (step == pp->last) {
+                c->i++;
+                c->step = STEP_NONE;
+            }
+            else {
+                c->step = sequencer_step(s, step)->next;
+            }
             break;
         }
-        swtimer_element_t next = swtimer_peek(&s->swtimer);
-        if (next.time_abs != s->swtimer.now_abs) break;
-        if (!logged) {
-            if (s->verbose) { LOG("tick time=%d\n", s->swtimer.now_abs); };
-            logged = 1;
         }
-        swtimer_pop(&s->swtimer);
-        /* The tag refers to the pattern number, which can be obtained
-           to store the next step in the sequence. */
-        pattern_t pattern_nb = next.tag;
+    }
+}
+/* Steps of pattern p were removed or reordered.  If it is being
+   walked, walk it again from the start of its run. */
+static inline void sequencer_compact_touch_(struct sequencer *s, pattern_t p) {
+    struct sequencer_compact *c = &s->compact;
+    if ((c->i != p) || (c->step == STEP_NONE)) return;
+    if ((c->phase == sequencer_compact_owner) ||
+        (c->phase == sequencer_compact_move)) {
+        c->step = STEP_NONE;
+        c->dst = c->run;
+    }
+}
+/* Bring the maps up to date with a pattern whose links were edited
+   in more places than one. */
+static inline void sequencer_compact_relink_(struct sequencer *s, pattern_t p) {
+    struct step_pool *sp = &s->step_pool;
+    struct pattern_phase *pp = sequencer_pattern(s, p);
+    step_t step = pp->last;
+    for (uint32_t i = 0; i < pp->nb_steps; i++) {
+        step_pool_relink_(sp, step);
+        step_pool_own_(sp, step, p);
+        step = sp->step[step].next;
+    }
+    sequencer_compact_touch_(s, p);
+}
+#else
+static inline void sequencer_compact_touch_(struct sequencer *s, pattern_t p) { }
+static inline void sequencer_compact_relink_(struct sequencer *s, pattern_t p) { }
+#endif
+
+/* Dispatch all events in a pattern that happen at this time instance.
+   Returns the delay to the next step. */
+static inline dtime_t sequencer_pattern_dispatch(struct sequencer *s, pattern_t pattern_nb,
+                                                 struct pattern_phase *pp) {
+    step_t step = pp->head;
+    uint32_t chain = 1;
+    uint32_t groove_pos = pp->groove_pos;
+    for(;;) {
+        if (s->verbose) { LOG("step %d\n", step); }
+        const struct pattern_step *ps = sequencer_step(s, step);
+        const uint8_t *u8 = ps->event.u8;
+        if (PAT_SEQ_CMD == u8[0]) {
+            /* Handle internal sequencer events. */
+            sequencer_seq_cmd(s, pattern_nb, ps);
+        }
+        else {
+            /* All the rest is user-defined.  Individual
+               patterns can be muted. */
+            if (!pp->mute) {
+                s->pattern = pattern_nb;
+                s->groove_slot = pp->groove * SEQUENCER_GROOVE_SLOTS +
+                    groove_pos / SEQUENCER_GROOVE_TICKS;
+                s->dispatch(s, &ps->event);
+                s->stats.tick_events++;
+            }
+        }
+        /* The step after the last one is at the start of the loop. */
+        groove_pos = (step == pp->last) ? 0 :
+            (groove_pos + ps->delay) % SEQUENCER_GROOVE_PERIOD;
+        if (ps->delay > 0) {
+            /* Next event is in the future. */
+            pp->head = ps->next;
+            pp->groove_pos = groove_pos;
+            if (chain > s->stats.max_chain) s->stats.max_chain = chain;
+            return ps->delay;
+        }
+        else {
+            /* Next event has the same timestamp. */
+            ASSERT(step != ps->next);
+            step = ps->next;
+            chain++;
+            continue;
+        }
+    }
+}
+
+/* Handle a group's timer entry: dispatch the patterns, collect dead
+   patterns and reschedule.  The members are due at the timer entry,
+   except for those that were moved to a later step by a transform,
+   which are skipped.  Members that are due at different times after
+   this step are split into separate groups, so no member is visited
+   when it has nothing to play.  A split that is due at the same time
+   as another group joins it, so patterns that meet again, e.g. at
+   the start of each loop pass, share a timer entry again. */
+static inline void sequencer_group_tick(struct sequencer *s, pattern_t first) {
+    dtime_t now = sequencer_now(s);
+    sequencer_pattern(s, first)->lead = 0;
+    pattern_t prev = PATTERN_NONE;
+    pattern_t pattern_nb = first;
+    while (pattern_nb != PATTERN_NONE) {
         if (s->verbose) { LOG("pattern %d\n", pattern_nb); }
-        ASSERT(pattern_nb < PATTERN_POOL_SIZE);
         struct pattern_phase *pp = sequencer_pattern(s, pattern_nb);
-        step_t step = pp->head;
-
         switch(pattern_phase_lifecycle(pp)) {
-        case pattern_phase_dead:
+        case pattern_phase_dead: {
             /* This pattern is an empty shell left over by
-               sequencer_drop_pattern(). We collect it here */
+               sequencer_clear_pattern(). We collect it here */
             ASSERT(pp->last == STEP_DEAD);
             LOG("collecting pattern_nb %d\n", pattern_nb);
+            pattern_t next = pp->group_next;
+            if (prev == PATTERN_NONE) {
+                first = next;
+            }
+            else {
+                sequencer_pattern(s, prev)->group_next = next;
+            }
             sequencer_pattern_free(s, pattern_nb);
-            break;
+            pattern_nb = next;
+            continue;
+        }
         case pattern_phase_used:
-            /* Dispatch all events in this pattern that happen at this
-               time instance. */
-            for(;;) {
-                if (s->verbose) { LOG("step %d\n", step); }
-                const struct pattern_step *ps = sequencer_step(s, step);
-                const uint8_t *u8 = ps->event.u8;
-                if (PAT_SEQ_CMD == u8[0]) {
-                    /* Handle internal sequencer events. */
-                    sequencer_seq_cmd(s, pattern_nb, ps);
-                }
-                else {
-                    /* All the rest is user-defined.  Individual
-                       patterns can be muted. */
-                    if (!pp->mute) {
-                        s->dispatch(s, &ps->event);
-                    }
-                }
-                if (ps->delay > 0) {
-                    /* Next event is in the future. */
-                    pp->head = ps->next;
-                    swtimer_schedule(&s->swtimer, ps->delay, pattern_nb);
-                    break;
-                }
-                else {
-                    /* Next event has the same timestamp. */
-                    ASSERT(step != ps->next);
-                    step = ps->next;
-                    continue;
-                }
+            if (pp->due == now) {
+                pp->due = now + sequencer_pattern_dispatch(s, pattern_nb, pp);
             }
             break;
         case pattern_phase_unused:
             ERROR("unused pattern found in timer heap\n");
             break;
         }
+        prev = pattern_nb;
+        pattern_nb = pp->group_next;
+    }
+    /* Split by due time.  Usually there is only one.  The first
+       member of each split leads it, the others keep their order. */
+    while (first != PATTERN_NONE) {
+        pattern_t leader = first;
+        pattern_t last = leader;
+        dtime_t due = sequencer_pattern(s, leader)->due;
+        pattern_t *rest = &first;
+        for (pattern_nb = sequencer_pattern(s, leader)->group_next;
+             pattern_nb != PATTERN_NONE; ) {
+            struct pattern_phase *pp = sequencer_pattern(s, pattern_nb);
+            pattern_t next = pp->group_next;
+            if (pp->due == due) {
+                sequencer_pattern(s, last)->group_next = pattern_nb;
+                last = pattern_nb;
+            }
+            else {
+                *rest = pattern_nb;
+                rest = &pp->group_next;
+            }
+            pattern_nb = next;
+        }
+        sequencer_pattern(s, last)->group_next = PATTERN_NONE;
+        *rest = PATTERN_NONE;
+        /* Members of this group don't lead, so g is never one of
+           them. */
+        pattern_t g = sequencer_group_find_(s, due);
+        if (g != PATTERN_NONE) {
+            sequencer_group_splice_(s, g, leader, last);
+        }
+        else {
+            sequencer_group_schedule_(s, due - now, leader);
+        }
+    }
+}
+
+void sequencer_tick(struct sequencer *s) {
+    int logged = 0;
+    for(;;) {
+        /* The timer stores the number of the first pattern in a
+           group, which can be used to obtain the next step in the
+           sequence of each pattern. */
+        pattern_t pattern_nb = sequencer_timer_pop(&s->timer);
+        if (pattern_nb == PATTERN_NONE) break;
+        if (!logged) {
+            if (s->verbose) { LOG("tick time=%d\n", sequencer_timer_now(&s->timer)); };
+            logged = 1;
+        }
+        sequencer_group_tick(s, pattern_nb);
     }
-    /* Software timer uses 16 bit circular time, which at 120bpm is
-       about 22 minutes.  This is the maximum time between steps, and
-       the maximum total time of a live recorded pattern. */
-    s->swtimer.now_abs++;
+#ifdef SEQUENCER_POOL_ARENA
+    if (s->compact.budget) {
+        sequencer_compact(s, s->compact.budget);
+    }
+#endif
+    struct sequencer_stats *st = &s->stats;
+    uint32_t nb = st->tick_events;
+    st->tick_events = 0;
+    st->nb_ticks++;
+    st->nb_events += nb;
+    if (nb > st->max_events) st->max_events = nb;
+    uint32_t bucket = nb ? 32 - __builtin_clz(nb) : 0;
+    if (bucket >= SEQUENCER_STATS_HIST) bucket = SEQUENCER_STATS_HIST - 1;
+    st->events_hist[bucket]++;
+    uint32_t timer_nb = sequencer_timer_nb(&s->timer);
+    if (timer_nb > st->max_timer_nb) st->max_timer_nb = timer_nb;
+    /* Timer delays are 16 bit, which at 120bpm is about 22 minutes.
+       This is the maximum time between steps, and the maximum total
+       time of a live recorded pattern. */
+    sequencer_timer_advance(&s->timer, 1);
     /* Accumulate the inter-step delay for live recording.*/
     s->cursor.delay++;
     /* Keep track of global time.  This is for debugging only.  The 32
        bits can accomodate a bit less than 3 years at 120bpm. */
     s->time++;
 }
+
+/* Number of ticks that can be skipped before the next timer deadline
+   is due, clipped to max.  During these ticks sequencer_tick() would
+   only advance time. */
+static inline uintptr_t sequencer_idle_ticks(struct sequencer *s, uintptr_t max) {
+    return sequencer_timer_idle(&s->timer, max);
+}
+/* Same time bookkeeping as the end of sequencer_tick(), n times. */
+static inline void sequencer_skip(struct sequencer *s, uintptr_t n) {
+    sequencer_timer_advance(&s->timer, n);
+    s->cursor.delay += n;
+    s->time += n;
+}
 void sequencer_ntick(struct sequencer *s, uintptr_t n) {
-    while(n--) sequencer_tick(s);
+    while(n) {
+        uintptr_t idle = sequencer_idle_ticks(s, n);
+        sequencer_skip(s, idle);
+        n -= idle;
+        if (n) {
+            sequencer_tick(s);
+            n--;
+        }
+    }
+}
+
+/* Offline rendering.  Runs the sequencer for at most n ticks, jumping
+   straight to the next timer deadline, and collects the dispatched
+   events in r->buf, stamped with s->time.  Rendering stops early when
+   the buffer is close to full (see r->reserve), so the caller can
+   flush it and call again.  Returns the number of ticks that were
+   rendered. */
+static void sequencer_render_dispatch(struct sequencer *s, const union pattern_event *ev) {
+    struct sequencer_render *r = s->render;
+    if (r->nb < r->size) {
+        struct sequencer_event *e = &r->buf[r->nb++];
+        e->time = s->time;
+        e->event = *ev;
+    }
+    else {
+        r->nb_drop++;
+    }
+}
+uintptr_t sequencer_render(struct sequencer *s, struct sequencer_render *r, uintptr_t n) {
+    sequencer_fn dispatch = s->dispatch;
+    s->dispatch = sequencer_render_dispatch;
+    s->render = r;
+    uintptr_t reserve = r->reserve ? r->reserve : 1;
+    uintptr_t done = 0;
+    while((done < n) && (r->nb + reserve <= r->size)) {
+        uintptr_t idle = sequencer_idle_ticks(s, n - done);
+        sequencer_skip(s, idle);
+        done += idle;
+        if (done < n) {
+            sequencer_tick(s);
+            done++;
+        }
+    }
+    s->dispatch = dispatch;
+    s->render = NULL;
+    return done;
+}
+
+/* Loop length of a used pattern. */
+static inline uint32_t sequencer_pattern_length(struct sequencer *s, pattern_t p) {
+    return sequencer_pattern(s, p)->length;
+}
+/* Sort a list linked through group_next by due, keeping the order of
+   patterns with the same due.  Merge sort needs no extra storage. */
+static pattern_t sequencer_sort_by_due_(struct sequencer *s, pattern_t list) {
+    if ((list == PATTERN_NONE) ||
+        (sequencer_pattern(s, list)->group_next == PATTERN_NONE)) return list;
+    /* Split in halves. */
+    pattern_t slow = list, fast = sequencer_pattern(s, list)->group_next;
+    while (fast != PATTERN_NONE) {
+        fast = sequencer_pattern(s, fast)->group_next;
+        if (fast == PATTERN_NONE) break;
+        fast = sequencer_pattern(s, fast)->group_next;
+        slow = sequencer_pattern(s, slow)->group_next;
+    }
+    pattern_t b = sequencer_pattern(s, slow)->group_next;
+    sequencer_pattern(s, slow)->group_next = PATTERN_NONE;
+    pattern_t a = sequencer_sort_by_due_(s, list);
+    b = sequencer_sort_by_due_(s, b);
+    /* Merge. */
+    pattern_t sorted = PATTERN_NONE;
+    pattern_t *tail = &sorted;
+    while ((a != PATTERN_NONE) && (b != PATTERN_NONE)) {
+        struct pattern_phase *pa = sequencer_pattern(s, a);
+        struct pattern_phase *pb = sequencer_pattern(s, b);
+        if (pb->due < pa->due) { *tail = b; tail = &pb->group_next; b = pb->group_next; }
+        else                   { *tail = a; tail = &pa->group_next; a = pa->group_next; }
+    }
+    *tail = (a != PATTERN_NONE) ? a : b;
+    return sorted;
 }
 
 /* Clear timer and restart all loops from the beginning. */
 // FIXME: Can be used for full (offline) reload as well.
 void sequencer_restart(struct sequencer *s) {
 
-    swtimer_reset(&s->swtimer);
-    for(int pattern_nb=0; pattern_nb<PATTERN_POOL_SIZE; pattern_nb++) {
+    sequencer_timer_reset(&s->timer);
+    pattern_t nb_patterns = s->pattern_pool.nb;
+    /* Rewind.  Until a pattern is grouped, group_next links the used
+       patterns in order and due holds the loop length. */
+    pattern_t used = PATTERN_NONE;
+    pattern_t *tail = &used;
+    for(pattern_t pattern_nb=0; pattern_nb<nb_patterns; pattern_nb++) {
         struct pattern_phase *pp = sequencer_pattern(s, pattern_nb);
         step_t last_step = pp->last;
+        pp->lead = 0;
         switch(pattern_phase_lifecycle(pp)) {
         case pattern_phase_dead:
             LOG("collecting pattern_nb %d\n", pattern_nb);
@@ -478,13 +1378,40 @@ void sequencer_restart(struct sequencer *s) {
             step_t first_step = plast->next;
             ASSERT(first_step != STEP_NONE);
             pp->head = first_step;
-            swtimer_schedule(&s->swtimer, 0, pattern_nb);
+            pp->groove_pos = 0;
+            /* Lengths that do not fit are not merged. */
+            uint32_t len = sequencer_pattern_length(s, pattern_nb);
+            pp->due = len < 0xFFFF ? len : 0xFFFF;
+            *tail = pattern_nb;
+            tail = &pp->group_next;
             break;
             }
         case pattern_phase_unused:
             break;
         }
     }
+    *tail = PATTERN_NONE;
+    /* All patterns start in phase, so patterns of the same length can
+       share a timer entry for as long as their steps line up.  Sorted
+       by length, each run of the same length is a group, led by the
+       first pattern of that length. */
+    used = sequencer_sort_by_due_(s, used);
+    dtime_t now = sequencer_now(s);
+    while (used != PATTERN_NONE) {
+        pattern_t leader = used;
+        pattern_t last = leader;
+        dtime_t len = sequencer_pattern(s, leader)->due;
+        used = sequencer_pattern(s, leader)->group_next;
+        while ((len != 0xFFFF) && (used != PATTERN_NONE) &&
+               (sequencer_pattern(s, used)->due == len)) {
+            sequencer_pattern(s, used)->due = now;
+            last = used;
+            used = sequencer_pattern(s, used)->group_next;
+        }
+        sequencer_pattern(s, last)->group_next = PATTERN_NONE;
+        sequencer_pattern(s, leader)->due = now;
+        sequencer_group_schedule_(s, 0, leader);
+    }
 }
 
 /* Expose internal structure as iterators.  Originally written to
@@ -502,7 +1429,7 @@ struct sequencer_pattern_iterator {
 };
 #define FOR_SEQUENCER_PATTERNS(s, i)                              \
     for(struct sequencer_pattern_iterator i = { .sequencer = s }; \
-        i.pattern_nb < PATTERN_POOL_SIZE; \
+        i.pattern_nb < (s)->pattern_pool.nb; \
         i.pattern_nb++)
 
 struct sequencer_step_iterator {
@@ -537,11 +1464,111 @@ void sequencer_step_iterator_next(struct sequencer_step_iterator *i) {
         sequencer_step_iterator_next(&i))
 
 
-/* FIXME: Create a function that checks the main invariants:
-   - the timer heap should not contain duplicate references
-   - each allocated pattern should be referenced in the timer heap
-   - a pattern can be empty, which indicates it should be deleted */
+/* Check the main invariants, for tests and fuzzing.  Fails with
+   ASSERT.  Cost is linear in the size of the pools.
+   - free lists match their counts
+   - the timer has no duplicate references, and refers to group
+     leaders only, which are the patterns that have lead set
+   - each allocated pattern is in exactly one group, including empty
+     (dead) patterns, which are collected by their group's next tick
+   - each used pattern's cycle has nb_steps steps, adds up to its
+     length and contains the play head, and all steps are accounted
+     for
+   - the compactor's predecessor and owner maps match the links */
+static void sequencer_check_group_(void *ctx, pattern_t leader) {
+    struct sequencer *s = ctx;
+    ASSERT(leader < s->pattern_pool.nb);
+    ASSERT(sequencer_pattern(s, leader)->lead);
+    uint32_t n = 0;
+    for (pattern_t p = leader; p != PATTERN_NONE; p = sequencer_pattern(s, p)->group_next) {
+        ASSERT(n++ < s->pattern_pool.nb);
+        struct pattern_phase *pp = sequencer_pattern(s, p);
+        ASSERT(!pp->mark);
+        ASSERT(pattern_phase_unused != pattern_phase_lifecycle(pp));
+        pp->mark = 1;
+    }
+}
 void sequencer_check_invariants(struct sequencer *s) {
+    struct pattern_pool *pool = &s->pattern_pool;
+    struct step_pool *sp = &s->step_pool;
+
+    uint32_t n = 0;
+    for (pattern_t p = pool->free; p != PATTERN_NONE; p = pool->pattern[p].head) {
+        ASSERT(n++ < pool->nb);
+        ASSERT(pattern_phase_unused == pattern_phase_lifecycle(&pool->pattern[p]));
+    }
+    ASSERT(n == pool->nb_free);
+    n = 0;
+    for (step_t i = sp->free; i != STEP_NONE; i = sp->step[i].next) {
+        ASSERT(n++ < sp->nb);
+    }
+    ASSERT(n == sp->nb_free);
+
+    for (pattern_t p = 0; p < pool->nb; p++) pool->pattern[p].mark = 0;
+    sequencer_timer_foreach(&s->timer, sequencer_check_group_, s);
+
+    uint32_t nb_used_steps = 0, nb_lead = 0;
+    for (pattern_t p = 0; p < pool->nb; p++) {
+        struct pattern_phase *pp = &pool->pattern[p];
+        if (pattern_phase_unused != pattern_phase_lifecycle(pp)) nb_lead += pp->lead;
+        switch (pattern_phase_lifecycle(pp)) {
+        case pattern_phase_unused:
+            ASSERT(!pp->mark);
+            break;
+        case pattern_phase_dead:
+            ASSERT(pp->mark);
+            ASSERT(pp->nb_steps == 0);
+            break;
+        case pattern_phase_used: {
+            ASSERT(pp->mark);
+            step_t first = sequencer_step(s, pp->last)->next;
+            step_t i = first;
+            int head = 0;
+            uint32_t length = 0;
+            n = 0;
+            do {
+                ASSERT(n++ < pp->nb_steps);
+                head |= (i == pp->head);
+                length += sequencer_step(s, i)->delay;
+                i = sequencer_step(s, i)->next;
+            } while (i != first);
+            ASSERT(n == pp->nb_steps);
+            ASSERT(length == pp->length);
+            ASSERT(head);
+            nb_used_steps += n;
+            break;
+        }
+        }
+        pp->mark = 0;
+    }
+    ASSERT(nb_used_steps + sp->nb_free == sp->nb);
+    ASSERT(nb_lead == sequencer_timer_nb(&s->timer));
+
+#ifdef SEQUENCER_POOL_ARENA
+    /* Outside of a rebuild, the compactor maps match the links. */
+    if ((s->compact.phase == sequencer_compact_idle) ||
+        (s->compact.phase == sequencer_compact_move)) {
+        if (sp->free != STEP_NONE) ASSERT(sp->prev[sp->free] == STEP_NONE);
+        for (pattern_t p = 0; p < pool->nb; p++) {
+            struct pattern_phase *pp = &pool->pattern[p];
+            if (pattern_phase_used != pattern_phase_lifecycle(pp)) continue;
+            step_t i = pp->last;
+            for (uint32_t k = 0; k < pp->nb_steps; k++) {
+                ASSERT(sp->owner[i] == p);
+                ASSERT(sp->prev[sp->step[i].next] == i);
+                i = sp->step[i].next;
+            }
+        }
+        for (step_t i = sp->free; i != STEP_NONE; i = sp->step[i].next) {
+            if (sp->step[i].next != STEP_NONE) ASSERT(sp->prev[sp->step[i].next] == i);
+        }
+    }
+#endif
+
+    if (s->cursor.pattern != PATTERN_NONE) {
+        ASSERT(pattern_phase_used ==
+               pattern_phase_lifecycle(sequencer_pattern(s, s->cursor.pattern)));
+    }
 }
 
 
@@ -552,6 +1579,11 @@ void sequencer_add_step_event(struct sequencer *s, pattern_t pat_nb,
     struct pattern_step *pstep = sequencer_step(s, step);
     struct pattern_phase *pp = sequencer_pattern(s, pat_nb);
     step_t last = pp->last;
+    pp->nb_steps++;
+    pp->length += delay;
+    if (s->step_pool.nb_free < s->stats.min_free_steps) {
+        s->stats.min_free_steps = s->step_pool.nb_free;
+    }
 
     if (last == STEP_NONE) {
         /* If pattern is empty, create a loop of 1 step. */
@@ -559,7 +1591,7 @@ void sequencer_add_step_event(struct sequencer *s, pattern_t pat_nb,
         /* Link it into the current pattern. */
         pp->last = step;
         pp->head = step;
-        LOG("pat %d first step %d\n", pat_nb, step);
+        if (s->verbose) { LOG("pat %d first step %d\n", pat_nb, step); }
     }
     else {
         /* There is at least one step.  Add the new step at the end of
@@ -569,8 +1601,11 @@ void sequencer_add_step_event(struct sequencer *s, pattern_t pat_nb,
         pstep->next = first; // new step followed by first
         plast->next = step; // last step followed by new step
         pp->last = step; // new step is now last step
-        LOG("pat %d next step %d after %d\n", pat_nb, step, last);
+        step_pool_relink_(&s->step_pool, last);
+        if (s->verbose) { LOG("pat %d next step %d after %d\n", pat_nb, step, last); }
     }
+    step_pool_relink_(&s->step_pool, step);
+    step_pool_own_(&s->step_pool, step, pat_nb);
 }
 void sequencer_add_step_cv(struct sequencer *s, pattern_t pat_nb,
                            uint8_t chan, uint16_t val, dtime_t delay) {
@@ -582,26 +1617,571 @@ void sequencer_add_step_cv(struct sequencer *s, pattern_t pat_nb,
 }
 
 
+/* Create and schedule a new pattern from an array of steps, e.g. one
+   that was prepared off the RT path.  The next field of the steps is
+   ignored.  This does not fail on out-of-memory, but returns
+   PATTERN_NONE leaving the sequencer untouched.  Cost is bounded by
+   nb_steps, so it can be called from the RT thread. */
+pattern_t sequencer_load_pattern(struct sequencer *s,
+                                 const struct pattern_step *step,
+                                 uintptr_t nb_steps) {
+    if ((nb_steps == 0) ||
+        (s->pattern_pool.free == PATTERN_NONE) ||
+        (!step_pool_has_free(&s->step_pool, nb_steps))) {
+        return PATTERN_NONE;
+    }
+    pattern_t pat_nb = sequencer_pattern_alloc(s);
+    for (uintptr_t i = 0; i < nb_steps; i++) {
+        sequencer_add_step_event(s, pat_nb, &step[i].event, step[i].delay);
+    }
+    sequencer_schedule(s, 0, pat_nb);
+    return pat_nb;
+}
+
+/* Snapshot of the full sequencer state as a flat binary image: a
+   header followed by the step pool and the pattern pool, including
+   free lists, play heads, mute flags and due times.  The scheduler is
+   not stored.  It is rebuilt from the pattern groups, so an image can
+   be loaded with either scheduler, into pools of the same or larger
+   capacity.  Byte order and struct layout are native: the image is
+   meant to be written and read back on the same host. */
+#define SEQUENCER_SNAPSHOT_MAGIC   0x53455153 /* "SEQS" */
+#define SEQUENCER_SNAPSHOT_VERSION 2
+struct sequencer_snapshot {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t nb_steps;
+    uint32_t nb_patterns;
+    uint64_t time;
+    uint16_t step_size;
+    uint16_t pattern_size;
+    step_t step_free;
+    pattern_t pattern_free;
+    /* Timer time the pattern due times refer to. */
+    dtime_t now;
+    pattern_t cursor_pattern;
+    dtime_t cursor_delay;
+    dtime_t cursor_duration;
+};
+CT_ASSERT(sequencer_snapshot_size, sizeof(struct sequencer_snapshot) == 40);
+
+static inline uintptr_t sequencer_snapshot_bytes(struct sequencer *s) {
+    return sizeof(struct sequencer_snapshot)
+        + s->step_pool.nb * sizeof(struct pattern_step)
+        + s->pattern_pool.nb * sizeof(struct pattern_phase);
+}
+/* Returns the size of the image, or 0 when buf is too small.  The
+   cost is a copy of both pools. */
+uintptr_t sequencer_snapshot_save(struct sequencer *s, void *buf, uintptr_t size) {
+    uintptr_t nb_bytes = sequencer_snapshot_bytes(s);
+    if (size < nb_bytes) return 0;
+    struct sequencer_snapshot *h = buf;
+    h->magic           = SEQUENCER_SNAPSHOT_MAGIC;
+    h->version         = SEQUENCER_SNAPSHOT_VERSION;
+    h->nb_steps        = s->step_pool.nb;
+    h->nb_patterns     = s->pattern_pool.nb;
+    h->time            = s->time;
+    h->step_size       = sizeof(struct pattern_step);
+    h->pattern_size    = sizeof(struct pattern_phase);
+    h->step_free       = s->step_pool.free;
+    h->pattern_free    = s->pattern_pool.free;
+    h->now             = sequencer_now(s);
+    h->cursor_pattern  = s->cursor.pattern;
+    h->cursor_delay    = s->cursor.delay;
+    h->cursor_duration = s->cursor.duration;
+    uint8_t *p = (uint8_t*)(h + 1);
+    uintptr_t steps_bytes = h->nb_steps * sizeof(struct pattern_step);
+    memcpy(p, s->step_pool.step, steps_bytes);
+    memcpy(p + steps_bytes, s->pattern_pool.pattern,
+           h->nb_patterns * sizeof(struct pattern_phase));
+    return nb_bytes;
+}
+/* Put the groups back into the timer.  The first pattern of a group
+   is the one that no other pattern links to.  Due times are moved
+   from the image's time base to the timer's. */
+static inline void sequencer_snapshot_schedule_(struct sequencer *s, dtime_t image_now) {
+    sequencer_timer_reset(&s->timer);
+    dtime_t now = sequencer_now(s);
+    FOR_SEQUENCER_PATTERNS(s, ip) {
+        struct pattern_phase *pp = sequencer_pattern(s, ip.pattern_nb);
+        pp->mark = 0;
+        pp->lead = 0;
+        pp->due = pp->due - image_now + now;
+    }
+    FOR_SEQUENCER_PATTERNS(s, ip) {
+        struct pattern_phase *pp = sequencer_pattern(s, ip.pattern_nb);
+        if ((pattern_phase_unused != pattern_phase_lifecycle(pp)) &&
+            (pp->group_next != PATTERN_NONE)) {
+            sequencer_pattern(s, pp->group_next)->mark = 1;
+        }
+    }
+    FOR_SEQUENCER_PATTERNS(s, ip) {
+        struct pattern_phase *pp = sequencer_pattern(s, ip.pattern_nb);
+        if ((pattern_phase_unused == pattern_phase_lifecycle(pp)) || pp->mark) continue;
+        /* Dead patterns only need to be collected. */
+        dtime_t wait_min = 0xFFFF;
+        int used = 0;
+        for (pattern_t p = ip.pattern_nb; p != PATTERN_NONE; p = sequencer_pattern(s, p)->group_next) {
+            struct pattern_phase *pm = sequencer_pattern(s, p);
+            if (pattern_phase_used != pattern_phase_lifecycle(pm)) continue;
+            dtime_t wait = pm->due - now;
+            if (wait < wait_min) wait_min = wait;
+            used = 1;
+        }
+        sequencer_group_schedule_(s, used ? wait_min : 0, ip.pattern_nb);
+    }
+}
+/* Check the structure of an image before it is loaded, so that a
+   corrupt image can't make the load or the sequencer index out of
+   range or loop forever.  Each index is bounds checked and each list
+   walk is bounded by the size of its pool.  Every step has to be on
+   exactly one step cycle or on the free list, and every pattern that
+   is not free in exactly one group.  Marks for the steps are kept in
+   mark, for the patterns in the mark bits of the pattern pool.
+   Returns 0 when the image is good. */
+static int sequencer_snapshot_check_(struct sequencer *s, const struct sequencer_snapshot *h,
+                                     uint16_t *mark) {
+    const struct pattern_step *step = (const void*)(h + 1);
+    const struct pattern_phase *pattern = (const void*)(step + h->nb_steps);
+    uint32_t nb_steps = h->nb_steps, nb_patterns = h->nb_patterns;
+    memset(mark, 0, nb_steps * sizeof(mark[0]));
+    for (uint32_t i = 0; i < nb_patterns; i++) sequencer_pattern(s, i)->mark = 0;
+    uint32_t nb_marked = 0, nb_free_patterns = 0;
+#define MARK_STEP_(i) \
+    if (((i) >= nb_steps) || mark[i]) return -1; \
+    mark[i] = 1; nb_marked++;
+
+    for (step_t i = h->step_free; i != STEP_NONE; i = step[i].next) {
+        MARK_STEP_(i);
+    }
+    for (pattern_t i = h->pattern_free; i != PATTERN_NONE; i = pattern[i].head) {
+        if ((i >= nb_patterns) || (nb_free_patterns++ == nb_patterns) ||
+            (pattern[i].last != STEP_NONE)) return -1;
+    }
+    for (uint32_t p = 0; p < nb_patterns; p++) {
+        const struct pattern_phase *pp = &pattern[p];
+        if (pp->last == STEP_NONE) {
+            nb_free_patterns--;
+            continue;
+        }
+        if (pp->group_next != PATTERN_NONE) {
+            /* At most one pattern links to each pattern. */
+            if ((pp->group_next >= nb_patterns) ||
+                (pattern[pp->group_next].last == STEP_NONE)) return -1;
+            struct pattern_phase *pg = sequencer_pattern(s, pp->group_next);
+            if (pg->mark) return -1;
+            pg->mark = 1;
+        }
+        if (pp->last == STEP_DEAD) {
+            if (pp->nb_steps != 0) return -1;
+            continue;
+        }
+        if ((pp->last >= nb_steps) || (pp->nb_steps == 0) ||
+            (pp->groove >= SEQUENCER_GROOVE_NB) ||
+            (pp->groove_pos >= SEQUENCER_GROOVE_PERIOD)) return -1;
+        /* The cycle closes at last after nb_steps steps. */
+        step_t first = step[pp->last].next;
+        step_t i = first;
+        uint32_t length = 0;
+        int head = 0;
+        for (uint32_t n = 0; n < pp->nb_steps; n++) {
+            MARK_STEP_(i);
+            length += step[i].delay;
+            head |= (i == pp->head);
+            if ((n + 1 == pp->nb_steps) != (i == pp->last)) return -1;
+            i = step[i].next;
+        }
+        if ((i != first) || !head || (length != pp->length)) return -1;
+    }
+#undef MARK_STEP_
+    if ((nb_marked != nb_steps) || (nb_free_patterns != 0)) return -1;
+    /* Groups are chains from an unmarked leader.  With at most one
+       link into each pattern, a chain can't run into a cycle, but a
+       cycle can exist on its own, out of reach of all leaders. */
+    uint32_t nb_grouped = 0, nb_in_use = 0;
+    for (uint32_t p = 0; p < nb_patterns; p++) {
+        if (pattern[p].last == STEP_NONE) continue;
+        nb_in_use++;
+        if (sequencer_pattern(s, p)->mark) continue;
+        for (pattern_t g = p; g != PATTERN_NONE; g = pattern[g].group_next) {
+            nb_grouped++;
+        }
+    }
+    for (uint32_t i = 0; i < nb_patterns; i++) sequencer_pattern(s, i)->mark = 0;
+    return (nb_grouped == nb_in_use) ? 0 : -1;
+}
+/* Replace the state of an initialized sequencer with an image.
+   Returns 0 on success, or -1 leaving the sequencer untouched when
+   the image is not compatible or not consistent.  A recording is not
+   restored: the cursor is closed and the pattern it was recording
+   plays on as a normal pattern. */
+int sequencer_snapshot_load(struct sequencer *s, const void *buf, uintptr_t size) {
+    const struct sequencer_snapshot *h = buf;
+    if (size < sizeof(*h)) return -1;
+    uintptr_t steps_bytes = h->nb_steps * sizeof(struct pattern_step);
+    uintptr_t patterns_bytes = h->nb_patterns * sizeof(struct pattern_phase);
+    if ((h->magic != SEQUENCER_SNAPSHOT_MAGIC) ||
+        (h->version != SEQUENCER_SNAPSHOT_VERSION) ||
+        (h->step_size != sizeof(struct pattern_step)) ||
+        (h->pattern_size != sizeof(struct pattern_phase)) ||
+        (h->nb_steps > s->step_pool.nb) ||
+        (h->nb_patterns > s->pattern_pool.nb) ||
+        (size < sizeof(*h) + steps_bytes + patterns_bytes)) {
+        return -1;
+    }
+#ifdef SEQUENCER_POOL_ARENA
+    /* The compactor's owner map is the scratch space for the check.
+       It is rebuilt from the links either way. */
+    int rv = sequencer_snapshot_check_(s, h, s->step_pool.owner);
+    s->compact.phase = sequencer_compact_clear;
+    s->compact.i = 0;
+#else
+    uint16_t mark[STEP_POOL_SIZE];
+    int rv = sequencer_snapshot_check_(s, h, mark);
+#endif
+    if (rv) return -1;
+    const uint8_t *p = (const uint8_t*)(h + 1);
+    memcpy(s->step_pool.step, p, steps_bytes);
+    memcpy(s->pattern_pool.pattern, p + steps_bytes, patterns_bytes);
+    /* Extra capacity goes to the free lists. */
+    s->step_pool.free = h->step_free;
+    for (uint32_t i = s->step_pool.nb; i-- > h->nb_steps; ) {
+        step_pool_free(&s->step_pool, i);
+    }
+    s->step_pool.gen++;
+    s->pattern_pool.free = h->pattern_free;
+    for (uint32_t i = s->pattern_pool.nb; i-- > h->nb_patterns; ) {
+        pattern_pool_free_(&s->pattern_pool, i);
+    }
+    s->step_pool.nb_free = 0;
+    for (step_t i = s->step_pool.free; i != STEP_NONE; i = s->step_pool.step[i].next) {
+        s->step_pool.nb_free++;
+    }
+    s->pattern_pool.nb_free = 0;
+    for (pattern_t i = s->pattern_pool.free; i != PATTERN_NONE; i = s->pattern_pool.pattern[i].head) {
+        s->pattern_pool.nb_free++;
+    }
+    sequencer_stats_reset(s);
+    s->time = h->time;
+    s->cursor.pattern  = PATTERN_NONE;
+    s->cursor.delay    = 0;
+    s->cursor.duration = 0;
+    sequencer_snapshot_schedule_(s, h->now);
+    return 0;
+}
 
 /* Note that the timer heap still contains a reference to the pattern.
    We can't easily remove that so the timer event is allowed to
    expire, which will free the pattern slot at that time.  We can
    however already delete the step cycle. */
 void sequencer_clear_pattern(struct sequencer *s, pattern_t pat_nb) {
-    ASSERT(pat_nb < PATTERN_POOL_SIZE);
-    step_t last = s->pattern_pool.pattern[pat_nb].last;
+    step_t last = sequencer_pattern(s, pat_nb)->last;
     if (last == STEP_NONE) {
         LOG("Pattern %d is empty\n", pat_nb);
     }
     else {
         LOG("Pattern %d, removing cycle at %d\n", pat_nb, last);
-        step_pool_free_loop(&s->step_pool, last);
         struct pattern_phase *pp = sequencer_pattern(s, pat_nb);
+        step_pool_free_loop(&s->step_pool, last, pp->nb_steps);
+        sequencer_compact_touch_(s, pat_nb);
+        pp->nb_steps = 0;
+        pp->length = 0;
         pp->head = STEP_DEAD;
         pp->last = STEP_DEAD;
     }
 }
 
+/* Active note tracking for MIDI events, one bit per port, channel and
+   key.  The dispatch function feeds it the events it sends out, so
+   that only the notes that are actually sounding get a note off when
+   playback stops or a pattern is muted or cleared. */
+struct sequencer_notes {
+    uint32_t on[16][16][4];
+};
+typedef void (*sequencer_note_off_fn)(void *ctx, const union pattern_event *ev);
+
+/* Returns 1 for a MIDI note on or off, with *on set for note on. */
+static inline int sequencer_event_is_note(const union pattern_event *ev, int *on) {
+    if (ev->u8[0] >= 16) return 0;
+    switch(ev->u8[1] & 0xF0) {
+    case 0x90: *on = (ev->u8[3] != 0); return 1;
+    case 0x80: *on = 0; return 1;
+    default: return 0;
+    }
+}
+static inline void sequencer_notes_update(struct sequencer_notes *n,
+                                          const union pattern_event *ev) {
+    int on;
+    if (!sequencer_event_is_note(ev, &on)) return;
+    uint8_t key = ev->u8[2] & 0x7F;
+    uint32_t *w = &n->on[ev->u8[0]][ev->u8[1] & 0x0F][key / 32];
+    uint32_t bit = 1 << (key % 32);
+    if (on) { *w |= bit; } else { *w &= ~bit; }
+}
+static inline void sequencer_notes_release_(struct sequencer_notes *n,
+                                            uint8_t port, uint8_t chan, uint8_t key,
+                                            sequencer_note_off_fn off, void *ctx) {
+    n->on[port][chan][key / 32] &= ~(1 << (key % 32));
+    union pattern_event ev = { .u8 = { PAT_MIDI_TAG(port), 0x80 | chan, key, 0 } };
+    off(ctx, &ev);
+}
+/* Note off for every sounding note on one port. */
+void sequencer_notes_release_port(struct sequencer_notes *n, uint8_t port,
+                                  sequencer_note_off_fn off, void *ctx) {
+    for (int chan = 0; chan < 16; chan++) {
+        for (int w = 0; w < 4; w++) {
+            uint32_t bits = n->on[port][chan][w];
+            while (bits) {
+                int key = w * 32 + __builtin_ctz(bits);
+                bits &= bits - 1;
+                sequencer_notes_release_(n, port, chan, key, off, ctx);
+            }
+        }
+    }
+}
+/* Note off for every sounding note. */
+void sequencer_notes_release_all(struct sequencer_notes *n,
+                                 sequencer_note_off_fn off, void *ctx) {
+    for (int port = 0; port < 16; port++) {
+        sequencer_notes_release_port(n, port, off, ctx);
+    }
+}
+/* Note off for the sounding notes that this pattern plays.  Cost is
+   linear in the size of the pattern. */
+void sequencer_notes_release_pattern(struct sequencer *s, struct sequencer_notes *n,
+                                     pattern_t pat_nb,
+                                     sequencer_note_off_fn off, void *ctx) {
+    struct pattern_phase *pp = sequencer_pattern(s, pat_nb);
+    if (pattern_phase_used != pattern_phase_lifecycle(pp)) return;
+    FOR_SEQUENCER_STEPS(s, pat_nb, is) {
+        const union pattern_event *ev = &is.step->event;
+        int on;
+        if (!sequencer_event_is_note(ev, &on) || !on) continue;
+        uint8_t port = ev->u8[0], chan = ev->u8[1] & 0x0F, key = ev->u8[2] & 0x7F;
+        if (n->on[port][chan][key / 32] & (1 << (key % 32))) {
+            sequencer_notes_release_(n, port, chan, key, off, ctx);
+        }
+    }
+}
+
+/* Pattern transforms.  These edit the step cycle of a used pattern in
+   place, at a cost linear in the number of steps, so they can be
+   called from the RT thread.  The pattern keeps its loop position and
+   the play head moves to the first step after it.  A group only looks
+   at its members at the time of its timer entry, so the new head is
+   never due before the old one.  Steps that fall in between are
+   picked up on the next pass.  The recording pattern is refused, as
+   are patterns that are not in use.  Return 0 on success, -1 with the
+   pattern untouched otherwise. */
+static inline int sequencer_pattern_editable(struct sequencer *s, pattern_t p) {
+    return (p < s->pattern_pool.nb) &&
+        (p != s->cursor.pattern) &&
+        (pattern_phase_used == pattern_phase_lifecycle(sequencer_pattern(s, p)));
+}
+/* Loop position at the current time. */
+static inline uint32_t sequencer_pattern_pos_(struct sequencer *s, pattern_t p, uint32_t len) {
+    struct pattern_phase *pp = sequencer_pattern(s, p);
+    uint32_t t = 0, n = 0;
+    step_t step = sequencer_step(s, pp->last)->next;
+    while (step != pp->head) {
+        const struct pattern_step *ps = sequencer_step(s, step);
+        ASSERT(n++ < pp->nb_steps);
+        t += ps->delay;
+        step = ps->next;
+    }
+    dtime_t wait = pp->due - sequencer_now(s);
+    return (t % len + len - wait % len) % len;
+}
+/* Move the play head to the first step at or after loop position pos
+   that is at least min_wait ticks away.  A chain of zero delay steps
+   at the end of the loop plays at the same time as the first step,
+   and before it. */
+static inline void sequencer_pattern_seek_(struct sequencer *s, pattern_t p,
+                                           uint32_t pos, dtime_t min_wait) {
+    struct pattern_phase *pp = sequencer_pattern(s, p);
+    uint32_t len = sequencer_pattern_length(s, p);
+    ASSERT(len > 0);
+    uint32_t best_wait = 0xFFFFFFFF, best_t = 0;
+    int best_wraps = 0;
+    step_t best = STEP_NONE;
+    uint32_t t = 0;
+    step_t step = sequencer_step(s, pp->last)->next;
+    for(;;) {
+        const struct pattern_step *ps = sequencer_step(s, step);
+        int wraps = (t == len);
+        uint32_t wait = (t % len + len - pos) % len;
+        if (wait < min_wait) wait += ((min_wait - wait + len - 1) / len) * len;
+        if ((wait < best_wait) ||
+            ((wait == best_wait) && wraps && !best_wraps)) {
+            best_wait = wait;
+            best_wraps = wraps;
+            best_t = t;
+            best = step;
+        }
+        t += ps->delay;
+        if (step == pp->last) break;
+        step = ps->next;
+    }
+    /* Lengths that do not fit are not kept in phase. */
+    if (best_wait > 0xFFFF) best_wait = 0xFFFF;
+    pp->head = best;
+    pp->due = sequencer_now(s) + best_wait;
+    pp->groove_pos = best_t % SEQUENCER_GROOVE_PERIOD;
+}
+
+/* Delay all events by r ticks modulo the loop length.  The gaps
+   between steps do not change, only the step that starts the loop.
+   If no event lands on the start, a head command step is put there
+   to hold the delay up to the first event, as in live recordings.
+   This needs at most one free step. */
+int sequencer_pattern_rotate(struct sequencer *s, pattern_t pat_nb, uint32_t r) {
+    if (!sequencer_pattern_editable(s, pat_nb)) return -1;
+    struct pattern_phase *pp = sequencer_pattern(s, pat_nb);
+    uint32_t len = sequencer_pattern_length(s, pat_nb);
+    if (len == 0) return -1;
+    r %= len;
+    if (r == 0) return 0;
+    uint32_t pos = sequencer_pattern_pos_(s, pat_nb, len);
+    dtime_t wait = pp->due - sequencer_now(s);
+
+    /* An existing head command is unlinked, giving its delay to the
+       last step, and reused if needed. */
+    struct pattern_step *plast = sequencer_step(s, pp->last);
+    step_t first = plast->next;
+    struct pattern_step *pfirst = sequencer_step(s, first);
+    step_t head = STEP_NONE;
+    if ((pp->nb_steps > 1) &&
+        (pfirst->event.u8[0] == PAT_SEQ_CMD) &&
+        (pfirst->event.u8[1] == PAT_SEQ_CMD_HEAD)) {
+        head = first;
+        first = pfirst->next;
+        plast->delay += pfirst->delay;
+        plast->next = first;
+        pp->nb_steps--;
+        /* The loop now starts at the old first event. */
+        r = (r + pfirst->delay) % len;
+    }
+
+    /* The first step that wraps around starts the loop, after a gap
+       of g ticks. */
+    step_t pred = pp->last, k = first, step = first;
+    uint32_t t = 0, g = r;
+    for(;;) {
+        const struct pattern_step *ps = sequencer_step(s, step);
+        if (t + r >= len) {
+            k = step;
+            g = t + r - len;
+            break;
+        }
+        t += ps->delay;
+        if (step == pp->last) break;
+        pred = step;
+        step = ps->next;
+    }
+    if (k == first) pred = pp->last;
+    if (g > 0) {
+        if (head == STEP_NONE) {
+            if (s->step_pool.nb_free == 0) return -1;
+            union pattern_event ev = { .u8 = {PAT_SEQ_CMD, PAT_SEQ_CMD_HEAD} };
+            head = step_pool_new_event(&s->step_pool, &ev, 0);
+        }
+        struct pattern_step *ppred = sequencer_step(s, pred);
+        struct pattern_step *phead = sequencer_step(s, head);
+        ASSERT(ppred->delay >= g);
+        ppred->delay -= g;
+        phead->delay = g;
+        phead->next = k;
+        ppred->next = head;
+        pp->nb_steps++;
+    }
+    else if (head != STEP_NONE) {
+        step_pool_free(&s->step_pool, head);
+    }
+    pp->last = pred;
+    sequencer_compact_relink_(s, pat_nb);
+    s->step_pool.gen++;
+    sequencer_pattern_seek_(s, pat_nb, pos, wait);
+    return 0;
+}
+
+/* Scale all times by num/den.  Times are rounded from the start of
+   the loop so the rounding errors do not add up.  Steps that end up
+   at the same time become a chain. */
+int sequencer_pattern_scale(struct sequencer *s, pattern_t pat_nb,
+                            uint32_t num, uint32_t den) {
+    if (!sequencer_pattern_editable(s, pat_nb) || !num || !den) return -1;
+    struct pattern_phase *pp = sequencer_pattern(s, pat_nb);
+    uint32_t len = sequencer_pattern_length(s, pat_nb);
+#define SCALE_(t) ((uint32_t)(((uint64_t)(t) * num + den / 2) / den))
+    uint32_t scaled_len = SCALE_(len);
+    if ((scaled_len == 0) || (scaled_len > 0xFFFF)) return -1;
+    uint32_t pos = SCALE_(sequencer_pattern_pos_(s, pat_nb, len)) % scaled_len;
+    dtime_t wait = pp->due - sequencer_now(s);
+    uint32_t t = 0, scaled_t = 0;
+    FOR_SEQUENCER_STEPS(s, pat_nb, is) {
+        t += is.step->delay;
+        uint32_t next = SCALE_(t);
+        is.step->delay = next - scaled_t;
+        scaled_t = next;
+    }
+#undef SCALE_
+    pp->length = scaled_len;
+    sequencer_pattern_seek_(s, pat_nb, pos, wait);
+    return 0;
+}
+
+/* Play the loop backwards: an event at time t moves to len - t.  The
+   step at the start of the loop stays there, so a head command keeps
+   its function.  In the reversed cycle each step gets the delay of
+   its old predecessor. */
+int sequencer_pattern_reverse(struct sequencer *s, pattern_t pat_nb) {
+    if (!sequencer_pattern_editable(s, pat_nb)) return -1;
+    struct pattern_phase *pp = sequencer_pattern(s, pat_nb);
+    if (pp->nb_steps < 2) return 0;
+    uint32_t len = sequencer_pattern_length(s, pat_nb);
+    if (len == 0) return -1;
+    uint32_t pos = sequencer_pattern_pos_(s, pat_nb, len);
+    dtime_t wait = pp->due - sequencer_now(s);
+    step_t prev = pp->last;
+    step_t first = sequencer_step(s, prev)->next;
+    /* The old second step wraps back to the start. */
+    step_t last = sequencer_step(s, first)->next;
+    dtime_t carry = sequencer_step(s, prev)->delay;
+    step_t step = first;
+    for (uint32_t i = 0; i < pp->nb_steps; i++) {
+        struct pattern_step *ps = sequencer_step(s, step);
+        step_t next = ps->next;
+        dtime_t delay = ps->delay;
+        ps->delay = carry;
+        ps->next = prev;
+        carry = delay;
+        prev = step;
+        step = next;
+    }
+    ASSERT(step == first);
+    pp->last = last;
+    sequencer_compact_relink_(s, pat_nb);
+    s->step_pool.gen++;
+    sequencer_pattern_seek_(s, pat_nb, pos, wait);
+    return 0;
+}
+
+/* Transpose MIDI notes by a number of semitones.  Keys that would go
+   out of range are left alone, so note on and off stay paired.
+   Notes that are sounding keep their old key, so the caller should
+   release them first, see sequencer_notes_release_pattern(). */
+int sequencer_pattern_transpose(struct sequencer *s, pattern_t pat_nb, int32_t semitones) {
+    if (!sequencer_pattern_editable(s, pat_nb)) return -1;
+    FOR_SEQUENCER_STEPS(s, pat_nb, is) {
+        union pattern_event *ev = &is.step->event;
+        int on;
+        if (!sequencer_event_is_note(ev, &on)) continue;
+        int32_t key = (ev->u8[2] & 0x7F) + semitones;
+        if ((key >= 0) && (key <= 127)) ev->u8[2] = key;
+    }
+    return 0;
+}
+
 void sequencer_info_pattern(struct sequencer *s, pattern_t pat_nb) {
     LOG("pattern %d:\n", pat_nb);
     struct pattern_phase *pp = sequencer_pattern(s, pat_nb);
@@ -624,11 +2204,13 @@ void sequencer_info_pattern(struct sequencer *s, pattern_t pat_nb) {
    cursor consists of 2 parts: the event data is written in the new
    step, while the existing old step delay is split between old and
    new step. */
-pattern_t sequencer_cursor_open(struct sequencer *s, dtime_t duration) {
+static inline pattern_t sequencer_cursor_open_(struct sequencer *s, dtime_t duration) {
     struct sequencer_cursor *c = &s->cursor;
     ASSERT(c->pattern == PATTERN_NONE);
     c->delay = 0;
     c->duration = duration;
+    c->rec_overdub = c->overdub;
+    c->rec_grid = c->grid;
     pattern_t pat = sequencer_pattern_alloc(s);
     c->pattern = pat;
     /* Schedule an internal head command.  This has two functions: it
@@ -639,7 +2221,11 @@ pattern_t sequencer_cursor_open(struct sequencer *s, dtime_t duration) {
         .u8 = {PAT_SEQ_CMD, PAT_SEQ_CMD_HEAD}
     };
     sequencer_add_step_event(s, pat, &ev, duration);
-    swtimer_schedule(&s->swtimer, duration, pat);
+    return pat;
+}
+pattern_t sequencer_cursor_open(struct sequencer *s, dtime_t duration) {
+    pattern_t pat = sequencer_cursor_open_(s, duration);
+    sequencer_schedule(s, duration, pat);
     return pat;
 }
 void sequencer_cursor_close(struct sequencer *s) {
@@ -663,13 +2249,63 @@ pattern_t sequencer_cursor_dup(struct sequencer *s) {
     ASSERT(c->pattern != PATTERN_NONE);
     dtime_t duration = c->duration;
     sequencer_cursor_close(s);
+    /* The new pattern starts a loop later, at the header time.  It
+       joins the group that is due then, see sequencer_schedule(). */
     return sequencer_cursor_open(s, duration);
 }
+/* Insert an event into the recording at loop time pos.  Events
+   at the same time stay in recording order.  Cost is linear in the
+   size of the pattern. */
+static inline void sequencer_cursor_insert(struct sequencer *s, const union pattern_event *ev,
+                                           uint32_t pos) {
+    struct sequencer_cursor *c = &s->cursor;
+    struct pattern_phase *pp = sequencer_pattern(s, c->pattern);
+    /* The header is the first step, at loop time 0. */
+    step_t step = sequencer_step(s, pp->last)->next;
+    uint32_t t = 0;
+    for(;;) {
+        struct pattern_step *ps = sequencer_step(s, step);
+        if ((step == pp->last) || (t + ps->delay > pos)) break;
+        t += ps->delay;
+        step = ps->next;
+    }
+    /* This splits the delay of step.  If the new event falls between
+       the play position and the pattern's play head, it is not
+       played until the next pass, which is what we want since the
+       event was just played live. */
+    struct pattern_step *ps = sequencer_step(s, step);
+    dtime_t delay = t + ps->delay - pos;
+    pp->length -= ps->delay;
+    ps->delay = pos - t;
+    pp->length += ps->delay + delay;
+    step_t new_step = step_pool_new_event(&s->step_pool, ev, delay);
+    struct pattern_step *pnew = sequencer_step(s, new_step);
+    pnew->next = ps->next;
+    ps->next = new_step;
+    step_pool_relink_(&s->step_pool, step);
+    step_pool_relink_(&s->step_pool, new_step);
+    step_pool_own_(&s->step_pool, new_step, c->pattern);
+    if (step == pp->last) pp->last = new_step;
+    pp->nb_steps++;
+    if (s->step_pool.nb_free < s->stats.min_free_steps) {
+        s->stats.min_free_steps = s->step_pool.nb_free;
+    }
+}
 void sequencer_cursor_write(struct sequencer *s, const union pattern_event *ev) {
     struct sequencer_cursor *c = &s->cursor;
+    if (c->rec_overdub) {
+        uint32_t pos = c->delay;
+        if (c->rec_grid > 1) {
+            pos = ((pos + c->rec_grid / 2) / c->rec_grid) * c->rec_grid;
+        }
+        /* Wrap around to the start of the next pass. */
+        sequencer_cursor_insert(s, ev, pos % c->duration);
+        return;
+    }
     struct pattern_phase *pp = sequencer_pattern(s, c->pattern);
     struct pattern_step *last = sequencer_step(s, pp->last);
     dtime_t time_left = last->delay - c->delay;
+    pp->length = pp->length - last->delay + c->delay;
     last->delay = c->delay;
     c->delay = 0;
     sequencer_add_step_event(s, c->pattern, ev, time_left);
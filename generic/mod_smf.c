@@ -0,0 +1,373 @@
+#ifndef MOD_SMF
+#define MOD_SMF
+
+/* Standard MIDI File (SMF) import and export for sequencer patterns.
+
+   Both directions stream through a small buffer, so a file never has
+   to be held in memory as a whole.  The reader pulls bytes through a
+   fill callback, the writer pushes them out through a flush
+   callback.  Track chunk sizes are computed by a counting pass over
+   the steps before the track is written, so the output does not need
+   to be seekable.
+
+   Pattern events map to SMF as follows:
+
+   - MIDI channel messages go out as channel messages.  The port is
+     set by a port prefix meta event (FF 21) at the start of a type 1
+     track, or whenever it changes in a type 0 track.
+
+   - Anything else, e.g. CV and sequencer commands, is stored verbatim
+     in a sequencer specific meta event (FF 7F) under the
+     non-commercial manufacturer ID 7D, so it survives a round trip.
+
+   - The loop length is the time of the end of track event.
+
+   Requires mod_sequencer.c */
+
+#include <stdlib.h>
+
+#define SMF_MANUFACTURER 0x7D
+/* Pseudo port for events that are not MIDI channel messages. */
+#define SMF_PORT_RAW 16
+#define SMF_PORT_ALL 17
+
+/* Port of a MIDI channel message, SMF_PORT_RAW otherwise. */
+static inline uint32_t smf_event_port(const union pattern_event *ev) {
+    if ((ev->u8[0] < 16) && (ev->u8[1] >= 0x80) && (ev->u8[1] < 0xF0)) {
+        return ev->u8[0];
+    }
+    return SMF_PORT_RAW;
+}
+static inline uint32_t smf_status_nb_data(uint8_t status) {
+    switch(status & 0xF0) {
+    case 0xC0: case 0xD0: return 1;
+    default: return 2;
+    }
+}
+
+
+/* Writer */
+struct smf_writer {
+    /* A NULL buffer only counts bytes. */
+    uint8_t *buf;
+    uint32_t size;
+    uint32_t nb;
+    uint32_t count;
+    /* Writes out buf[0..nb), returns 0 on success. */
+    int (*flush)(struct smf_writer *w);
+    void *ctx;
+    int error;
+};
+static inline void smf_put(struct smf_writer *w, uint8_t b) {
+    w->count++;
+    if (!w->buf) return;
+    if (w->nb == w->size) {
+        if (w->flush(w)) w->error = 1;
+        w->nb = 0;
+    }
+    w->buf[w->nb++] = b;
+}
+static inline void smf_put_be(struct smf_writer *w, uint32_t val, uint32_t nb) {
+    while (nb--) smf_put(w, val >> (8 * nb));
+}
+static inline void smf_put_vlq(struct smf_writer *w, uint32_t val) {
+    if (val > 0x0FFFFFFF) {
+        w->error = 1;
+        val = 0x0FFFFFFF;
+    }
+    uint32_t shift = 21;
+    while ((shift > 0) && !(val >> shift)) shift -= 7;
+    for (; shift > 0; shift -= 7) smf_put(w, 0x80 | ((val >> shift) & 0x7F));
+    smf_put(w, val & 0x7F);
+}
+static inline void smf_put_port_(struct smf_writer *w, uint32_t port) {
+    smf_put(w, 0xFF); smf_put(w, 0x21); smf_put(w, 1); smf_put(w, port);
+}
+
+/* Track body: events of one port, or all of them, followed by the end
+   of track at the loop length. */
+static void smf_encode_track_(struct smf_writer *w,
+                              const struct pattern_step *step, uint32_t nb_steps,
+                              uint32_t track_port) {
+    uint32_t t = 0, t_prev = 0;
+    uint32_t port = SMF_PORT_RAW;
+    if (track_port < SMF_PORT_RAW) {
+        smf_put_vlq(w, 0);
+        smf_put_port_(w, track_port);
+    }
+    for (uint32_t i = 0; i < nb_steps; i++) {
+        const union pattern_event *ev = &step[i].event;
+        uint32_t ev_port = smf_event_port(ev);
+        if ((track_port == SMF_PORT_ALL) || (track_port == ev_port)) {
+            smf_put_vlq(w, t - t_prev);
+            t_prev = t;
+            if (ev_port == SMF_PORT_RAW) {
+                smf_put(w, 0xFF); smf_put(w, 0x7F); smf_put(w, 5);
+                smf_put(w, SMF_MANUFACTURER);
+                for (int b = 0; b < 4; b++) smf_put(w, ev->u8[b]);
+            }
+            else {
+                if ((track_port == SMF_PORT_ALL) && (ev_port != port)) {
+                    smf_put_port_(w, ev_port);
+                    port = ev_port;
+                    smf_put_vlq(w, 0);
+                }
+                uint32_t nb = smf_status_nb_data(ev->u8[1]);
+                for (uint32_t b = 1; b <= 1 + nb; b++) smf_put(w, ev->u8[b]);
+            }
+        }
+        t += step[i].delay;
+    }
+    smf_put_vlq(w, t - t_prev);
+    smf_put(w, 0xFF); smf_put(w, 0x2F); smf_put(w, 0);
+}
+static void smf_encode_chunk_(struct smf_writer *w,
+                              const struct pattern_step *step, uint32_t nb_steps,
+                              uint32_t track_port) {
+    struct smf_writer count = {};
+    smf_encode_track_(&count, step, nb_steps, track_port);
+    smf_put_be(w, 0x4D54726B, 4); // MTrk
+    smf_put_be(w, count.count, 4);
+    smf_encode_track_(w, step, nb_steps, track_port);
+}
+
+/* Encode a step cycle, in playback order starting at the beginning of
+   the loop, as SMF type 0 or 1.  Type 1 has a track per port, with
+   the non-MIDI events in a track of their own.  Time is in sequencer
+   ticks, with division ticks per quarter note.  Flushes the writer at
+   the end.  Returns 0 on success. */
+int smf_encode(struct smf_writer *w,
+               const struct pattern_step *step, uint32_t nb_steps,
+               uint32_t format, uint32_t division) {
+    if ((format > 1) || (division == 0) || (division > 0x7FFF)) return -1;
+    uint32_t used = 0;
+    for (uint32_t i = 0; i < nb_steps; i++) {
+        used |= 1 << smf_event_port(&step[i].event);
+    }
+    /* An empty pattern still has a track to hold the loop length. */
+    if (format == 0 || !used) used = 1 << SMF_PORT_ALL;
+    smf_put_be(w, 0x4D546864, 4); // MThd
+    smf_put_be(w, 6, 4);
+    smf_put_be(w, format, 2);
+    smf_put_be(w, __builtin_popcount(used), 2);
+    smf_put_be(w, division, 2);
+    for (uint32_t port = 0; port <= SMF_PORT_ALL; port++) {
+        if (used & (1 << port)) smf_encode_chunk_(w, step, nb_steps, port);
+    }
+    if (w->buf && w->nb) {
+        if (w->flush(w)) w->error = 1;
+        w->nb = 0;
+    }
+    return w->error ? -1 : 0;
+}
+
+
+/* Reader */
+struct smf_reader {
+    const uint8_t *buf;
+    uint32_t nb;
+    uint32_t pos;
+    /* Total number of bytes consumed. */
+    uint32_t offset;
+    /* Refills buf and nb and returns nb, 0 at the end of the input or
+       -1 on error.  NULL if buf holds all of the input. */
+    int (*fill)(struct smf_reader *r);
+    void *ctx;
+};
+static inline int smf_get(struct smf_reader *r) {
+    if (r->pos == r->nb) {
+        if (!r->fill || (r->fill(r) <= 0)) return -1;
+        r->pos = 0;
+    }
+    r->offset++;
+    return r->buf[r->pos++];
+}
+static inline int smf_get_be(struct smf_reader *r, uint32_t *val, uint32_t nb) {
+    *val = 0;
+    while (nb--) {
+        int c = smf_get(r);
+        if (c < 0) return -1;
+        *val = (*val << 8) | c;
+    }
+    return 0;
+}
+static inline int smf_get_vlq(struct smf_reader *r, uint32_t *val) {
+    *val = 0;
+    for (int i = 0; i < 4; i++) {
+        int c = smf_get(r);
+        if (c < 0) return -1;
+        *val = (*val << 7) | (c & 0x7F);
+        if (!(c & 0x80)) return 0;
+    }
+    return -1;
+}
+static inline int smf_skip(struct smf_reader *r, uint32_t nb) {
+    while (nb--) if (smf_get(r) < 0) return -1;
+    return 0;
+}
+
+struct smf_info {
+    uint32_t format;
+    uint32_t nb_tracks;
+    uint32_t division;
+    /* Latest end of track, in sequencer ticks. */
+    uint32_t length;
+};
+typedef int (*smf_event_fn)(void *ctx, uint32_t time, const union pattern_event *ev);
+
+/* Decode one track chunk body. */
+static int smf_decode_track_(struct smf_reader *r, uint32_t end, uint32_t ppq,
+                             struct smf_info *info, smf_event_fn fn, void *ctx) {
+    uint64_t abs = 0;
+    uint32_t port = 0;
+    uint8_t status = 0;
+#define SMF_TRY(x) if ((x) < 0) return -1
+    while (r->offset < end) {
+        uint32_t delta, len;
+        SMF_TRY(smf_get_vlq(r, &delta));
+        abs += delta;
+        /* Round the absolute time, so errors don't accumulate. */
+        uint64_t time = (abs * ppq + info->division / 2) / info->division;
+        if (time > 0xFFFFFFFF) return -1;
+        int b = smf_get(r);
+        SMF_TRY(b);
+        if (b == 0xFF) {
+            /* Meta events cancel running status. */
+            status = 0;
+            int type = smf_get(r);
+            SMF_TRY(type);
+            SMF_TRY(smf_get_vlq(r, &len));
+            if ((type == 0x21) && (len >= 1)) {
+                int p = smf_get(r);
+                SMF_TRY(p);
+                port = p & 0x0F;
+                len--;
+            }
+            else if ((type == 0x7F) && (len == 5)) {
+                union pattern_event ev;
+                int id = smf_get(r);
+                SMF_TRY(id);
+                for (int i = 0; i < 4; i++) {
+                    int c = smf_get(r);
+                    SMF_TRY(c);
+                    ev.u8[i] = c;
+                }
+                len = 0;
+                if ((id == SMF_MANUFACTURER) && fn(ctx, time, &ev)) return -1;
+            }
+            else if (type == 0x2F) {
+                if (time > info->length) info->length = time;
+            }
+            SMF_TRY(smf_skip(r, len));
+        }
+        else if ((b == 0xF0) || (b == 0xF7)) {
+            /* Sysex is not supported by the pattern format. */
+            status = 0;
+            SMF_TRY(smf_get_vlq(r, &len));
+            SMF_TRY(smf_skip(r, len));
+        }
+        else {
+            int d1;
+            if (b & 0x80) {
+                if (b >= 0xF0) return -1;
+                status = b;
+                d1 = smf_get(r);
+                SMF_TRY(d1);
+            }
+            else {
+                /* Running status */
+                if (!status) return -1;
+                d1 = b;
+            }
+            int d2 = 0;
+            if (smf_status_nb_data(status) == 2) {
+                d2 = smf_get(r);
+                SMF_TRY(d2);
+            }
+            union pattern_event ev = { .u8 = { port, status, d1 & 0x7F, d2 & 0x7F } };
+            if (fn(ctx, time, &ev)) return -1;
+        }
+    }
+#undef SMF_TRY
+    return (r->offset == end) ? 0 : -1;
+}
+
+/* Decode an SMF type 0 or 1 file, passing each event to fn with its
+   time scaled to ppq sequencer ticks per quarter note.  Events of
+   different tracks are not merged, see smf_events_to_steps().  Stops
+   with an error if fn returns nonzero. */
+int smf_decode(struct smf_reader *r, uint32_t ppq,
+               smf_event_fn fn, void *ctx, struct smf_info *info) {
+    uint32_t id, len, nb_tracks;
+    memset(info, 0, sizeof(*info));
+    if (smf_get_be(r, &id, 4) || (id != 0x4D546864) || // MThd
+        smf_get_be(r, &len, 4) || (len < 6) ||
+        smf_get_be(r, &info->format, 2) ||
+        smf_get_be(r, &nb_tracks, 2) ||
+        smf_get_be(r, &info->division, 2) ||
+        smf_skip(r, len - 6)) {
+        return -1;
+    }
+    /* Type 2 is a set of unrelated sequences, and SMPTE time is not
+       supported. */
+    if ((info->format > 1) || (info->division & 0x8000) || (info->division == 0)) {
+        return -1;
+    }
+    while (info->nb_tracks < nb_tracks) {
+        if (smf_get_be(r, &id, 4) || smf_get_be(r, &len, 4)) return -1;
+        if (id != 0x4D54726B) { // MTrk
+            /* Unknown chunks are to be skipped. */
+            if (smf_skip(r, len)) return -1;
+            continue;
+        }
+        if (smf_decode_track_(r, r->offset + len, ppq, info, fn, ctx)) return -1;
+        info->nb_tracks++;
+    }
+    return 0;
+}
+
+/* Decoded events are collected by the caller, e.g. into an array of
+   struct smf_event, and sorted into playback order.  The order
+   breaks ties between events of the same time. */
+struct smf_event {
+    uint32_t time;
+    uint32_t order;
+    union pattern_event event;
+};
+static int smf_event_cmp(const void *va, const void *vb) {
+    const struct smf_event *a = va, *b = vb;
+    if (a->time != b->time) return a->time < b->time ? -1 : 1;
+    return a->order < b->order ? -1 : (a->order > b->order);
+}
+/* Sort events and convert them to a step cycle of the given length,
+   as used by sequencer_load_pattern().  If the first event is not at
+   time 0, a head command step holds the delay up to it, as in live
+   recordings.  The step array needs room for nb + 1 steps.  Returns
+   the number of steps, or 0 if the cycle can't be represented. */
+uint32_t smf_events_to_steps(struct smf_event *ev, uint32_t nb, uint32_t length,
+                             struct pattern_step *step) {
+    if (nb == 0) return 0;
+    qsort(ev, nb, sizeof(*ev), smf_event_cmp);
+    if (length < ev[nb - 1].time) length = ev[nb - 1].time;
+    if (length == 0) return 0;
+    uint32_t n = 0;
+    if (ev[0].time > 0xFFFF) return 0;
+    if (ev[0].time > 0) {
+        union pattern_event head = { .u8 = {PAT_SEQ_CMD, PAT_SEQ_CMD_HEAD} };
+        step[n].event = head;
+        step[n].delay = ev[0].time;
+        step[n].next = STEP_NONE;
+        n++;
+    }
+    for (uint32_t i = 0; i < nb; i++) {
+        uint32_t next = (i + 1 < nb) ? ev[i + 1].time : length;
+        if (next - ev[i].time > 0xFFFF) return 0;
+        step[n].event = ev[i].event;
+        step[n].delay = next - ev[i].time;
+        step[n].next = STEP_NONE;
+        n++;
+    }
+    return n;
+}
+
+#endif
@@ -0,0 +1,102 @@
+/* Host benchmark for the pattern scheduler.  Plays back 64
+   polymetric loops and reports the time per sequencer_tick().  Build
+   bench_sequencer_wheel.c for the same benchmark using the timing
+   wheel instead of the swtimer heap, and bench_sequencer_hub.c for
+   the configuration and scale of hub.c.
+
+   Usage: bench_sequencer [max_ns_per_tick]
+   Exits with an error if the time per tick is over the limit. */
+
+#define STEP_POOL_SIZE 4096
+#define PATTERN_POOL_SIZE 64
+
+#include "mod_sequencer.c"
+#include "macros.h"
+#include <stdlib.h>
+#include <time.h>
+
+#ifndef BENCH_NAME
+#ifdef SEQUENCER_TIMER_WHEEL
+#define BENCH_NAME "wheel"
+#else
+#define BENCH_NAME "heap"
+#endif
+#endif
+
+#ifndef BENCH_NB_PATTERNS
+#define BENCH_NB_PATTERNS 64
+#endif
+#ifndef BENCH_NB_TICKS
+#define BENCH_NB_TICKS (1000 * 1000 * 10)
+#endif
+
+static uintptr_t nb_events;
+static uint32_t checksum;
+void bench_dispatch(struct sequencer *seq, const union pattern_event *ev) {
+    nb_events++;
+    checksum += ev->u32 ^ seq->time;
+}
+
+/* Each pattern has a different loop length and number of steps, so
+   the loops drift against each other and the timer sees a mix of
+   coinciding and isolated deadlines. */
+void bench_patterns(struct sequencer *s) {
+    for (int p = 0; p < BENCH_NB_PATTERNS; p++) {
+        pattern_t pat = sequencer_pattern_alloc(s);
+        int nb_steps = 3 + p % 13;
+        int len = 24 * (3 + p % 7) + p;
+        int left = len;
+        for (int i = 0; i < nb_steps; i++) {
+            dtime_t delay = (i == nb_steps - 1) ? left : len / nb_steps;
+            left -= delay;
+            union pattern_event ev = PAT_MIDI(p % 16, 0x90, 36 + i, 100);
+            sequencer_add_step_event(s, pat, &ev, delay);
+        }
+        sequencer_schedule(s, 0, pat);
+    }
+}
+
+static uint64_t time_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+int main(int argc, char **argv) {
+    static struct sequencer s;
+#ifdef SEQUENCER_POOL_ARENA
+    struct sequencer_arena arena = {
+        .size = sequencer_arena_bytes(BENCH_NB_STEPS, BENCH_NB_PATTERNS_MAX)
+    };
+    arena.buf = malloc(arena.size);
+    ASSERT(arena.buf);
+    sequencer_init(&s, bench_dispatch, &arena,
+                   BENCH_NB_STEPS, BENCH_NB_PATTERNS_MAX);
+#else
+    sequencer_init(&s, bench_dispatch);
+#endif
+#ifdef BENCH_COMPACT_BUDGET
+    s.compact.budget = BENCH_COMPACT_BUDGET;
+#endif
+    bench_patterns(&s);
+
+    uint64_t t0 = time_ns();
+    for (uintptr_t i = 0; i < BENCH_NB_TICKS; i++) {
+        sequencer_tick(&s);
+    }
+    uint64_t t1 = time_ns();
+
+    double ns_per_tick = (double)(t1 - t0) / BENCH_NB_TICKS;
+    LOG("%s: %d patterns, %d ticks, %d events, checksum %08x\n",
+        BENCH_NAME, BENCH_NB_PATTERNS, BENCH_NB_TICKS,
+        (int)nb_events, checksum);
+    LOG("%s: %.1f ns/tick, %.1f ns/event, max %d events/tick\n",
+        BENCH_NAME, ns_per_tick,
+        (double)(t1 - t0) / nb_events,
+        (int)s.stats.max_events);
+    if ((argc > 1) && (ns_per_tick > strtod(argv[1], NULL))) {
+        LOG("%s: over limit of %s ns/tick\n", BENCH_NAME, argv[1]);
+        return 1;
+    }
+    return 0;
+}
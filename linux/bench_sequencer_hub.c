@@ -0,0 +1,12 @@
+/* The benchmark in the configuration of hub.c: timing wheel, pools
+   in an arena of the same size, compaction running, and a pattern
+   count closer to a full live set. */
+#define SEQUENCER_TIMER_WHEEL
+#define SEQUENCER_POOL_ARENA
+#define BENCH_NAME "hub"
+#define BENCH_NB_STEPS 32768
+#define BENCH_NB_PATTERNS_MAX 1024
+#define BENCH_NB_PATTERNS 512
+#define BENCH_NB_TICKS (1000 * 1000)
+#define BENCH_COMPACT_BUDGET 256
+#include "bench_sequencer.c"
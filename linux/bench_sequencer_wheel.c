@@ -0,0 +1,2 @@
+#define SEQUENCER_TIMER_WHEEL
+#include "bench_sequencer.c"
@@ -7,6 +7,7 @@
 #include "macros.h"
 #include "assert_read.h"
 #include "assert_write.h"
+#include "erl_port.h"
 #include "uct_byteswap.h"
 
 #include <jack/jack.h>
@@ -61,7 +62,9 @@ static jack_nframes_t bpm = 120;
 static int clock_phase = 0.0;
 static int clock_pol = 1;
 
+static struct jack_load jack_load;
 static int process (jack_nframes_t nframes, void *arg) {
+    jack_time_t t0 = jack_load_begin(&jack_load);
 
     /* Boilerplate. */
     jack_nframes_t sr = jack_get_sample_rate(client);
@@ -119,6 +122,7 @@ static int process (jack_nframes_t nframes, void *arg) {
         clock_phase += 1;
     }
 
+    jack_load_end(&jack_load, t0, nframes);
     return 0;
 }
 
@@ -185,9 +189,25 @@ int handle_clock_div(struct tag_u32 *req) {
     }
     return -1;
 }
+int handle_jack_load(struct tag_u32 *req) {
+    TAG_U32_UNPACK(req, 0, m, reset) {
+        struct jack_load_snapshot l;
+        jack_load_read(&jack_load, &l, m->reset);
+        SEND_REPLY_TAG_U32_BYTES(req, (uint8_t*)l.hist, sizeof(l.hist),
+                                 0 /* ok */,
+                                 l.nb_cycles,
+                                 l.max_us,
+                                 l.nb_xruns,
+                                 l.nframes,
+                                 jack_get_sample_rate(client));
+        return 0;
+    }
+    return -1;
+}
 int map_root(struct tag_u32 *req) {
     const struct tag_u32_entry map[] = {
         {"clock_div", t_cmd, handle_clock_div, 1},
+        {"jack_load", t_cmd, handle_jack_load, 1},
     };
     return HANDLE_TAG_U32_MAP(req, map);
 }
@@ -223,20 +243,18 @@ int main(int argc, char **argv) {
                JACK_DEFAULT_AUDIO_TYPE, JackPortIsOutput, 0));
 
     jack_set_process_callback (client, process, 0);
+    jack_load_init(&jack_load, client);
     ASSERT(!mlockall(MCL_CURRENT | MCL_FUTURE));
     ASSERT(!jack_activate(client));
 
     /* The main thread blocks on stdin.  The protocol is {packet,4}
        with MIDI on TAG_STREAM. */
+    static struct packet4_reader stdin_reader = { .fd = 0 };
     for(;;) {
-        uint32_t nb; {
-            uint8_t buf[4];
-            assert_read_fixed(0, buf, 4);
-            nb = read_be(buf, 4);
-        }
+        uint32_t nb;
+        const uint8_t *buf = packet4_reader_next(&stdin_reader, &nb);
+        if (!buf) exit(1);
         LOG("nb = %d\n", nb);
-        uint8_t buf[nb];
-        assert_read_fixed(0, buf, nb);
         if (nb >= 4) {
             uint16_t tag = read_be(buf, 2);
             LOG("tag = %04x\n", tag);
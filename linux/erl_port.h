@@ -45,6 +45,8 @@ static inline uint32_t assert_read_u32(int fd) {
     assert_read_fixed(fd, &be[0], 4);
     return be[0] << 24 | be[1] << 16 | be[2] << 8 | be[3];
 }
+/* Returns a malloc()ed copy of the packet, which the caller frees.
+   Loops reading many packets should use packet4_reader below. */
 static inline void *assert_read_packet4_len(int fd, uint32_t *save_len) {
     uint32_t buf_len = assert_read_u32(fd);
     if (save_len) { *save_len = buf_len; }
@@ -68,6 +70,64 @@ static inline void assert_read_packet4_static(int fd, void *buf, ssize_t buf_siz
     assert_read(0, buf + 4, *size);
 }
 
+/* {packet,4} reader.  Input is read in large blocks into a buffer
+   that is reused for all packets, and packets are returned in place,
+   so there is no allocation or copy per packet.  A packet stays valid
+   until the next call to packet4_reader_next().  The buffer starts at
+   PACKET4_READER_SIZE and grows to fit the largest packet seen, up to
+   PACKET4_READER_MAX. */
+#ifndef PACKET4_READER_SIZE
+#define PACKET4_READER_SIZE 0x10000
+#endif
+#ifndef PACKET4_READER_MAX
+#define PACKET4_READER_MAX 0x4000000
+#endif
+struct packet4_reader {
+    int fd;
+    uint8_t *buf;
+    uint32_t size;
+    uint32_t start, end;
+};
+/* Makes sure nb bytes are buffered.  Returns -1 on end of file. */
+static inline int packet4_reader_fill(struct packet4_reader *r, uint32_t nb) {
+    if (r->end - r->start >= nb) return 0;
+    if (nb > r->size) {
+        uint32_t size = r->size ? r->size : PACKET4_READER_SIZE;
+        while (size < nb) size *= 2;
+        if (size > PACKET4_READER_MAX) { LOG("packet4_reader: 0x%08x bytes\n", nb); }
+        ASSERT(size <= PACKET4_READER_MAX);
+        r->buf = realloc(r->buf, size);
+        ASSERT(r->buf);
+        r->size = size;
+    }
+    if (r->start + nb > r->size) {
+        memmove(r->buf, r->buf + r->start, r->end - r->start);
+        r->end -= r->start;
+        r->start = 0;
+    }
+    while (r->end - r->start < nb) {
+        ssize_t rv = read(r->fd, r->buf + r->end, r->size - r->end);
+        if ((rv < 0) && (errno == EINTR)) continue;
+        ASSERT(rv >= 0);
+        if (rv == 0) return -1;
+        r->end += rv;
+    }
+    return 0;
+}
+/* Returns the next packet and its size in *len, or NULL on end of
+   file. */
+static inline const uint8_t *packet4_reader_next(struct packet4_reader *r, uint32_t *len) {
+    if (packet4_reader_fill(r, 4)) return NULL;
+    const uint8_t *be = r->buf + r->start;
+    *len = be[0] << 24 | be[1] << 16 | be[2] << 8 | be[3];
+    if (*len > PACKET4_READER_MAX - 4) { LOG("packet4_reader: 0x%08x bytes\n", *len); }
+    ASSERT(*len <= PACKET4_READER_MAX - 4);
+    if (packet4_reader_fill(r, 4 + *len)) return NULL;
+    const uint8_t *packet = r->buf + r->start + 4;
+    r->start += 4 + *len;
+    return packet;
+}
+
 
 /* RAW WRITE / ASSERT */
 #include "assert_write.h"
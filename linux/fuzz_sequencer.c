@@ -0,0 +1,224 @@
+/* Randomized test for the sequencer.  Runs a seeded random mix of
+   pattern edits and transforms, recording, restarts, snapshots,
+   compaction and playback, and checks sequencer_check_invariants()
+   after each operation.  Build fuzz_sequencer_wheel.c for the timing wheel.
+
+   Usage: fuzz_sequencer [seed] [nb_ops] */
+
+#define SEQUENCER_POOL_ARENA
+#include "mod_sequencer.c"
+#include "macros.h"
+#include <stdlib.h>
+
+#ifdef SEQUENCER_TIMER_WHEEL
+#define FUZZ_TIMER "wheel"
+#else
+#define FUZZ_TIMER "heap"
+#endif
+
+#define FUZZ_NB_STEPS    2000
+#define FUZZ_NB_PATTERNS 64
+
+static uint32_t rng_state;
+static uint32_t rng(void) {
+    /* xorshift32 */
+    uint32_t x = rng_state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    return rng_state = x;
+}
+static uint32_t rng_below(uint32_t n) {
+    return rng() % n;
+}
+
+/* Playback of a sequencer restored from a snapshot is compared to
+   the original through a hash of its events.  The order of events
+   within a tick depends on the timer layout, so the hash is a sum. */
+static struct sequencer seq, copy;
+static uint32_t hash[2];
+static uint32_t hash_tick;
+static void fuzz_dispatch(struct sequencer *s, const union pattern_event *ev) {
+    uint32_t x = (ev->u32 ^ hash_tick) * 2654435761u;
+    hash[s == &copy] += x ^ (x >> 15);
+}
+
+static void fuzz_init(struct sequencer *s) {
+    struct sequencer_arena a = {
+        .size = sequencer_arena_bytes(FUZZ_NB_STEPS, FUZZ_NB_PATTERNS)
+    };
+    a.buf = malloc(a.size);
+    ASSERT(a.buf);
+    sequencer_init(s, fuzz_dispatch, &a, FUZZ_NB_STEPS, FUZZ_NB_PATTERNS);
+}
+
+static union pattern_event fuzz_event(void) {
+    union pattern_event ev = PAT_MIDI(rng_below(16), 0x90, rng_below(128), 100);
+    return ev;
+}
+
+/* A random used pattern other than the recording, or PATTERN_NONE. */
+static pattern_t fuzz_pick(struct sequencer *s) {
+    pattern_t start = rng_below(s->pattern_pool.nb);
+    for (pattern_t i = 0; i < s->pattern_pool.nb; i++) {
+        pattern_t p = (start + i) % s->pattern_pool.nb;
+        if ((p != s->cursor.pattern) &&
+            (pattern_phase_used == pattern_phase_lifecycle(sequencer_pattern(s, p)))) {
+            return p;
+        }
+    }
+    return PATTERN_NONE;
+}
+
+static void fuzz_new_pattern(struct sequencer *s) {
+    uint32_t nb_steps = 1 + rng_below(16);
+    if ((sequencer_stats_free_patterns(s) == 0) ||
+        (sequencer_stats_free_steps(s) < nb_steps)) return;
+    struct pattern_step step[nb_steps];
+    memset(step, 0, sizeof(step));
+    for (uint32_t i = 0; i < nb_steps; i++) {
+        step[i].event = fuzz_event();
+        step[i].delay = rng_below(4) ? rng_below(50) : 0;
+    }
+    step[nb_steps - 1].delay = 1 + rng_below(50);
+    if (rng_below(2)) {
+        ASSERT(PATTERN_NONE != sequencer_load_pattern(s, step, nb_steps));
+    }
+    else {
+        pattern_t pat = sequencer_pattern_alloc(s);
+        for (uint32_t i = 0; i < nb_steps; i++) {
+            sequencer_add_step_event(s, pat, &step[i].event, step[i].delay);
+        }
+        sequencer_schedule(s, rng_below(20), pat);
+    }
+}
+
+static void fuzz_record(struct sequencer *s) {
+    if (!sequencer_recording(s)) {
+        if (sequencer_stats_free_patterns(s) && sequencer_stats_free_steps(s)) {
+            sequencer_cursor_open(s, 24 * (1 + rng_below(4)));
+        }
+        return;
+    }
+    switch (rng_below(4)) {
+    case 0:
+        sequencer_cursor_close(s);
+        break;
+    case 1:
+        s->cursor.overdub ^= 1;
+        s->cursor.grid = rng_below(7);
+        break;
+    default:
+        /* A new pass needs a step for the header. */
+        if (sequencer_stats_free_steps(s) > 1) {
+            union pattern_event ev = fuzz_event();
+            sequencer_cursor_write(s, &ev);
+        }
+        break;
+    }
+}
+
+static void fuzz_snapshot(struct sequencer *s) {
+    if (sequencer_recording(s)) return;
+    uintptr_t nb = sequencer_snapshot_bytes(s);
+    uint8_t *image = malloc(nb);
+    ASSERT(image);
+    ASSERT(nb == sequencer_snapshot_save(s, image, nb));
+    /* A corrupted image is either refused, leaving the sequencer as
+       it was, or loads into a consistent state. */
+    for (int i = 0; i < 8; i++) {
+        uintptr_t at = rng_below(nb);
+        uint8_t byte = image[at];
+        image[at] ^= 1 << rng_below(8);
+        sequencer_snapshot_load(&copy, image, nb);
+        sequencer_check_invariants(&copy);
+        image[at] = byte;
+    }
+    ASSERT(0 == sequencer_snapshot_load(&copy, image, nb));
+    free(image);
+    sequencer_check_invariants(&copy);
+    hash[0] = hash[1] = 0;
+    for (hash_tick = 0; hash_tick < 200; hash_tick++) {
+        sequencer_tick(s);
+        sequencer_tick(&copy);
+    }
+    ASSERT(hash[0] == hash[1]);
+}
+
+int main(int argc, char **argv) {
+    rng_state = argc > 1 ? strtoul(argv[1], NULL, 0) : 1;
+    uint32_t nb_ops = argc > 2 ? strtoul(argv[2], NULL, 0) : 100000;
+    if (!rng_state) rng_state = 1;
+    uint32_t seed = rng_state;
+
+    struct sequencer *s = &seq;
+    fuzz_init(s);
+    fuzz_init(&copy);
+    uint32_t nb_snapshots = 0;
+    for (uint32_t op = 0; op < nb_ops; op++) {
+        switch (rng_below(16)) {
+        case 0: case 1:
+            fuzz_new_pattern(s);
+            break;
+        case 2: {
+            pattern_t p = fuzz_pick(s);
+            if ((p != PATTERN_NONE) && sequencer_stats_free_steps(s)) {
+                union pattern_event ev = fuzz_event();
+                sequencer_add_step_event(s, p, &ev, 1 + rng_below(20));
+            }
+            break;
+        }
+        case 3: {
+            pattern_t p = fuzz_pick(s);
+            if (p != PATTERN_NONE) sequencer_clear_pattern(s, p);
+            break;
+        }
+        case 4: {
+            pattern_t p = fuzz_pick(s);
+            if (p != PATTERN_NONE) sequencer_pattern(s, p)->mute ^= 1;
+            break;
+        }
+        case 5:
+            if (rng_below(8) == 0) sequencer_restart(s);
+            break;
+        case 6: case 7:
+            fuzz_record(s);
+            break;
+        case 8:
+            s->compact.budget = rng_below(2) ? 0 : 1 + rng_below(256);
+            break;
+        case 10: {
+            pattern_t p = fuzz_pick(s);
+            if (p == PATTERN_NONE) break;
+            switch (rng_below(4)) {
+            case 0: sequencer_pattern_rotate(s, p, rng_below(200)); break;
+            case 1: sequencer_pattern_scale(s, p, 1 + rng_below(4), 1 + rng_below(4)); break;
+            case 2: sequencer_pattern_reverse(s, p); break;
+            case 3: sequencer_pattern_transpose(s, p, (int32_t)rng_below(25) - 12); break;
+            }
+            break;
+        }
+        case 9:
+            if (rng_below(64) == 0) {
+                fuzz_snapshot(s);
+                nb_snapshots++;
+            }
+            break;
+        default:
+            /* Each loop pass of the recording takes a new pattern
+               and header step, which must not run out. */
+            if (sequencer_recording(s) &&
+                ((sequencer_stats_free_patterns(s) < 8) ||
+                 (sequencer_stats_free_steps(s) < 8))) {
+                sequencer_cursor_close(s);
+            }
+            sequencer_ntick(s, 1 + rng_below(100));
+            break;
+        }
+        sequencer_check_invariants(s);
+    }
+    LOG("fuzz %s: seed %u, %u ops, %u snapshots, %u events, %u compact passes\n",
+        FUZZ_TIMER, seed, nb_ops, nb_snapshots,
+        (uint32_t)s->stats.nb_events, s->compact.nb_passes);
+    return 0;
+}
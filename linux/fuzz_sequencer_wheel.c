@@ -0,0 +1,2 @@
+#define SEQUENCER_TIMER_WHEEL
+#include "fuzz_sequencer.c"
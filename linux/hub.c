@@ -24,51 +24,265 @@
 #include "assert_write.h"
 #include "tag_u32.h"
 
+#include <pthread.h>
+#include <semaphore.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <math.h>
+
+/* The host has memory to spare for the O(1) scheduler, and for pools
+   that are large enough for long overdub sessions.  The pools are
+   allocated once in app_init() and locked by mlockall() in main(). */
+#define SEQUENCER_TIMER_WHEEL
+#define SEQUENCER_POOL_ARENA
 #include "mod_sequencer.c"
+#define HUB_NB_STEPS    32768
+#define HUB_NB_PATTERNS 1024
+/* Sequencer ticks that take longer than this are counted. */
+#define HUB_TICK_BUDGET_US 100
+#include "mod_smf.c"
 #include "mod_akai_fire.c"
 #include "mod_novation_remote.c"
 
+/* Writes to stdout come from the main thread (tag_u32 replies), the
+   JACK notification thread and the Erlang output thread.  Only non-RT
+   threads take this lock, and they keep each {packet,4} message in
+   one critical section. */
+static pthread_mutex_t stdout_mutex = PTHREAD_MUTEX_INITIALIZER;
+
 void send_tag_u32_buf_write(const uint8_t *buf, uint32_t len) {
     uint8_t len_buf[4];
     write_be(len_buf, len, 4);
+    pthread_mutex_lock(&stdout_mutex);
     assert_write(1, len_buf, 4);
     assert_write(1, buf, len);
+    pthread_mutex_unlock(&stdout_mutex);
 }
 #define SEND_TAG_U32_BUF_WRITE send_tag_u32_buf_write
 #include "mod_send_tag_u32.c"
 
 /* JACK */
-#define FOR_MIDI_IN(m) \
-    m(clock_in)        \
-    m(fire_in)         \
-    m(easycontrol)     \
-    m(keystation_in1)  \
-    m(keystation_in2)  \
-    m(remote_in)       \
-    m(uma_in)          \
-    m(z_debug)         \
-
-#define FOR_MIDI_IN_DIS(m) \
-
-#define FOR_MIDI_OUT(m) \
-    m(tb03)         \
-    m(fire_out)     \
-    m(volca_keys)   \
-    m(volca_bass)   \
-    m(volca_beats)  \
-    m(synth)        \
-    m(pd_out)       \
-    m(transport)    \
-
-
-FOR_MIDI_IN(DEF_JACK_PORT)
-FOR_MIDI_OUT(DEF_JACK_PORT)
+
+/* MIDI ports are kept in a registry that can be extended at run time
+   with the midi_in_add and midi_out_add commands, so adding a device
+   does not need a restart that drops the loaded patterns.  The
+   registry is a pair of dense arrays owned by the JACK thread and
+   edited through the command ring.  The default ports are registered
+   at startup, see app_ports_init(). */
+#define HUB_NB_MIDI_IN  32
+#define HUB_NB_MIDI_OUT 32
+#define HUB_PORT_NAME   32
+
+/* MIDI through.  Inputs are routed to outputs by a compiled rule
+   table, see mod_midi_through.c.  Rules refer to an input by its slot,
+   which unlike its index in the registry does not change when other
+   inputs are removed, and to an output by its route number. */
+#define MIDI_THROUGH_NB_IN HUB_NB_MIDI_IN
+#include "mod_midi_through.c"
+
+/* Each input is processed by one of these handlers, see the
+   process_*_in() functions. */
+#define FOR_MIDI_IN_HANDLER(m) \
+    m(clock)        \
+    m(fire)         \
+    m(easycontrol)  \
+    m(keystation1)  \
+    m(keystation2)  \
+    m(remote)       \
+    m(uma)          \
+    m(debug)        \
+    m(erl)          \
+    m(through)      \
+
+#define DEF_MIDI_IN_HANDLER_ENUM(name) midi_in_##name,
+enum midi_in_handler {
+    FOR_MIDI_IN_HANDLER(DEF_MIDI_IN_HANDLER_ENUM)
+    NB_MIDI_IN_HANDLER
+};
+
+/* DC-coupled audio outputs carrying CV.  Channel n of PAT_CV_TAG
+   events drives the n-th port. */
+#define FOR_CV_OUT(m) \
+    m(cv0)          \
+    m(cv1)          \
+    m(cv2)          \
+    m(cv3)          \
+
+
+FOR_CV_OUT(DEF_JACK_PORT)
 
 static jack_client_t *client = NULL;
+/* Set once process() can run, and cleared when the JACK server shuts
+   the client down.  While it is clear, rt_cmd_call() applies edits on
+   the main thread. */
+static int client_active = 0;
+
+/* Output staging.  Events for each output port are collected during
+   the period together with their frame offset, and written to the
+   JACK buffer at the end of process().  JACK needs the events in a
+   buffer to be time-ordered, while inputs are processed one port at a
+   time, so the staged events get one stable sort per buffer. */
+#define MIDI_OUT_NB_EVENTS 256
+#define MIDI_OUT_NB_BYTES 2048
+struct midi_out_event {
+    jack_nframes_t time;
+    uint16_t offset;
+    uint16_t nb_bytes;
+};
+struct midi_out {
+    jack_port_t *port;
+    void *buf; // JACK buffer of the current period
+    uint32_t nb_events;
+    uint32_t nb_bytes;
+    uint32_t nb_drop;
+    struct midi_out_event event[MIDI_OUT_NB_EVENTS];
+    uint8_t bytes[MIDI_OUT_NB_BYTES];
+    char name[HUB_PORT_NAME];
+};
+struct app;
+struct midi_in;
+typedef void (*midi_in_fn)(struct app *app, struct midi_in *in);
+struct midi_in {
+    jack_port_t *port;
+    midi_in_fn process;
+    /* Port number on the copies sent to Erlang. */
+    uint8_t erl_port;
+    uint8_t handler;
+    uint8_t through_slot;
+    char name[HUB_PORT_NAME];
+};
+
+/* Sequencer output routing.  The table maps the port nibble of
+   PAT_MIDI_TAG events and the channel of PAT_CV_TAG events to one of
+   the registered MIDI outputs, or ROUTE_NONE to drop them.  It is edited
+   through the command ring and resolved to output buffers once per
+   process cycle, see app_route_resolve(). */
+#define ROUTE_NB_MIDI 16
+#define ROUTE_NB_CV   16
+#define ROUTE_NONE    0xFF
+struct route {
+    uint8_t midi[ROUTE_NB_MIDI];
+    uint8_t cv[ROUTE_NB_CV];
+};
+
+/* CV output.  The 16 bit CV value maps to 0.0 - 1.0.  Events are
+   staged like MIDI output, as deferred groove events at the start of
+   the period can come after a tick event with an earlier frame.  At
+   the end of process() they are sorted and rendered in time order:
+   the part of the buffer up to the event is filled with the old
+   segment, then the target changes.  With slew at 0 the output steps,
+   otherwise it ramps towards the target by slew per sample. */
+#define CV_OUT_NB_EVENTS 64
+struct cv_out_event {
+    jack_nframes_t time;
+    uint16_t val;
+};
+struct cv_out {
+    jack_default_audio_sample_t *buf; // JACK buffer of the current period
+    jack_nframes_t pos;  // first frame not yet rendered
+    float value;         // output at pos
+    float target;
+    float slew;
+    uint32_t nb_events;
+    uint32_t nb_drop;
+    struct cv_out_event event[CV_OUT_NB_EVENTS];
+};
+#define DEF_CV_OUT_ENUM(name) name##_nb,
+enum cv_out_nb {
+    FOR_CV_OUT(DEF_CV_OUT_ENUM)
+    NB_CV_OUT
+};
+#define DEF_CV_OUT_PORT_REF(name) &name,
+static jack_port_t **const cv_out_port[NB_CV_OUT] = {
+    FOR_CV_OUT(DEF_CV_OUT_PORT_REF)
+};
+
+/* Groove.  Events whose groove offset takes them past the end of the
+   period wait here, ordered by absolute frame time. */
+#define GROOVE_DELAY_NB 128
+struct groove_event {
+    uint32_t time;
+    pattern_t pattern;
+    union pattern_event event;
+};
+struct groove_delay {
+    uint32_t nb;
+    uint32_t nb_late;
+    struct groove_event event[GROOVE_DELAY_NB];
+};
+
+/* Clock-in period estimate.  A second order delay-locked loop on the
+   absolute frame times of the F8 messages, see Fons Adriaensen, "Using
+   a DLL to filter time".  The loop bandwidth is a fraction of the
+   clock rate, so it behaves the same at any tempo. */
+#define CLOCK_DLL_BW 0.01
+struct clock_dll {
+    uint32_t base;  // absolute frame time that t0 is relative to
+    double t0;      // filtered time of the last clock
+    double period;  // frames per clock
+    double jitter;  // running mean of the absolute phase error
+    uint32_t nb;    // clocks seen since reset, saturates at 2
+};
+static inline void clock_dll_reset(struct clock_dll *d) {
+    d->nb = 0;
+}
+static inline void clock_dll_update(struct clock_dll *d, uint32_t t) {
+    if (d->nb == 0) {
+        d->base = t;
+        d->t0 = 0;
+        d->nb = 1;
+        return;
+    }
+    double dt = (int32_t)(t - d->base);
+    if (d->nb == 1) {
+        d->period = dt;
+        d->jitter = 0;
+    }
+    else {
+        double e = dt - (d->t0 + d->period);
+        if ((e > 4 * d->period) || (e < -d->period)) {
+            /* Clock stopped or jumped.  Start over. */
+            d->nb = 0;
+            clock_dll_update(d, t);
+            return;
+        }
+        const double w = 2 * M_PI * CLOCK_DLL_BW;
+        d->t0 += d->period + M_SQRT2 * w * e;
+        d->period += w * w * e;
+        d->jitter += 0.01 * ((e < 0 ? -e : e) - d->jitter);
+        /* Keep t0 small. */
+        int32_t i = d->t0;
+        d->base += i;
+        d->t0 -= i;
+        return;
+    }
+    d->base = t;
+    d->t0 = 0;
+    d->nb = 2;
+}
+static inline int clock_dll_locked(const struct clock_dll *d) {
+    return d->nb == 2;
+}
+
+/* Scenes.  A scene is the set of patterns that play, all others are
+   muted.  Scenes are built off the RT path and copied in through the
+   command ring.  A switch is applied to all patterns in one sequencer
+   tick, at the next multiple of the switch quantum. */
+#define HUB_NB_SCENES 16
+#define SCENE_NONE 0xFF
+struct scene {
+    uint32_t play[HUB_NB_PATTERNS / 32];
+};
 
 struct app {
     struct sequencer sequencer;
+    struct sequencer_arena arena;
+    /* Notes sent by app_sequencer_tick() that are still sounding. */
+    struct sequencer_notes notes;
     uint32_t running;
+    /* Set by a command that needs to run again next period. */
+    uint32_t rt_cmd_again;
     jack_nframes_t nframes;
     uint8_t stamp;
 
@@ -76,39 +290,274 @@ struct app {
     struct remote remote;
     struct akai_fire fire;
 
-    /* midi out ports */
-    void *pd_out_buf;
-    void *transport_buf;
-    void *fire_out_buf;
+    /* MIDI port registry.  Inputs are processed in this order. */
+    struct midi_in midi_in[HUB_NB_MIDI_IN];
+    uint32_t nb_midi_in;
+    struct midi_out midi_out[HUB_NB_MIDI_OUT];
+    uint32_t nb_midi_out;
+    struct midi_out *pd_out_buf;
+    struct midi_out *transport_buf;
+    struct midi_out *fire_out_buf;
+    /* Swapped in by app_through_update(), read once per cycle. */
+    const struct midi_through_map *through;
+
+    /* cv out ports */
+    struct cv_out cv_out[NB_CV_OUT];
+
+    /* Sequencer output routing, and its resolved form. */
+    struct route route;
+    struct midi_out *route_midi[ROUTE_NB_MIDI];
+    struct midi_out *route_cv[ROUTE_NB_CV];
+
+    /* Groove offsets in frames, indexed by sequencer.groove_slot.
+       Template 0 is straight unless configured otherwise. */
+    uint16_t groove[SEQUENCER_GROOVE_NB * SEQUENCER_GROOVE_SLOTS];
+    struct groove_delay groove_delay;
+    /* Offset applied to the last note on of each port, channel and
+       key, reused for its note off. */
+    uint16_t note_groove[16][16][128];
+
+    /* Frame offset of the MIDI clock that is driving the current
+       sequencer tick. */
+    jack_nframes_t tick_time;
+
+    /* Clock-in period estimate, see handle_clock_est(). */
+    struct clock_dll clock_dll;
+
+    /* Sequencer ticks since start, for quantized scene switches. */
+    uint32_t song_tick;
+    struct scene scene[HUB_NB_SCENES];
+    uint8_t scene_pending;
+    uint32_t scene_quantum;
+
+    /* Wall clock time spent in sequencer_tick(), see handle_stats(). */
+    uint32_t tick_max_us;
+    uint32_t tick_over_budget;
+    /* log2 buckets: 0, 1, 2-3, ... microseconds */
+    uint32_t tick_us_hist[SEQUENCER_STATS_HIST];
 
     /* rolling time */
     uint32_t time;
 
+    /* Frame time at which the upstream recorder was started.  The
+       {record,...} timestamps are relative to this, so app->time is
+       never reset: it is the frame base for groove and the clock. */
+    uint32_t record_time;
+
 } app_state = {};
 
 #define BPM_TO_PERIOD(sr,bpm) ((sr*60)/(bpm*24))
 
+
+/* Main thread to JACK thread command channel.
+
+   The sequencer and the Fire state are owned by the JACK thread.  The
+   main thread prepares request data off the RT path, then posts a
+   closure to this single producer / single consumer ring.  The JACK
+   thread executes all pending closures at the start of the next
+   process() call, before the sequencer ticks, so each edit is applied
+   atomically with respect to playback.  A closure with more work than
+   fits in one period sets app->rt_cmd_again and is called again at
+   the next one.
+
+   rt_cmd_call() waits for completion, which allows the closure
+   context to live on the main thread's stack and to carry a result
+   back.  When there is no JACK thread to wait for, the main thread
+   runs the pending closures itself. */
+#define NB_RT_CMDS 16 // power of two
+typedef void (*rt_cmd_fn)(struct app *app, void *ctx);
+struct rt_cmd {
+    rt_cmd_fn fn;
+    void *ctx;
+};
+struct rt_cmd_ring {
+    struct rt_cmd cmd[NB_RT_CMDS];
+    uint32_t write; // only written by main thread
+    uint32_t read;  // only written by JACK thread
+} rt_cmd_ring = {};
+
+/* JACK thread. */
+static inline void rt_cmd_poll(struct app *app) {
+    struct rt_cmd_ring *r = &rt_cmd_ring;
+    uint32_t write = __atomic_load_n(&r->write, __ATOMIC_ACQUIRE);
+    uint32_t read = r->read;
+    while (read != write) {
+        struct rt_cmd *c = &r->cmd[read % NB_RT_CMDS];
+        app->rt_cmd_again = 0;
+        c->fn(app, c->ctx);
+        /* A command that spreads its work over several periods holds
+           back the ones behind it, so they see it done. */
+        if (app->rt_cmd_again) break;
+        read++;
+        __atomic_store_n(&r->read, read, __ATOMIC_RELEASE);
+    }
+}
+
+/* Main thread.  Returns 0 if the JACK thread is gone, after running
+   its pending commands. */
+static int rt_cmd_wait_active(void) {
+    if (__atomic_load_n(&client_active, __ATOMIC_ACQUIRE)) return 1;
+    rt_cmd_poll(&app_state);
+    return 0;
+}
+/* Main thread.  Returns the sequence number of the posted command. */
+static uint32_t rt_cmd_post(rt_cmd_fn fn, void *ctx) {
+    struct rt_cmd_ring *r = &rt_cmd_ring;
+    uint32_t write = r->write;
+    while (write - __atomic_load_n(&r->read, __ATOMIC_ACQUIRE) >= NB_RT_CMDS) {
+        /* Ring is full.  Buffer size should be chosen such that this
+           doesn't happen. */
+        if (!rt_cmd_wait_active()) break;
+        LOG("rt_cmd stall\n");
+        usleep(1000);
+    }
+    struct rt_cmd *c = &r->cmd[write % NB_RT_CMDS];
+    c->fn = fn;
+    c->ctx = ctx;
+    __atomic_store_n(&r->write, write + 1, __ATOMIC_RELEASE);
+    return write;
+}
+/* Main thread.  Wait until the JACK thread has executed the command
+   with sequence number seq, and all the ones before it. */
+static void rt_cmd_wait(uint32_t seq) {
+    struct rt_cmd_ring *r = &rt_cmd_ring;
+    while ((int32_t)(__atomic_load_n(&r->read, __ATOMIC_ACQUIRE) - seq) <= 0) {
+        if (!rt_cmd_wait_active()) break;
+        usleep(100);
+    }
+}
+static void rt_cmd_call(rt_cmd_fn fn, void *ctx) {
+    rt_cmd_wait(rt_cmd_post(fn, ctx));
+}
+
 static inline void *midi_out_buf_cleared(jack_port_t *port, jack_nframes_t nframes) {
     void *buf = jack_port_get_buffer(port, nframes);
     jack_midi_clear_buffer(buf);
     return buf;
 }
-// Send midi data out over a jack port.
-static inline void send_midi(void *out_buf, jack_nframes_t time,
+// Send midi data out over a jack port, at frame offset time.
+static inline void send_midi(struct midi_out *o, jack_nframes_t time,
                              const void *data_buf, size_t nb_bytes) {
     //LOG("%d %d %d\n", frames, time, (int)nb_bytes);
-    void *buf = jack_midi_event_reserve(out_buf, time, nb_bytes);
-    if (buf) memcpy(buf, data_buf, nb_bytes);
+    if ((o->nb_events >= MIDI_OUT_NB_EVENTS) ||
+        (o->nb_bytes + nb_bytes > MIDI_OUT_NB_BYTES)) {
+        o->nb_drop++;
+        return;
+    }
+    struct midi_out_event *e = &o->event[o->nb_events++];
+    e->time = time;
+    e->offset = o->nb_bytes;
+    e->nb_bytes = nb_bytes;
+    memcpy(&o->bytes[o->nb_bytes], data_buf, nb_bytes);
+    o->nb_bytes += nb_bytes;
 }
-static inline void send_cc(void *out_buf, int chan, int cc, int val) {
+static inline void send_cc(struct midi_out *o, jack_nframes_t time, int chan, int cc, int val) {
     const uint8_t midi[] = {0xB0 + (chan & 0x0F), cc & 0x7F, val & 0x7F};
-    send_midi(out_buf, 0, midi, sizeof(midi));
+    send_midi(o, time, midi, sizeof(midi));
 }
-static inline void send_control_byte(void *out_buf, uint8_t byte) {
-    send_midi(out_buf, 0, &byte, 1);
+static inline void send_control_byte(struct midi_out *o, jack_nframes_t time, uint8_t byte) {
+    send_midi(o, time, &byte, 1);
+}
+static inline void send_start(struct midi_out *o, jack_nframes_t time) { send_control_byte(o, time, 0xFA); }
+static inline void send_stop(struct midi_out *o, jack_nframes_t time)  { send_control_byte(o, time, 0xFC); }
+
+static inline void midi_out_begin(struct midi_out *o, jack_port_t *port, jack_nframes_t nframes) {
+    o->buf = midi_out_buf_cleared(port, nframes);
+    o->nb_events = 0;
+    o->nb_bytes = 0;
+}
+static inline void midi_out_flush(struct midi_out *o) {
+    /* Stable insertion sort.  This is close to O(n) since events are
+       already ordered per input port. */
+    struct midi_out_event *ev = o->event;
+    for (uint32_t i = 1; i < o->nb_events; i++) {
+        struct midi_out_event e = ev[i];
+        uint32_t j = i;
+        while ((j > 0) && (ev[j-1].time > e.time)) {
+            ev[j] = ev[j-1];
+            j--;
+        }
+        ev[j] = e;
+    }
+    for (uint32_t i = 0; i < o->nb_events; i++) {
+        void *buf = jack_midi_event_reserve(o->buf, ev[i].time, ev[i].nb_bytes);
+        if (buf) {
+            memcpy(buf, &o->bytes[ev[i].offset], ev[i].nb_bytes);
+        }
+        else {
+            o->nb_drop++;
+        }
+    }
+}
+
+/* The segment renderers are written as plain counted loops over
+   restrict pointers so they vectorize.  Ramps are computed from the
+   segment start instead of accumulated, so they don't drift. */
+static inline void cv_fill(jack_default_audio_sample_t *restrict dst,
+                           uint32_t n, float v) {
+    for (uint32_t i = 0; i < n; i++) dst[i] = v;
+}
+static inline void cv_ramp(jack_default_audio_sample_t *restrict dst,
+                           uint32_t n, float v, float inc) {
+    for (uint32_t i = 0; i < n; i++) dst[i] = v + inc * (float)(i + 1);
+}
+static inline void cv_out_render(struct cv_out *o, jack_nframes_t end) {
+    if (end <= o->pos) return;
+    jack_default_audio_sample_t *dst = o->buf + o->pos;
+    uint32_t n = end - o->pos;
+    o->pos = end;
+    float d = o->target - o->value;
+    if ((d != 0) && (o->slew > 0)) {
+        float inc = (d < 0) ? -o->slew : o->slew;
+        float ad = (d < 0) ? -d : d;
+        if (ad > o->slew * (float)n) {
+            /* Target is not reached in this segment. */
+            cv_ramp(dst, n, o->value, inc);
+            o->value += inc * (float)n;
+            return;
+        }
+        /* Ramp up to the target, then hold it. */
+        uint32_t nr = (uint32_t)(ad / o->slew);
+        cv_ramp(dst, nr, o->value, inc);
+        dst += nr;
+        n -= nr;
+    }
+    o->value = o->target;
+    cv_fill(dst, n, o->value);
+}
+static inline void send_cv(struct cv_out *o, jack_nframes_t time, uint16_t val) {
+    if (o->nb_events >= CV_OUT_NB_EVENTS) {
+        o->nb_drop++;
+        return;
+    }
+    struct cv_out_event *e = &o->event[o->nb_events++];
+    e->time = time;
+    e->val = val;
+}
+static inline void cv_out_begin(struct cv_out *o, jack_port_t *port, jack_nframes_t nframes) {
+    o->buf = jack_port_get_buffer(port, nframes);
+    o->pos = 0;
+    o->nb_events = 0;
+}
+static inline void cv_out_flush(struct cv_out *o, jack_nframes_t nframes) {
+    /* Same stable sort as midi_out_flush(), so of two events at the
+       same frame the last one sent sets the target. */
+    struct cv_out_event *ev = o->event;
+    for (uint32_t i = 1; i < o->nb_events; i++) {
+        struct cv_out_event e = ev[i];
+        uint32_t j = i;
+        while ((j > 0) && (ev[j-1].time > e.time)) {
+            ev[j] = ev[j-1];
+            j--;
+        }
+        ev[j] = e;
+    }
+    for (uint32_t i = 0; i < o->nb_events; i++) {
+        cv_out_render(o, ev[i].time);
+        o->target = (float)ev[i].val * (1.0f / 0xFFFF);
+    }
+    cv_out_render(o, nframes);
 }
-static inline void send_start(void *out_buf) { send_control_byte(out_buf, 0xFA); }
-static inline void send_stop(void *out_buf)  { send_control_byte(out_buf, 0xFC); }
 
 
 /* Erlang */
@@ -116,6 +565,71 @@ static inline void send_stop(void *out_buf)  { send_control_byte(out_buf, 0xFC);
 #define TO_ERL_SIZE (1 << TO_ERL_SIZE_LOG)
 static uint8_t to_erl_buf[TO_ERL_SIZE];
 static size_t to_erl_buf_bytes = 0;
+
+/* The JACK thread collects all messages for one period in to_erl_buf,
+   then commits them to a lock-free single producer / single consumer
+   byte ring.  A low priority output thread waits on a semaphore and
+   drains the ring to stdout, so a blocked pipe can't stall the
+   process callback.  If the ring doesn't have room, the whole period
+   is dropped to keep the {packet,4} framing intact. */
+#define ERL_OUT_SIZE_LOG 18
+#define ERL_OUT_SIZE (1 << ERL_OUT_SIZE_LOG)
+struct erl_out {
+    uint8_t buf[ERL_OUT_SIZE];
+    uint32_t write; // only written by JACK thread
+    uint32_t read;  // only written by output thread
+    sem_t sema;
+    pthread_t thread;
+    /* Statistics, written by JACK thread. */
+    uint32_t nb_drop_msg;   // did not fit in to_erl_buf
+    uint32_t nb_drop_block; // periods that did not fit in the ring
+    uint32_t nb_drop_bytes;
+    uint32_t max_fill;
+} erl_out = {};
+
+static void erl_out_commit(struct erl_out *o, const uint8_t *buf, uint32_t nb) {
+    uint32_t write = o->write;
+    uint32_t fill = write - __atomic_load_n(&o->read, __ATOMIC_ACQUIRE);
+    if (fill + nb > ERL_OUT_SIZE) {
+        o->nb_drop_block++;
+        o->nb_drop_bytes += nb;
+        return;
+    }
+    uint32_t offset = write % ERL_OUT_SIZE;
+    uint32_t nb1 = ERL_OUT_SIZE - offset;
+    if (nb1 > nb) nb1 = nb;
+    memcpy(&o->buf[offset], buf, nb1);
+    memcpy(&o->buf[0], buf + nb1, nb - nb1);
+    __atomic_store_n(&o->write, write + nb, __ATOMIC_RELEASE);
+    if (fill + nb > o->max_fill) o->max_fill = fill + nb;
+    sem_post(&o->sema);
+}
+static void *erl_out_thread_main(void *ctx) {
+    struct erl_out *o = ctx;
+    for(;;) {
+        ASSERT_ERRNO(sem_wait(&o->sema));
+        uint32_t write = __atomic_load_n(&o->write, __ATOMIC_ACQUIRE);
+        uint32_t read = o->read;
+        if (read == write) continue;
+        /* Messages can straddle the wrap point, so hold the lock
+           until both halves are written. */
+        pthread_mutex_lock(&stdout_mutex);
+        while (read != write) {
+            uint32_t offset = read % ERL_OUT_SIZE;
+            uint32_t nb = write - read;
+            if (offset + nb > ERL_OUT_SIZE) nb = ERL_OUT_SIZE - offset;
+            assert_write(1, &o->buf[offset], nb);
+            read += nb;
+            __atomic_store_n(&o->read, read, __ATOMIC_RELEASE);
+        }
+        pthread_mutex_unlock(&stdout_mutex);
+    }
+    return NULL;
+}
+static void erl_out_init(struct erl_out *o) {
+    ASSERT_ERRNO(sem_init(&o->sema, 0, 0));
+    ASSERT(0 == pthread_create(&o->thread, NULL, erl_out_thread_main, o));
+}
 //static uint32_t to_erl_room(void) {
 //    uint32_t free_bytes = sizeof(to_erl_buf) - to_erl_buf_bytes;
 //    if (free_bytes >= 6) return free_bytes - 6;
@@ -125,6 +639,7 @@ static uint8_t *to_erl_hole_8(int nb, uint16_t port) {
     size_t msg_size = 8 + nb;
     if (to_erl_buf_bytes + msg_size > sizeof(to_erl_buf)) {
         LOG("erl buffer overflow\n");
+        erl_out.nb_drop_msg++;
         return NULL;
     }
     uint8_t *msg = &to_erl_buf[to_erl_buf_bytes];
@@ -141,6 +656,7 @@ static uint8_t *to_erl_hole_6(int nb) {
     size_t msg_size = 6 + nb;
     if (to_erl_buf_bytes + msg_size > sizeof(to_erl_buf)) {
         LOG("erl buffer overflow\n");
+        erl_out.nb_drop_msg++;
         return NULL;
     }
     uint8_t *msg = &to_erl_buf[to_erl_buf_bytes];
@@ -164,6 +680,7 @@ static void to_erl_ptermvf(const char *fmt, va_list ap) {
     char *pterm = NULL;
     ASSERT(-1 != vasprintf(&pterm, fmt, ap));
     to_erl_pterm(pterm);
+    free(pterm);
 }
 // FIXME: This is so common it deserves a macro in uc_tools
 static void to_erl_ptermf(const char *fmt, ...) {
@@ -173,54 +690,234 @@ static void to_erl_ptermf(const char *fmt, ...) {
     va_end(ap);
 }
 
+/* Non-RT threads bypass to_erl_buf, which is owned by the JACK
+   thread, and write directly. */
+static void to_erl_ptermf_nrt(const char *fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+    char *pterm = NULL;
+    ASSERT(-1 != vasprintf(&pterm, fmt, ap));
+    va_end(ap);
+    uint32_t nb = strlen(pterm);
+    uint8_t hdr[6];
+    set_u32be(hdr, nb + 2); // {packet,4}
+    set_u16be(hdr+4, 0xFFEE); // TAG_PTERM
+    pthread_mutex_lock(&stdout_mutex);
+    assert_write(1, hdr, sizeof(hdr));
+    assert_write(1, (const uint8_t*)pterm, nb);
+    pthread_mutex_unlock(&stdout_mutex);
+    free(pterm);
+}
+
 static void to_erl_midi(const uint8_t *buf, int nb, uint8_t port) {
     uint8_t *hole = to_erl_hole_8(nb, port);
     if (hole) { memcpy(hole, buf, nb); }
 }
 
-static inline void process_z_debug(struct app *app) {
-    FOR_MIDI_EVENTS(iter, z_debug, app->nframes) {
+static inline void process_debug_in(struct app *app, struct midi_in *in) {
+    FOR_MIDI_EVENTS(iter, in->port, app->nframes) {
         const uint8_t *msg = iter.event.buffer;
         int n = iter.event.size;
         LOG_HEX("z_debug:", msg, n);
     }
 }
 
-void app_sequencer_tick(struct sequencer *seq, const union pattern_event *ev) {
-    struct app *app = (void*)seq;
+static void app_emit(struct app *app, jack_nframes_t time, const union pattern_event *ev) {
     const uint8_t *msg = ev->u8;
     LOG("tick %02x %02x %02x %02x\n", msg[0], msg[1], msg[2], msg[3]);
 
     if (msg[0] < 16) {
-        // FIXME: msg[0] is midi port, make numerical mapping
-        send_midi(app->pd_out_buf, 0, msg + 1, 3);
+        struct midi_out *out = app->route_midi[msg[0]];
+        if (out) {
+            send_midi(out, time, msg + 1, 3);
+            sequencer_notes_update(&app->notes, ev);
+        }
+    }
+    else if (msg[0] == PAT_CV_TAG) {
+        uint8_t chan = msg[1];
+        if (chan < NB_CV_OUT) {
+            send_cv(&app->cv_out[chan], time, ev->u16[1]);
+        }
+        /* CV can also go out as 14 bit pitch bend, on the MIDI
+           channel that has the same number as the CV channel. */
+        struct midi_out *out = chan < ROUTE_NB_CV ? app->route_cv[chan] : NULL;
+        if (out) {
+            uint16_t val = ev->u16[1] >> 2;
+            uint8_t bend[] = { 0xE0 | chan, val & 0x7F, val >> 7 };
+            send_midi(out, time, bend, sizeof(bend));
+        }
     }
     else {
         LOG("unsupported event tag %d\n", msg[0]);
     }
 }
 
+/* Queue an event at absolute frame time, after any event with the
+   same time.  If the queue is full it goes out at the end of the
+   current period, which is late but doesn't lose note offs. */
+static void app_groove_defer(struct app *app, uint32_t time, pattern_t pat,
+                             const union pattern_event *ev) {
+    struct groove_delay *d = &app->groove_delay;
+    if (d->nb >= GROOVE_DELAY_NB) {
+        d->nb_late++;
+        app_emit(app, app->nframes - 1, ev);
+        return;
+    }
+    uint32_t i = d->nb++;
+    while ((i > 0) && ((int32_t)(d->event[i-1].time - time) > 0)) {
+        d->event[i] = d->event[i-1];
+        i--;
+    }
+    d->event[i].time = time;
+    d->event[i].pattern = pat;
+    d->event[i].event = *ev;
+}
+/* Emit the queued events that fall in the current period. */
+static inline void app_groove_flush(struct app *app) {
+    struct groove_delay *d = &app->groove_delay;
+    uint32_t n = 0;
+    while (n < d->nb) {
+        int32_t t = d->event[n].time - app->time;
+        if (t >= (int32_t)app->nframes) break;
+        app_emit(app, t > 0 ? t : 0, &d->event[n].event);
+        n++;
+    }
+    if (n) {
+        d->nb -= n;
+        memmove(&d->event[0], &d->event[n], d->nb * sizeof(d->event[0]));
+    }
+}
+/* Drop pending events of a pattern that is being muted or cleared,
+   so no note on goes out after its note offs. */
+static inline void app_groove_drop_pattern(struct app *app, pattern_t pat) {
+    struct groove_delay *d = &app->groove_delay;
+    uint32_t j = 0;
+    for (uint32_t i = 0; i < d->nb; i++) {
+        if (d->event[i].pattern != pat) d->event[j++] = d->event[i];
+    }
+    d->nb = j;
+}
+
+/* Sequencer dispatch.  The groove offset is a single table lookup;
+   events that don't fit in the current period are deferred.  A note
+   off takes the offset of its note on instead of that of its own
+   slot, so it can't go out before the note on when the note on's slot
+   has the larger offset. */
+void app_sequencer_tick(struct sequencer *seq, const union pattern_event *ev) {
+    struct app *app = (void*)seq;
+    uint32_t offset = app->groove[seq->groove_slot];
+    int on;
+    if (sequencer_event_is_note(ev, &on)) {
+        uint16_t *g = &app->note_groove[ev->u8[0]][ev->u8[1] & 0x0F][ev->u8[2] & 0x7F];
+        if (on) { *g = offset; } else { offset = *g; }
+    }
+    jack_nframes_t time = app->tick_time + offset;
+    if (time < app->nframes) {
+        app_emit(app, time, ev);
+    }
+    else {
+        app_groove_defer(app, app->time + time, seq->pattern, ev);
+    }
+}
+
+/* Note offs for hanging notes go out at app->tick_time, on the
+   output the note's port is currently routed to. */
+static void app_note_off(void *ctx, const union pattern_event *ev) {
+    struct app *app = ctx;
+    struct midi_out *out = app->route_midi[ev->u8[0]];
+    if (out) {
+        send_midi(out, app->tick_time, ev->u8 + 1, 3);
+    }
+}
+static inline void app_release_all(struct app *app, jack_nframes_t time) {
+    app->groove_delay.nb = 0;
+    app->tick_time = time;
+    sequencer_notes_release_all(&app->notes, app_note_off, app);
+}
+/* For pattern edits that come in through the command ring, which is
+   handled before the clock input.  Use the end of the period so the
+   note offs are sorted after any note on of this period. */
+static inline void app_release_pattern(struct app *app, pattern_t pat) {
+    app_groove_drop_pattern(app, pat);
+    app->tick_time = app->nframes - 1;
+    sequencer_notes_release_pattern(&app->sequencer, &app->notes, pat,
+                                    app_note_off, app);
+}
+
+/* Switch to the pending scene.  Runs before the sequencer tick, so
+   the new mute states apply to the events of that tick, and note offs
+   go out at app->tick_time. */
+void app_pattern_state(struct sequencer *s, pattern_t pat, int state);
+static void app_scene_apply(struct app *app) {
+    struct sequencer *s = &app->sequencer;
+    const struct scene *sc = &app->scene[app->scene_pending];
+    app->scene_pending = SCENE_NONE;
+    FOR_SEQUENCER_PATTERNS(s, ip) {
+        pattern_t pat = ip.pattern_nb;
+        struct pattern_phase *pp = sequencer_pattern(s, pat);
+        if (pattern_phase_used != pattern_phase_lifecycle(pp)) continue;
+        uint32_t mute = !((sc->play[pat / 32] >> (pat % 32)) & 1);
+        if (mute == pp->mute) continue;
+        pp->mute = mute;
+        if (mute) {
+            app_groove_drop_pattern(app, pat);
+            sequencer_notes_release_pattern(s, &app->notes, pat,
+                                            app_note_off, app);
+        }
+        app_pattern_state(s, pat, !mute);
+    }
+}
+static inline void app_scene_poll(struct app *app) {
+    if ((app->scene_pending != SCENE_NONE) &&
+        (app->song_tick % app->scene_quantum == 0)) {
+        app_scene_apply(app);
+    }
+}
+
 static inline void app_play(struct app *app) {
     LOG("app_play %d->1\n", app->running);
+    clock_dll_reset(&app->clock_dll);
+    app->song_tick = 0;
     app->running = 1;
 }
 static inline void app_continue(struct app *app) {
     LOG("app_continue\n");
+    clock_dll_reset(&app->clock_dll);
     app->running = 1;
 }
 static inline void app_pause(struct app *app) {
     LOG("app_pause\n");
     app->running = 0;
 }
-static inline void app_stop(struct app *app) {
+static inline void app_stop(struct app *app, jack_nframes_t time) {
     LOG("app_stop %d->0\n", app->running);
     app->running = 0;
+    app_release_all(app, time);
     sequencer_restart(&app->sequencer);
 }
 
 
-static inline void process_clock_in(struct app *app) {
-    FOR_MIDI_EVENTS(iter, clock_in, app->nframes) {
+static inline void app_tick_time(struct app *app, jack_time_t us) {
+    if (us > app->tick_max_us) app->tick_max_us = us;
+    if (us > HUB_TICK_BUDGET_US) app->tick_over_budget++;
+    uint32_t bucket = us ? 64 - __builtin_clzll(us) : 0;
+    if (bucket >= SEQUENCER_STATS_HIST) bucket = SEQUENCER_STATS_HIST - 1;
+    app->tick_us_hist[bucket]++;
+}
+static inline void app_tick(struct app *app, jack_nframes_t time) {
+    app->tick_time = time;
+    jack_time_t t0 = jack_get_time();
+    app_scene_poll(app);
+    sequencer_tick(&app->sequencer);
+    app_tick_time(app, jack_get_time() - t0);
+    app->song_tick++;
+}
+static inline void app_clock(struct app *app, jack_nframes_t time) {
+    clock_dll_update(&app->clock_dll, app->time + time);
+    app_tick(app, time);
+}
+static inline void process_clock_in(struct app *app, struct midi_in *in) {
+    FOR_MIDI_EVENTS(iter, in->port, app->nframes) {
         const uint8_t *msg = iter.event.buffer;
         if (iter.event.size == 1) {
             switch(msg[0]) {
@@ -232,12 +929,12 @@ static inline void process_clock_in(struct app *app) {
                 app_continue(app);
                 break;
             case 0xFC: // stop
-                app_stop(app);
+                app_stop(app, iter.event.time);
                 break;
             case 0xF8: { // clock
                 // LOG("tick, running=%d\n", app->running);
                 if (app->running) {
-                    sequencer_tick(&app->sequencer);
+                    app_clock(app, iter.event.time);
                 }
                 break;
             }
@@ -248,12 +945,12 @@ static inline void process_clock_in(struct app *app) {
 
 // FIXME: I want a simpler midi dispatch construct.
 
-static inline void process_easycontrol_in(struct app *app) {
-    FOR_MIDI_EVENTS(iter, easycontrol, app->nframes) {
+static inline void process_easycontrol_in(struct app *app, struct midi_in *in) {
+    FOR_MIDI_EVENTS(iter, in->port, app->nframes) {
         const uint8_t *msg = iter.event.buffer;
         int n = iter.event.size;
-        /* Send a copy to Erlang.  FIXME: How to allocate midi port numbers? */
-        to_erl_midi(msg, n, 0 /*midi port*/);
+        /* Send a copy to Erlang. */
+        to_erl_midi(msg, n, in->erl_port);
         if (n == 3) {
             switch(msg[0]) {
             case 0xb0: {
@@ -264,14 +961,14 @@ static inline void process_easycontrol_in(struct app *app) {
                         if (!val) {
                             /* Play press. */
                             LOG("easycontrol: start\n");
-                            send_start(app->transport_buf);
+                            send_start(app->transport_buf, iter.event.time);
                         }
                         break;
                     case 0x2e:
                         if (!val) {
                             /* Stop press. */
                             LOG("easycontrol: stop\n");
-                            send_stop(app->transport_buf);
+                            send_stop(app->transport_buf, iter.event.time);
                         }
                         break;
                 }
@@ -282,20 +979,20 @@ static inline void process_easycontrol_in(struct app *app) {
     }
 }
 
-static inline void process_keystation_in1(struct app *app) {
-    FOR_MIDI_EVENTS(iter, keystation_in1, app->nframes) {
+static inline void process_keystation1_in(struct app *app, struct midi_in *in) {
+    FOR_MIDI_EVENTS(iter, in->port, app->nframes) {
         const uint8_t *msg = iter.event.buffer;
         int n = iter.event.size;
-        /* Send a copy to Erlang.  FIXME: How to allocate midi port numbers? */
-        to_erl_midi(msg, n, 1 /*midi port*/);
+        /* Send a copy to Erlang. */
+        to_erl_midi(msg, n, in->erl_port);
     }
 }
-static inline void process_keystation_in2(struct app *app) {
-    FOR_MIDI_EVENTS(iter, keystation_in2, app->nframes) {
+static inline void process_keystation2_in(struct app *app, struct midi_in *in) {
+    FOR_MIDI_EVENTS(iter, in->port, app->nframes) {
         const uint8_t *msg = iter.event.buffer;
         int n = iter.event.size;
-        /* Send a copy to Erlang.  FIXME: How to allocate midi port numbers? */
-        to_erl_midi(msg, n, 2 /*midi port*/);
+        /* Send a copy to Erlang. */
+        to_erl_midi(msg, n, in->erl_port);
         if (n == 3) {
             switch(msg[0]) {
             case 0x90: { /* Note on */
@@ -305,14 +1002,14 @@ static inline void process_keystation_in2(struct app *app) {
                     case 0x5e:
                         /* Play press. */
                         LOG("keystation: start\n");
-                        send_start(app->transport_buf);
+                        send_start(app->transport_buf, iter.event.time);
                         app_play(app);
                         break;
                     case 0x5d:
                         /* Stop press. */
                         LOG("keystation: stop\n");
-                        send_stop(app->transport_buf);
-                        app_stop(app);
+                        send_stop(app->transport_buf, iter.event.time);
+                        app_stop(app, iter.event.time);
                         break;
                 }
                 break;
@@ -322,23 +1019,24 @@ static inline void process_keystation_in2(struct app *app) {
     }
 }
 
-void pd_midi(struct app *app, const uint8_t *msg, size_t len) {
+void pd_midi(struct app *app, jack_nframes_t time, const uint8_t *msg, size_t len) {
     /* Jack midi port connected to pd_io object, which takes jack midi
      * in and converts it to netsend into Pd. */
-    send_midi(app->pd_out_buf, 0, msg, len);
+    send_midi(app->pd_out_buf, time, msg, len);
     /* Send a copy to Erlang. */
     to_erl_midi(msg, len, 4 /* midi port */);
 }
-void pd_cc(struct app *app, uint8_t ctrl, uint8_t val) {
+void pd_cc(struct app *app, jack_nframes_t time, uint8_t ctrl, uint8_t val) {
     // Map it back to a CC after stateful processing
     uint8_t msg[] = {
         0xB0 + (app->remote.sel & 0x0F),
         ctrl & 0x7F,
         val & 0x7F
     };
-    pd_midi(app, msg, sizeof(msg));
+    pd_midi(app, time, msg, sizeof(msg));
 }
-void pd_note(struct app *app, uint8_t on_off, uint8_t note, uint8_t vel) {
+void pd_note(struct app *app, jack_nframes_t time,
+             uint8_t on_off, uint8_t note, uint8_t vel) {
     // Route it to the proper channel
     union pattern_event ev = {
         .u8 = {
@@ -350,7 +1048,7 @@ void pd_note(struct app *app, uint8_t on_off, uint8_t note, uint8_t vel) {
     };
     struct sequencer *s = &app->sequencer;
     const uint8_t *msg = &ev.u8[1];
-    pd_midi(app, msg, 3);
+    pd_midi(app, time, msg, 3);
 
     // Recording
     if (app->remote.record) {
@@ -369,7 +1067,7 @@ void pd_note(struct app *app, uint8_t on_off, uint8_t note, uint8_t vel) {
             /* If the player is off, we send the events upstream. */
             to_erl_ptermf(
                 "{record,{%d,<<%d,%d,%d,%d>>}}",
-                app->time,
+                app->time - app->record_time,
                 PAT_MIDI_TAG(0), // FIXME: ports
                 msg[0], msg[1], msg[2]);
         }
@@ -379,10 +1077,10 @@ void pd_note(struct app *app, uint8_t on_off, uint8_t note, uint8_t vel) {
 
 /* TODO: Wrap this in an abstract MIDI api. */
 
-static inline void process_remote_in(struct app *app) {
+static inline void process_remote_in(struct app *app, struct midi_in *in) {
     struct remote *r = &app->remote;
     struct sequencer *s = &app->sequencer;
-    FOR_MIDI_EVENTS(iter, remote_in, app->nframes) {
+    FOR_MIDI_EVENTS(iter, in->port, app->nframes) {
         const uint8_t *msg = iter.event.buffer;
         int n = iter.event.size;
         /* Send a copy to Erlang.  FIXME: How to allocate midi port numbers? */
@@ -394,7 +1092,7 @@ static inline void process_remote_in(struct app *app) {
                 /* Route it to the current track. */
                 uint8_t note = msg[1];
                 uint8_t vel = msg[2];
-                pd_note(app, tag, note, vel);
+                pd_note(app, iter.event.time, tag, note, vel);
                 break;
             }
             case 0xB0: {
@@ -405,33 +1103,33 @@ static inline void process_remote_in(struct app *app) {
                 if (cc <= 7) {
                     uint8_t slider = cc;
                     r->sel = slider;
-                    pd_cc(app, 0, val);
+                    pd_cc(app, iter.event.time, 0, val);
                 }
                 else if (cc <= 15) {
                     uint8_t slider_but = cc - 8;
                     r->sel = slider_but;
-                    pd_cc(app, 1, val);
+                    pd_cc(app, iter.event.time, 1, val);
                 }
                 else if (cc <= 23) {
                     uint8_t knob = cc - 16;
                     r->sel = knob;
-                    pd_cc(app, 2, val);
+                    pd_cc(app, iter.event.time, 2, val);
                 }
                 else if (cc <= 31) {
                     uint8_t knob_but = cc - 24;
                     r->sel = knob_but;
-                    pd_cc(app, 3, val);
+                    pd_cc(app, iter.event.time, 3, val);
                 }
                 else if (cc <= 39) {
                     uint8_t rotary = cc - 32;
                     // local to r->sel
                     // FIXME: do rotary processing
-                    pd_cc(app, 4 + rotary, val);
+                    pd_cc(app, iter.event.time, 4 + rotary, val);
                 }
                 else if (cc <= 47) {
                     uint8_t rotary_but = cc - 40;
                     // local to r->sel
-                    pd_cc(app, 4 + 8 + rotary_but, val);
+                    pd_cc(app, iter.event.time, 4 + 8 + rotary_but, val);
                 }
                 else if (cc == 0x32) {
                     // stop
@@ -448,11 +1146,11 @@ static inline void process_remote_in(struct app *app) {
                                 to_erl_pterm("{record,stop}");
                             }
                             app->remote.record = 0;
-                            app_stop(app);
+                            app_stop(app, iter.event.time);
                         }
                         else {
-                            send_stop(app->transport_buf);
-                            app_stop(app);
+                            send_stop(app->transport_buf, iter.event.time);
+                            app_stop(app, iter.event.time);
                         }
                     }
                 }
@@ -463,7 +1161,7 @@ static inline void process_remote_in(struct app *app) {
                             to_erl_pterm("{record,play}}");
                         }
                         else {
-                            send_start(app->transport_buf);
+                            send_start(app->transport_buf, iter.event.time);
                             LOG("remote play->app_play\n");
                             app_play(app);
                         }
@@ -477,7 +1175,7 @@ static inline void process_remote_in(struct app *app) {
                        off when stop is pressed.  Assume that the
                        initial state is off.  It's not sending the LED
                        state. */
-                    to_erl_midi(msg, n, 3 /*midi port*/);
+                    to_erl_midi(msg, n, in->erl_port);
                     if (val == 0) {
                         app->remote.record = !app->remote.record;
                         if (app->running) {
@@ -499,7 +1197,7 @@ static inline void process_remote_in(struct app *app) {
                                processing and tempo + pattern
                                config. */
                             if (app->remote.record) {
-                                app->time = 0;
+                                app->record_time = app->time;
                                 to_erl_pterm("{record,start}");
                             }
                             else {
@@ -513,26 +1211,26 @@ static inline void process_remote_in(struct app *app) {
                     }
                 }
                 else {
-                    to_erl_midi(msg, n, 3 /*midi port*/);
+                    to_erl_midi(msg, n, in->erl_port);
                 }
                 break;
             }
             default: {
-                to_erl_midi(msg, n, 3 /*midi port*/);
+                to_erl_midi(msg, n, in->erl_port);
                 break;
             }
             }
         }
         else {
-            to_erl_midi(msg, n, 3 /*midi port*/);
+            to_erl_midi(msg, n, in->erl_port);
         }
     }
 }
 
-static inline void process_uma_in(struct app *app) {
+static inline void process_uma_in(struct app *app, struct midi_in *in) {
     // Just reuse the remote25 struct. Never used together.
     struct remote *r = &app->remote;
-    FOR_MIDI_EVENTS(iter, uma_in, app->nframes) {
+    FOR_MIDI_EVENTS(iter, in->port, app->nframes) {
         const uint8_t *msg = iter.event.buffer;
         int n = iter.event.size;
         /* Send a copy to Erlang.  FIXME: How to allocate midi port numbers? */
@@ -546,7 +1244,7 @@ static inline void process_uma_in(struct app *app) {
                 uint8_t note = msg[1];
                 uint8_t vel = msg[2];
                 LOG("note %d %d\n", note, vel);
-                pd_note(app, tag, note, vel);
+                pd_note(app, iter.event.time, tag, note, vel);
                 break;
             }
             case 0xB0: {
@@ -555,7 +1253,7 @@ static inline void process_uma_in(struct app *app) {
                 uint8_t cc = msg[1];
                 uint8_t val = msg[2];
                 if (cc == 25) {
-                    app_stop(app);
+                    app_stop(app, iter.event.time);
                 }
                 else if (cc == 26) {
                     app_pause(app);
@@ -566,6 +1264,7 @@ static inline void process_uma_in(struct app *app) {
                 else if (cc == 28) {
                     if (val == 0) {
                         LOG("rec on\n");
+                        app->record_time = app->time;
                         to_erl_pterm("{record,start}");
                         r->record = 1;
                     }
@@ -582,72 +1281,132 @@ static inline void process_uma_in(struct app *app) {
                 LOG("CC %d %d\n", cc, val);
             }
             default:
-                to_erl_midi(msg, n, 6 /*midi port*/);
+                to_erl_midi(msg, n, in->erl_port);
                 break;
             }
         }
         else {
-            to_erl_midi(msg, n, 6 /*midi port*/);
+            to_erl_midi(msg, n, in->erl_port);
         }
     }
 }
-
-
+static inline void process_fire_in(struct app *app, struct midi_in *in) {
+    void *fire_in_buf = jack_port_get_buffer(in->port, app->nframes);
+    akai_fire_process(&app->fire, app->fire_out_buf->buf, fire_in_buf);
+}
+/* For devices that are handled in Erlang. */
+static inline void process_erl_in(struct app *app, struct midi_in *in) {
+    FOR_MIDI_EVENTS(iter, in->port, app->nframes) {
+        to_erl_midi(iter.event.buffer, iter.event.size, in->erl_port);
+    }
+}
+/* For inputs that are only routed by the through table. */
+static inline void process_through_in(struct app *app, struct midi_in *in) {
+}
+#define DEF_MIDI_IN_HANDLER_FN(name) process_##name##_in,
+static const midi_in_fn midi_in_handler_fn[NB_MIDI_IN_HANDLER] = {
+    FOR_MIDI_IN_HANDLER(DEF_MIDI_IN_HANDLER_FN)
+};
+#define DEF_MIDI_IN_HANDLER_NAME(name) #name "\n"
+static const char midi_in_handler_names[] = FOR_MIDI_IN_HANDLER(DEF_MIDI_IN_HANDLER_NAME);
 
 
 static inline void process_erl_out(struct app *app) {
     /* Send to Erlang
 
-       Note: I'm not exactly sure whether it is a good idea to perform
-       the write() call from this thread, but it seems the difference
-       between a single semaphore system call and a single write to an
-       Erlang port pipe accessing a single page of memory is not going
-       to be big.  So revisit if it ever becomes a problem.
-
-       This will buffer all midi messages and perform only a single
-       write() call.
-
-    */
+       All messages produced during this period are handed to the
+       output thread in one block.  The write() call happens there. */
 
     if (to_erl_buf_bytes) {
         //LOG("buf_bytes = %d\n", (int)to_erl_buf_bytes);
-        assert_write(1, to_erl_buf, to_erl_buf_bytes);
+        erl_out_commit(&erl_out, to_erl_buf, to_erl_buf_bytes);
         to_erl_buf_bytes = 0;
     }
 
 }
 
+static inline void app_route_resolve(struct app *app) {
+    for (int i = 0; i < ROUTE_NB_MIDI; i++) {
+        uint8_t o = app->route.midi[i];
+        app->route_midi[i] = (o < app->nb_midi_out) ? &app->midi_out[o] : NULL;
+    }
+    for (int i = 0; i < ROUTE_NB_CV; i++) {
+        uint8_t o = app->route.cv[i];
+        app->route_cv[i] = (o < app->nb_midi_out) ? &app->midi_out[o] : NULL;
+    }
+}
+
+struct through_ctx {
+    struct app *app;
+    jack_nframes_t time;
+};
+static void app_through_send(void *ctx, uint32_t out, const uint8_t *msg, uint32_t len) {
+    struct through_ctx *c = ctx;
+    if (out < c->app->nb_midi_out) {
+        send_midi(&c->app->midi_out[out], c->time, msg, len);
+    }
+}
+static inline void app_through(struct app *app, const struct midi_through_map *map,
+                               struct midi_in *in) {
+    if (!midi_through_active(map, in->through_slot)) return;
+    struct through_ctx c = { .app = app };
+    FOR_MIDI_EVENTS(iter, in->port, app->nframes) {
+        c.time = iter.event.time;
+        midi_through_event(map, in->through_slot,
+                           iter.event.buffer, iter.event.size,
+                           app_through_send, &c);
+    }
+}
+
 static void app_process(struct app *app) {
 
     /* Erlang out is tagged with a rolling time stamp. */
     jack_nframes_t f = jack_last_frame_time(client);
     app->stamp = (f / app->nframes);
 
-    /* Order is important. */
-    process_clock_in(app);
-    process_easycontrol_in(app);
-    process_keystation_in1(app);
-    process_keystation_in2(app);
-    process_remote_in(app);
-    process_uma_in(app);
+    /* Order is important.  Apply edits before the sequencer ticks. */
+    rt_cmd_poll(app);
+    app_route_resolve(app);
+    app_groove_flush(app);
+    const struct midi_through_map *through =
+        __atomic_load_n(&app->through, __ATOMIC_ACQUIRE);
+    /* In registration order, which puts the clock input first. */
+    for (uint32_t i = 0; i < app->nb_midi_in; i++) {
+        struct midi_in *in = &app->midi_in[i];
+        app_through(app, through, in);
+        in->process(app, in);
+    }
+    /* Without ticks, edits made while stopped are compacted here. */
+    if (!app->running) {
+        sequencer_compact(&app->sequencer, app->sequencer.compact.budget);
+    }
     process_erl_out(app);
 
-    /* FIXME: Normalize this. */
-    void *fire_in_buf = jack_port_get_buffer(fire_in, app->nframes);
-    akai_fire_process(&app->fire, app->fire_out_buf, fire_in_buf);
-
-    process_z_debug(app);
-
 }
 
+static struct jack_load jack_load;
 static int process (jack_nframes_t nframes, void *arg) {
+    jack_time_t t0 = jack_load_begin(&jack_load);
     struct app *app = &app_state;
     app->nframes = nframes;
-    app->pd_out_buf    = midi_out_buf_cleared(pd_out, nframes);
-    app->transport_buf = midi_out_buf_cleared(transport, nframes);
-    app->fire_out_buf  = midi_out_buf_cleared(fire_out, nframes);
+    for (uint32_t i = 0; i < app->nb_midi_out; i++) {
+        midi_out_begin(&app->midi_out[i], app->midi_out[i].port, nframes);
+    }
+    for (int i = 0; i < NB_CV_OUT; i++) {
+        cv_out_begin(&app->cv_out[i], *cv_out_port[i], nframes);
+    }
     app_process(app);
+    /* Note that akai_fire_process() writes its sysex directly to the
+       JACK buffer at time 0, which is fine as staged events are
+       written after that. */
+    for (uint32_t i = 0; i < app->nb_midi_out; i++) {
+        midi_out_flush(&app->midi_out[i]);
+    }
+    for (int i = 0; i < NB_CV_OUT; i++) {
+        cv_out_flush(&app->cv_out[i], nframes);
+    }
     app->time += nframes;
+    jack_load_end(&jack_load, t0, nframes);
     return 0;
 }
 
@@ -732,101 +1491,432 @@ int handle_jack_port(struct tag_u32 *req) {
 
 // Important here is to create a locking mechanism: during the
 // traversal from the other thread, the data structure cannot be
-// modified.
-int handle_lock(struct tag_u32 *req) {
-    return -1;
-}
-int handle_unlock(struct tag_u32 *req) {
-    return -1;
-}
-
-
-int handle_list_patterns(struct tag_u32 *req) {
-    struct app *app = req->context;
+// modified.  This is solved by running the traversal on the JACK
+// thread through rt_cmd_call(), copying the data out into a buffer
+// owned by the main thread.
+
+struct list_patterns_cmd {
+    pattern_t pat[HUB_NB_PATTERNS];
+    size_t nb_patterns;
+};
+static void list_patterns_rt(struct app *app, void *ctx) {
+    struct list_patterns_cmd *c = ctx;
     struct sequencer *s = &app->sequencer;
-
-    // ASSERT LOCKED
-
-    /* The size information is implicit, so we count nb_patterns
-       before we can allocate. */
-    size_t nb_patterns = 0;
-    FOR_SEQUENCER_PATTERNS(s, ip) {
-        struct pattern_phase *pp = sequencer_pattern(s, ip.pattern_nb);
-        if (pattern_phase_used == pattern_phase_lifecycle(pp)) {
-            nb_patterns++;
-        }
-    }
-    size_t nb_bytes = sizeof(pattern_t) * nb_patterns;
-    pattern_t *pat = alloca(nb_bytes);
-    size_t i = 0;
-
-    /* Iterate a second time to record the patterns. */
+    c->nb_patterns = 0;
     FOR_SEQUENCER_PATTERNS(s, ip) {
         struct pattern_phase *pp = sequencer_pattern(s, ip.pattern_nb);
         if (pattern_phase_used == pattern_phase_lifecycle(pp)) {
-            pat[i++] = ip.pattern_nb;
+            c->pat[c->nb_patterns++] = ip.pattern_nb;
         }
     }
+}
+int handle_list_patterns(struct tag_u32 *req) {
+    struct list_patterns_cmd c;
+    rt_cmd_call(list_patterns_rt, &c);
     // FIXME: This could just as well send u32
-    SEND_REPLY_TAG_U32_BYTES(req, (uint8_t*)pat, nb_bytes, 0 /* ok */);
+    SEND_REPLY_TAG_U32_BYTES(req, (uint8_t*)c.pat,
+                             sizeof(pattern_t) * c.nb_patterns, 0 /* ok */);
     return 0;
 }
 struct pattern_step_ser {
     uint32_t u32;
     uint16_t delay;
 } __attribute__((__packed__));
+
+struct save_pattern_cmd {
+    pattern_t pattern_nb;
+    int ok;
+    /* A pattern can't be larger than the step pool. */
+    struct pattern_step_ser step[HUB_NB_STEPS];
+    size_t nb_steps;
+};
+static void save_pattern_rt(struct app *app, void *ctx) {
+    struct save_pattern_cmd *c = ctx;
+    struct sequencer *s = &app->sequencer;
+    struct pattern_phase *pp = sequencer_pattern(s, c->pattern_nb);
+    c->ok = (pattern_phase_used == pattern_phase_lifecycle(pp));
+    if (!c->ok) return;
+    size_t i = 0;
+    FOR_SEQUENCER_STEPS(s, c->pattern_nb, is) {
+        ASSERT(i < HUB_NB_STEPS);
+        c->step[i].u32 = is.step->event.u32;
+        c->step[i].delay = is.step->delay;
+        i++;
+    }
+    c->nb_steps = i;
+}
 int handle_save_pattern(struct tag_u32 *req) {
     TAG_U32_UNPACK(req, 0, m, pattern_nb) {
-        struct app *app = req->context;
-        struct sequencer *s = &app->sequencer;
-        struct pattern_phase *pp = sequencer_pattern(s, m->pattern_nb);
-        if (pattern_phase_used != pattern_phase_lifecycle(pp)) {
-            LOG("unused pattern %d\n", m->pattern_nb);
+        if (m->pattern_nb >= HUB_NB_PATTERNS) {
+            LOG("bad pattern %d\n", m->pattern_nb);
             return reply_error(req);
         }
-        /* Iterate once to find size. */
-        size_t nb_steps = 0;
-        FOR_SEQUENCER_STEPS(s, m->pattern_nb, is) { nb_steps++; }
-
-        size_t nb_bytes = sizeof(struct pattern_step_ser) * nb_steps;
-        struct pattern_step_ser *step = alloca(nb_bytes);
-        size_t i = 0;
-
-        /* Then again to fill the array. */
-        FOR_SEQUENCER_STEPS(s, m->pattern_nb, is) {
-            step[i].u32 = is.step->event.u32;
-            step[i].delay = is.step->delay;
-            i++;
+        /* Too large for the stack.  Only the main thread gets here. */
+        static struct save_pattern_cmd c;
+        c.pattern_nb = m->pattern_nb;
+        rt_cmd_call(save_pattern_rt, &c);
+        if (!c.ok) {
+            LOG("unused pattern %d\n", m->pattern_nb);
+            return reply_error(req);
         }
-        SEND_REPLY_TAG_U32_BYTES(req, (uint8_t*)step, nb_bytes, 0 /* ok */);
+        size_t nb_bytes = sizeof(struct pattern_step_ser) * c.nb_steps;
+        SEND_REPLY_TAG_U32_BYTES(req, (uint8_t*)c.step, nb_bytes, 0 /* ok */);
         return 0;
     }
     return -1;
 }
-int handle_load_pattern(struct tag_u32 *req) {
-    struct app *app = req->context;
+
+/* The pattern is built by the JACK thread, at most
+   HUB_LOAD_STEPS_PER_PERIOD steps per period, and only scheduled once
+   it is complete.  The command ring is held until then, see
+   rt_cmd_poll().  Steps come either decoded, or in the wire format of
+   the request.  The latter are decoded as they are added, so a
+   request of any size needs no buffer of its own.  If recording took
+   the remaining free steps in the meantime, the partial pattern is
+   dropped and pat_nb is PATTERN_NONE. */
+#define HUB_LOAD_STEPS_PER_PERIOD 1024
+struct load_pattern_cmd {
+    const struct pattern_step *step;
+    const struct pattern_step_ser *ser;
+    size_t nb_steps;
+    size_t nb_done;
+    pattern_t pat_nb;
+};
+/* Returns 1 when done.  *budget is the number of steps that can still
+   be added in this period. */
+static int load_pattern_step(struct app *app, struct load_pattern_cmd *c,
+                             uint32_t *budget) {
     struct sequencer *s = &app->sequencer;
-    pattern_t pat_nb = sequencer_pattern_alloc(s);
+    if (c->nb_done == 0) {
+        c->pat_nb = PATTERN_NONE;
+        if ((s->pattern_pool.free == PATTERN_NONE) ||
+            (!step_pool_has_free(&s->step_pool, c->nb_steps))) {
+            return 1;
+        }
+        c->pat_nb = sequencer_pattern_alloc(s);
+    }
+    else if (!step_pool_has_free(&s->step_pool, c->nb_steps - c->nb_done)) {
+        /* Not scheduled yet, so the slot can be freed right away. */
+        sequencer_clear_pattern(s, c->pat_nb);
+        sequencer_pattern_free(s, c->pat_nb);
+        c->pat_nb = PATTERN_NONE;
+        return 1;
+    }
+    while ((c->nb_done < c->nb_steps) && *budget) {
+        size_t i = c->nb_done++;
+        (*budget)--;
+        if (c->step) {
+            sequencer_add_step_event(s, c->pat_nb, &c->step[i].event, c->step[i].delay);
+        }
+        else {
+            union pattern_event ev = { .u32 = c->ser[i].u32 };
+            sequencer_add_step_event(s, c->pat_nb, &ev, c->ser[i].delay);
+        }
+    }
+    if (c->nb_done < c->nb_steps) return 0;
+    sequencer_schedule(s, 0, c->pat_nb);
+    return 1;
+}
+static void load_pattern_rt(struct app *app, void *ctx) {
+    uint32_t budget = HUB_LOAD_STEPS_PER_PERIOD;
+    if (!load_pattern_step(app, ctx, &budget)) app->rt_cmd_again = 1;
+}
+int handle_load_pattern(struct tag_u32 *req) {
+    const struct pattern_step_ser *ser = (const void*)req->bytes;
+    size_t nb_steps = req->nb_bytes / sizeof(*ser);
+    if ((nb_steps == 0) || (nb_steps > HUB_NB_STEPS)) {
+        LOG("bad pattern size %d\n", (int)nb_steps);
+        return reply_error(req);
+    }
+    struct load_pattern_cmd c = { .ser = ser, .nb_steps = nb_steps };
+    rt_cmd_call(load_pattern_rt, &c);
+    if (c.pat_nb == PATTERN_NONE) {
+        LOG("load_pattern: out of memory\n");
+        return reply_error(req);
+    }
+    return reply_ok_1(req, c.pat_nb);
+}
+/* Several patterns in one request, each a 32 bit big endian byte
+   count followed by the steps in load_pattern format.  They are
+   loaded by a single command that shares the per period step budget
+   over all patterns, so the request waits as many periods as a
+   load_pattern of the same total size.  The reply holds the pattern
+   numbers in request order, in the format of list_patterns, with
+   PATTERN_NONE for a pattern that didn't fit. */
+struct load_patterns_cmd {
+    struct load_pattern_cmd pat[HUB_NB_PATTERNS];
+    uint32_t nb;
+    uint32_t nb_done;
+};
+static void load_patterns_rt(struct app *app, void *ctx) {
+    struct load_patterns_cmd *c = ctx;
+    uint32_t budget = HUB_LOAD_STEPS_PER_PERIOD;
+    while (c->nb_done < c->nb) {
+        if (!load_pattern_step(app, &c->pat[c->nb_done], &budget)) {
+            app->rt_cmd_again = 1;
+            return;
+        }
+        c->nb_done++;
+    }
+}
+int handle_load_patterns(struct tag_u32 *req) {
+    static struct load_patterns_cmd c;
+    c.nb = 0;
+    c.nb_done = 0;
+    uint32_t offset = 0;
+    while (offset < req->nb_bytes) {
+        uint32_t nb;
+        if ((c.nb == HUB_NB_PATTERNS) ||
+            (req->nb_bytes - offset < 4) ||
+            ((nb = read_be(req->bytes + offset, 4)) > req->nb_bytes - offset - 4)) {
+            LOG("load_patterns: bad pattern at offset %d\n", offset);
+            return reply_error(req);
+        }
+        size_t nb_steps = nb / sizeof(struct pattern_step_ser);
+        if ((nb_steps == 0) || (nb_steps > HUB_NB_STEPS)) {
+            LOG("bad pattern size %d\n", (int)nb_steps);
+            return reply_error(req);
+        }
+        struct load_pattern_cmd *pc = &c.pat[c.nb++];
+        pc->step = NULL;
+        pc->ser = (const void*)(req->bytes + offset + 4);
+        pc->nb_steps = nb_steps;
+        pc->nb_done = 0;
+        offset += 4 + nb;
+    }
+    rt_cmd_call(load_patterns_rt, &c);
+    pattern_t pat[HUB_NB_PATTERNS];
+    for (uint32_t i = 0; i < c.nb; i++) {
+        pat[i] = c.pat[i].pat_nb;
+    }
+    SEND_REPLY_TAG_U32_BYTES(req, (uint8_t*)pat,
+                             sizeof(pattern_t) * c.nb, 0 /* ok */);
+    return 0;
+}
 
-    struct pattern_step_ser *step = (void*)req->bytes;
-    size_t nb_steps = req->nb_bytes / sizeof(*step);
-    for (size_t i = 0; i<nb_steps; i++) {
-        union pattern_event ev = {.u32 = step[i].u32};
-        sequencer_add_step_event(s, pat_nb, &ev, step[i].delay);
+/* Sequencer snapshots.  The JACK thread copies the state into a
+   buffer owned by the main thread, which writes it to a temporary
+   file and renames it over the snapshot, so a crash never leaves a
+   partial image behind.  At startup the file is mmap()ed and loaded
+   in one go, see app_snapshot_load(). */
+struct snapshot_cmd {
+    uint8_t *buf;
+    uintptr_t size;
+    uintptr_t nb_bytes;
+};
+static void snapshot_rt(struct app *app, void *ctx) {
+    struct snapshot_cmd *c = ctx;
+    c->nb_bytes = sequencer_snapshot_save(&app->sequencer, c->buf, c->size);
+}
+static int write_file_atomic(const char *path, const uint8_t *buf, uintptr_t nb) {
+    char tmp[strlen(path) + 5];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) return -1;
+    while (nb > 0) {
+        ssize_t rv = write(fd, buf, nb);
+        if (rv <= 0) { close(fd); unlink(tmp); return -1; }
+        buf += rv; nb -= rv;
+    }
+    if (fsync(fd) || close(fd)) { unlink(tmp); return -1; }
+    return rename(tmp, path);
+}
+int handle_snapshot(struct tag_u32 *req) {
+    /* Path is in the binary payload. */
+    if ((req->nb_bytes == 0) || (req->nb_bytes > 1024)) {
+        return reply_error(req);
+    }
+    char path[req->nb_bytes + 1];
+    memcpy(path, req->bytes, req->nb_bytes);
+    path[req->nb_bytes] = 0;
+
+    /* The pool capacities are fixed after app_init(), so the buffer
+       is allocated once. */
+    static struct snapshot_cmd c;
+    if (!c.buf) {
+        c.size = sequencer_snapshot_bytes(&app_state.sequencer);
+        c.buf = malloc(c.size);
+        ASSERT(c.buf);
+    }
+    rt_cmd_call(snapshot_rt, &c);
+    ASSERT(c.nb_bytes);
+    if (write_file_atomic(path, c.buf, c.nb_bytes)) {
+        LOG("snapshot: can't write %s: %s\n", path, strerror(errno));
+        return reply_error(req);
     }
-    swtimer_schedule(&s->swtimer, 0, pat_nb);
-    return reply_ok_1(req,pat_nb);
+    return reply_ok_1(req, c.nb_bytes);
 }
 
-int handle_fire_update(struct tag_u32 *req) {
-    struct app *app = req->context;
+/* Standard MIDI Files.  Patterns are read and written as files in the
+   main thread, through a small chunk buffer, see mod_smf.c.  Export
+   copies the step cycle out in one RT command and encodes the copy.
+   Import decodes the whole file first, so the pattern is spliced in
+   by a single load_pattern_rt() and a bad file leaves no trace. */
+#define HUB_SMF_CHUNK 4096
+/* Sequencer ticks per quarter note, used as the SMF division. */
+#define HUB_PPQ 24
+struct smf_file {
+    int fd;
+    uint8_t buf[HUB_SMF_CHUNK];
+};
+static int smf_file_flush(struct smf_writer *w) {
+    struct smf_file *f = w->ctx;
+    const uint8_t *buf = w->buf;
+    uint32_t nb = w->nb;
+    while (nb > 0) {
+        ssize_t rv = write(f->fd, buf, nb);
+        if (rv <= 0) return -1;
+        buf += rv; nb -= rv;
+    }
+    return 0;
+}
+static int smf_file_fill(struct smf_reader *r) {
+    struct smf_file *f = r->ctx;
+    ssize_t rv = read(f->fd, f->buf, sizeof(f->buf));
+    if (rv < 0) return -1;
+    r->buf = f->buf;
+    r->nb = rv;
+    return rv;
+}
+/* Both are allocated on first use.  One more step than the pool holds
+   for the head step added by smf_events_to_steps(). */
+static struct pattern_step *smf_step;
+static struct smf_event *smf_event;
+static uint32_t smf_nb_events;
+static void smf_alloc(void) {
+    if (smf_step) return;
+    smf_step = malloc(sizeof(*smf_step) * (HUB_NB_STEPS + 1));
+    smf_event = malloc(sizeof(*smf_event) * HUB_NB_STEPS);
+    ASSERT(smf_step && smf_event);
+}
+
+struct smf_save_cmd {
+    pattern_t pattern_nb;
+    uint32_t nb_steps;
+    int ok;
+};
+static void smf_save_rt(struct app *app, void *ctx) {
+    struct smf_save_cmd *c = ctx;
+    struct sequencer *s = &app->sequencer;
+    struct pattern_phase *pp = sequencer_pattern(s, c->pattern_nb);
+    c->ok = (pattern_phase_used == pattern_phase_lifecycle(pp));
+    if (!c->ok) return;
+    uint32_t i = 0;
+    FOR_SEQUENCER_STEPS(s, c->pattern_nb, is) {
+        ASSERT(i < HUB_NB_STEPS);
+        smf_step[i++] = *is.step;
+    }
+    c->nb_steps = i;
+}
+int handle_smf_save(struct tag_u32 *req) {
+    TAG_U32_UNPACK(req, 0, m, pattern_nb, format) {
+        /* Path is in the binary payload. */
+        if ((m->pattern_nb >= HUB_NB_PATTERNS) || (m->format > 1) ||
+            (req->nb_bytes == 0) || (req->nb_bytes > 1024)) {
+            return reply_error(req);
+        }
+        char path[req->nb_bytes + 1];
+        memcpy(path, req->bytes, req->nb_bytes);
+        path[req->nb_bytes] = 0;
+
+        smf_alloc();
+        struct smf_save_cmd c = { .pattern_nb = m->pattern_nb };
+        rt_cmd_call(smf_save_rt, &c);
+        if (!c.ok) {
+            LOG("smf_save: unused pattern %d\n", m->pattern_nb);
+            return reply_error(req);
+        }
+        char tmp[req->nb_bytes + 5];
+        snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+        static struct smf_file f;
+        f.fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (f.fd < 0) {
+            LOG("smf_save: can't open %s: %s\n", tmp, strerror(errno));
+            return reply_error(req);
+        }
+        struct smf_writer w = {
+            .buf = f.buf, .size = sizeof(f.buf), .flush = smf_file_flush, .ctx = &f
+        };
+        int err = smf_encode(&w, smf_step, c.nb_steps, m->format, HUB_PPQ) ||
+            fsync(f.fd);
+        if (close(f.fd)) err = 1;
+        if (err || rename(tmp, path)) {
+            LOG("smf_save: can't write %s: %s\n", path, strerror(errno));
+            unlink(tmp);
+            return reply_error(req);
+        }
+        return reply_ok_1(req, w.count);
+    }
+    return -1;
+}
+
+static int smf_load_event(void *ctx, uint32_t time, const union pattern_event *ev) {
+    if (smf_nb_events == HUB_NB_STEPS) return -1;
+    struct smf_event *e = &smf_event[smf_nb_events];
+    e->time = time;
+    e->order = smf_nb_events++;
+    e->event = *ev;
+    return 0;
+}
+int handle_smf_load(struct tag_u32 *req) {
+    /* Path is in the binary payload. */
+    if ((req->nb_bytes == 0) || (req->nb_bytes > 1024)) {
+        return reply_error(req);
+    }
+    char path[req->nb_bytes + 1];
+    memcpy(path, req->bytes, req->nb_bytes);
+    path[req->nb_bytes] = 0;
+
+    smf_alloc();
+    static struct smf_file f;
+    f.fd = open(path, O_RDONLY);
+    if (f.fd < 0) {
+        LOG("smf_load: can't open %s: %s\n", path, strerror(errno));
+        return reply_error(req);
+    }
+    struct smf_reader r = { .fill = smf_file_fill, .ctx = &f };
+    struct smf_info info;
+    smf_nb_events = 0;
+    int rv = smf_decode(&r, HUB_PPQ, smf_load_event, NULL, &info);
+    close(f.fd);
+    if (rv) {
+        LOG("smf_load: bad file %s at offset %d\n", path, r.offset);
+        return reply_error(req);
+    }
+    uint32_t nb_steps = smf_events_to_steps(smf_event, smf_nb_events, info.length, smf_step);
+    if ((nb_steps == 0) || (nb_steps > HUB_NB_STEPS)) {
+        LOG("smf_load: can't represent %s, %d events\n", path, smf_nb_events);
+        return reply_error(req);
+    }
+    struct load_pattern_cmd c = { .step = smf_step, .nb_steps = nb_steps };
+    rt_cmd_call(load_pattern_rt, &c);
+    if (c.pat_nb == PATTERN_NONE) {
+        LOG("smf_load: out of memory\n");
+        return reply_error(req);
+    }
+    return reply_ok_1(req, c.pat_nb);
+}
+static void fire_update_rt(struct app *app, void *ctx) {
     app->fire.need_update = 1;
+}
+int handle_fire_update(struct tag_u32 *req) {
+    rt_cmd_call(fire_update_rt, NULL);
     return reply_ok(req);
 }
+struct fire_button_cmd {
+    uint32_t row, col;
+};
+static void fire_button_rt(struct app *app, void *ctx) {
+    struct fire_button_cmd *c = ctx;
+    akai_fire_pad_event(&app->fire, c->row, c->col);
+}
 int handle_fire_button(struct tag_u32 *req) {
     TAG_U32_UNPACK(req, 0, m, row, col) {
-        struct app *app = req->context;
-        akai_fire_pad_event(&app->fire, m->row, m->col);
+        if ((m->row >= AKAI_FIRE_ROWS) || (m->col >= AKAI_FIRE_COLS)) {
+            return reply_error(req);
+        }
+        struct fire_button_cmd c = { .row = m->row, .col = m->col };
+        rt_cmd_call(fire_button_rt, &c);
         return reply_ok(req);
     }
     return -1;
@@ -835,6 +1925,656 @@ int handle_fire_button(struct tag_u32 *req) {
 /* Here "save" means from sequencer structure to tag_u32 return value,
    and "load" means tag_u32 argument to sequencer. */
 
+/* Erlang output drop counters, see struct erl_out. */
+int handle_erl_out(struct tag_u32 *req) {
+    struct erl_out *o = &erl_out;
+    SEND_REPLY_TAG_U32(req, 0,
+                       o->nb_drop_msg,
+                       o->nb_drop_block,
+                       o->nb_drop_bytes,
+                       o->max_fill);
+    return 0;
+}
+
+/* Remove a pattern.  Its sounding notes are released first. */
+struct clear_pattern_cmd {
+    pattern_t pattern_nb;
+    int ok;
+};
+static void clear_pattern_rt(struct app *app, void *ctx) {
+    struct clear_pattern_cmd *c = ctx;
+    struct sequencer *s = &app->sequencer;
+    struct pattern_phase *pp = sequencer_pattern(s, c->pattern_nb);
+    c->ok = (pattern_phase_used == pattern_phase_lifecycle(pp)) &&
+        (c->pattern_nb != s->cursor.pattern);
+    if (!c->ok) return;
+    app_release_pattern(app, c->pattern_nb);
+    sequencer_clear_pattern(s, c->pattern_nb);
+}
+int handle_clear_pattern(struct tag_u32 *req) {
+    TAG_U32_UNPACK(req, 0, m, pattern_nb) {
+        if (m->pattern_nb >= HUB_NB_PATTERNS) {
+            return reply_error(req);
+        }
+        struct clear_pattern_cmd c = { .pattern_nb = m->pattern_nb };
+        rt_cmd_call(clear_pattern_rt, &c);
+        return c.ok ? reply_ok(req) : reply_error(req);
+    }
+    return -1;
+}
+
+/* Sequencer output routing.  kind is 0 for MIDI ports, 1 for CV
+   channels.  An out number past the end of the midi_outs list drops
+   the events.  When a MIDI port moves, its sounding notes are
+   released on the output it used before, as their note offs would
+   otherwise go to the new one. */
+struct route_cmd {
+    uint32_t kind, index, out;
+};
+static void route_rt(struct app *app, void *ctx) {
+    struct route_cmd *c = ctx;
+    uint8_t o = (c->out < app->nb_midi_out) ? c->out : ROUTE_NONE;
+    if (c->kind == 0) {
+        if (o != app->route.midi[c->index]) {
+            /* Not resolved yet, so app_note_off() still sees the old
+               output.  See app_release_pattern() for the time. */
+            app->tick_time = app->nframes - 1;
+            sequencer_notes_release_port(&app->notes, c->index, app_note_off, app);
+        }
+        app->route.midi[c->index] = o;
+    }
+    else {
+        app->route.cv[c->index] = o;
+    }
+}
+int handle_route(struct tag_u32 *req) {
+    TAG_U32_UNPACK(req, 0, m, kind, index, out) {
+        uint32_t nb = (m->kind == 0) ? ROUTE_NB_MIDI : ROUTE_NB_CV;
+        if ((m->kind > 1) || (m->index >= nb)) {
+            return reply_error(req);
+        }
+        struct route_cmd c = { .kind = m->kind, .index = m->index, .out = m->out };
+        rt_cmd_call(route_rt, &c);
+        return reply_ok(req);
+    }
+    return -1;
+}
+/* Scenes.  scene_set takes the playing patterns as a list of 16 bit
+   little endian pattern numbers, like list_patterns returns them.
+   scene_switch applies the scene at the next multiple of quantum
+   sequencer ticks since start, or right away with quantum 0 or when
+   stopped. */
+struct scene_set_cmd {
+    uint32_t scene_nb;
+    const struct scene *scene;
+};
+static void scene_set_rt(struct app *app, void *ctx) {
+    struct scene_set_cmd *c = ctx;
+    app->scene[c->scene_nb] = *c->scene;
+}
+int handle_scene_set(struct tag_u32 *req) {
+    TAG_U32_UNPACK(req, 0, m, scene_nb) {
+        if ((m->scene_nb >= HUB_NB_SCENES) || (req->nb_bytes % 2)) {
+            return reply_error(req);
+        }
+        struct scene scene = {};
+        for (uint32_t i = 0; i < req->nb_bytes; i += 2) {
+            uint32_t pat = req->bytes[i] | (req->bytes[i+1] << 8);
+            if (pat >= HUB_NB_PATTERNS) {
+                return reply_error(req);
+            }
+            scene.play[pat / 32] |= 1 << (pat % 32);
+        }
+        struct scene_set_cmd c = { .scene_nb = m->scene_nb, .scene = &scene };
+        rt_cmd_call(scene_set_rt, &c);
+        return reply_ok(req);
+    }
+    return -1;
+}
+struct scene_switch_cmd {
+    uint8_t scene_nb;
+    uint32_t quantum;
+};
+static void scene_switch_rt(struct app *app, void *ctx) {
+    struct scene_switch_cmd *c = ctx;
+    app->scene_pending = c->scene_nb;
+    app->scene_quantum = c->quantum ? c->quantum : 1;
+    if (!app->running) {
+        app->tick_time = app->nframes - 1;
+        app_scene_apply(app);
+    }
+}
+int handle_scene_switch(struct tag_u32 *req) {
+    TAG_U32_UNPACK(req, 0, m, scene_nb, quantum) {
+        if (m->scene_nb >= HUB_NB_SCENES) {
+            return reply_error(req);
+        }
+        struct scene_switch_cmd c = {
+            .scene_nb = m->scene_nb, .quantum = m->quantum
+        };
+        rt_cmd_call(scene_switch_rt, &c);
+        return reply_ok(req);
+    }
+    return -1;
+}
+
+/* Clock-in estimate: period and mean jitter in 1/256 frames, tempo in
+   1/100 BPM, and whether the estimate is locked. */
+struct clock_est_cmd {
+    struct clock_dll dll;
+};
+static void clock_est_rt(struct app *app, void *ctx) {
+    struct clock_est_cmd *c = ctx;
+    c->dll = app->clock_dll;
+}
+int handle_clock_est(struct tag_u32 *req) {
+    struct clock_est_cmd c;
+    rt_cmd_call(clock_est_rt, &c);
+    if (!clock_dll_locked(&c.dll) || !(c.dll.period > 0)) {
+        return reply_2(req, 0 /* ok */, 0);
+    }
+    double sr = jack_get_sample_rate(client);
+    uint32_t period = c.dll.period * 256;
+    uint32_t jitter = c.dll.jitter * 256;
+    uint32_t bpm = (sr * 60 * 100) / (c.dll.period * 24);
+    SEND_REPLY_TAG_U32(req, 0 /* ok */, 1, period, jitter, bpm);
+    return 0;
+}
+
+/* Groove offset in frames of one slot of a template. */
+struct groove_cmd {
+    uint32_t index;
+    uint16_t frames;
+};
+static void groove_rt(struct app *app, void *ctx) {
+    struct groove_cmd *c = ctx;
+    app->groove[c->index] = c->frames;
+}
+int handle_groove(struct tag_u32 *req) {
+    TAG_U32_UNPACK(req, 0, m, template, slot, frames) {
+        if ((m->template >= SEQUENCER_GROOVE_NB) ||
+            (m->slot >= SEQUENCER_GROOVE_SLOTS) ||
+            (m->frames > 0xFFFF)) {
+            return reply_error(req);
+        }
+        struct groove_cmd c = {
+            .index = m->template * SEQUENCER_GROOVE_SLOTS + m->slot,
+            .frames = m->frames
+        };
+        rt_cmd_call(groove_rt, &c);
+        return reply_ok(req);
+    }
+    return -1;
+}
+/* Groove template used by a pattern. */
+struct pattern_groove_cmd {
+    pattern_t pattern_nb;
+    uint8_t template;
+    int ok;
+};
+static void pattern_groove_rt(struct app *app, void *ctx) {
+    struct pattern_groove_cmd *c = ctx;
+    struct pattern_phase *pp = sequencer_pattern(&app->sequencer, c->pattern_nb);
+    c->ok = (pattern_phase_used == pattern_phase_lifecycle(pp));
+    if (c->ok) pp->groove = c->template;
+}
+int handle_pattern_groove(struct tag_u32 *req) {
+    TAG_U32_UNPACK(req, 0, m, pattern_nb, template) {
+        if ((m->pattern_nb >= HUB_NB_PATTERNS) ||
+            (m->template >= SEQUENCER_GROOVE_NB)) {
+            return reply_error(req);
+        }
+        struct pattern_groove_cmd c = {
+            .pattern_nb = m->pattern_nb, .template = m->template
+        };
+        rt_cmd_call(pattern_groove_rt, &c);
+        return c.ok ? reply_ok(req) : reply_error(req);
+    }
+    return -1;
+}
+
+/* In-place pattern transforms, see sequencer_pattern_rotate() and
+   friends.  Times are in sequencer ticks, semitones is signed. */
+enum pattern_transform {
+    pattern_transform_rotate,
+    pattern_transform_scale,
+    pattern_transform_reverse,
+    pattern_transform_transpose,
+};
+struct pattern_transform_cmd {
+    pattern_t pattern_nb;
+    enum pattern_transform op;
+    uint32_t a, b;
+    int ok;
+};
+static void pattern_transform_rt(struct app *app, void *ctx) {
+    struct pattern_transform_cmd *c = ctx;
+    struct sequencer *s = &app->sequencer;
+    int rv = -1;
+    switch(c->op) {
+    case pattern_transform_rotate:
+        rv = sequencer_pattern_rotate(s, c->pattern_nb, c->a);
+        break;
+    case pattern_transform_scale:
+        rv = sequencer_pattern_scale(s, c->pattern_nb, c->a, c->b);
+        break;
+    case pattern_transform_reverse:
+        rv = sequencer_pattern_reverse(s, c->pattern_nb);
+        break;
+    case pattern_transform_transpose:
+        /* Sounding notes would not get their note off.  Only release
+           them when the transpose goes ahead. */
+        if (!sequencer_pattern_editable(s, c->pattern_nb)) break;
+        app_release_pattern(app, c->pattern_nb);
+        rv = sequencer_pattern_transpose(s, c->pattern_nb, (int32_t)c->a);
+        break;
+    }
+    c->ok = (rv == 0);
+}
+static int pattern_transform(struct tag_u32 *req, enum pattern_transform op,
+                             uint32_t pattern_nb, uint32_t a, uint32_t b) {
+    if (pattern_nb >= HUB_NB_PATTERNS) {
+        return reply_error(req);
+    }
+    struct pattern_transform_cmd c = {
+        .pattern_nb = pattern_nb, .op = op, .a = a, .b = b
+    };
+    rt_cmd_call(pattern_transform_rt, &c);
+    return c.ok ? reply_ok(req) : reply_error(req);
+}
+int handle_pattern_rotate(struct tag_u32 *req) {
+    TAG_U32_UNPACK(req, 0, m, pattern_nb, ticks) {
+        return pattern_transform(req, pattern_transform_rotate, m->pattern_nb, m->ticks, 0);
+    }
+    return -1;
+}
+int handle_pattern_scale(struct tag_u32 *req) {
+    TAG_U32_UNPACK(req, 0, m, pattern_nb, num, den) {
+        return pattern_transform(req, pattern_transform_scale, m->pattern_nb, m->num, m->den);
+    }
+    return -1;
+}
+int handle_pattern_reverse(struct tag_u32 *req) {
+    TAG_U32_UNPACK(req, 0, m, pattern_nb) {
+        return pattern_transform(req, pattern_transform_reverse, m->pattern_nb, 0, 0);
+    }
+    return -1;
+}
+int handle_pattern_transpose(struct tag_u32 *req) {
+    TAG_U32_UNPACK(req, 0, m, pattern_nb, semitones) {
+        return pattern_transform(req, pattern_transform_transpose, m->pattern_nb, m->semitones, 0);
+    }
+    return -1;
+}
+
+/* CV slew time in ms for a full scale change, 0 for stepped output. */
+struct cv_slew_cmd {
+    uint32_t index;
+    float slew;
+};
+static void cv_slew_rt(struct app *app, void *ctx) {
+    struct cv_slew_cmd *c = ctx;
+    app->cv_out[c->index].slew = c->slew;
+}
+int handle_cv_slew(struct tag_u32 *req) {
+    TAG_U32_UNPACK(req, 0, m, index, ms) {
+        if (m->index >= NB_CV_OUT) {
+            return reply_error(req);
+        }
+        float frames = (float)m->ms * jack_get_sample_rate(client) / 1000;
+        struct cv_slew_cmd c = {
+            .index = m->index, .slew = (frames >= 1) ? 1 / frames : 0
+        };
+        rt_cmd_call(cv_slew_rt, &c);
+        return reply_ok(req);
+    }
+    return -1;
+}
+
+/* MIDI through table, main thread side.  Rules name their input, and
+   are recompiled whenever the set of inputs changes.  The map is
+   double buffered: a new map is compiled into the one the JACK thread
+   is not using and swapped in with a pointer store.  The command ring
+   round trip after the store guarantees that the JACK thread has
+   picked up the new map before the old one is overwritten. */
+struct through_rule {
+    char in[HUB_PORT_NAME];
+    struct midi_through_rule rule;
+};
+static struct through_rule through_rule[MIDI_THROUGH_NB_ROUTES];
+static uint32_t through_nb_rules;
+static struct midi_through_map through_map[2];
+static void through_sync_rt(struct app *app, void *ctx) {
+}
+static int app_through_update(struct app *app,
+                              const struct through_rule *tr, uint32_t nb) {
+    struct midi_through_rule rule[MIDI_THROUGH_NB_ROUTES];
+    if (nb > MIDI_THROUGH_NB_ROUTES) return -1;
+    for (uint32_t i = 0; i < nb; i++) {
+        rule[i] = tr[i].rule;
+        rule[i].in = 0xFF;
+        for (uint32_t j = 0; j < app->nb_midi_in; j++) {
+            if (!strcmp(app->midi_in[j].name, tr[i].in)) {
+                rule[i].in = app->midi_in[j].through_slot;
+            }
+        }
+    }
+    struct midi_through_map *next = &through_map[app->through == &through_map[0]];
+    if (midi_through_compile(next, rule, nb)) return -1;
+    __atomic_store_n(&app->through, next, __ATOMIC_RELEASE);
+    if (client_active) rt_cmd_call(through_sync_rt, NULL);
+    return 0;
+}
+
+/* MIDI port registry, main thread side.  Only the main thread edits
+   the registry, so it can read it without synchronization.  Before
+   the client is activated rt_cmd_call() applies the edits directly. */
+static void midi_in_add_rt(struct app *app, void *ctx) {
+    app->midi_in[app->nb_midi_in++] = *(struct midi_in *)ctx;
+}
+static void midi_in_del_rt(struct app *app, void *ctx) {
+    uint32_t i = *(uint32_t *)ctx;
+    memmove(&app->midi_in[i], &app->midi_in[i + 1],
+            (app->nb_midi_in - i - 1) * sizeof(app->midi_in[0]));
+    app->nb_midi_in--;
+}
+struct midi_out_add_cmd {
+    jack_port_t *port;
+    const char *name;
+};
+static void midi_out_add_rt(struct app *app, void *ctx) {
+    struct midi_out_add_cmd *c = ctx;
+    struct midi_out *o = &app->midi_out[app->nb_midi_out];
+    o->port = c->port;
+    o->nb_drop = 0;
+    strcpy(o->name, c->name);
+    /* process() has already begun the other outputs. */
+    if (client_active) midi_out_begin(o, o->port, app->nframes);
+    app->nb_midi_out++;
+}
+/* Returns the index, or -1. */
+int app_midi_in_add(struct app *app, const char *name,
+                    uint32_t handler, uint32_t erl_port) {
+    if ((handler >= NB_MIDI_IN_HANDLER) || (erl_port > 0xFF) ||
+        (strlen(name) >= HUB_PORT_NAME) ||
+        (app->nb_midi_in == HUB_NB_MIDI_IN)) {
+        return -1;
+    }
+    /* Fails on a duplicate name. */
+    jack_port_t *port = jack_port_register(
+        client, name, JACK_DEFAULT_MIDI_TYPE, JackPortIsInput, 0);
+    if (!port) return -1;
+    /* Lowest slot not in use.  There are as many slots as inputs. */
+    uint32_t used = 0;
+    for (uint32_t i = 0; i < app->nb_midi_in; i++) {
+        used |= 1u << app->midi_in[i].through_slot;
+    }
+    uint32_t slot = 0;
+    while (used & (1u << slot)) slot++;
+    struct midi_in in = {
+        .port = port,
+        .process = midi_in_handler_fn[handler],
+        .erl_port = erl_port,
+        .handler = handler,
+        .through_slot = slot,
+    };
+    strcpy(in.name, name);
+    rt_cmd_call(midi_in_add_rt, &in);
+    /* Pick up the rules that name it.  The slot has no routes yet, as
+       they are removed when an input is deleted.  This fails if the
+       rules for it exceed the fanout, which leaves it unrouted. */
+    if (app_through_update(app, through_rule, through_nb_rules)) {
+        LOG("midi_in_add: bad through rules for %s\n", name);
+    }
+    return app->nb_midi_in - 1;
+}
+int app_midi_in_del(struct app *app, const char *name) {
+    for (uint32_t i = 0; i < app->nb_midi_in; i++) {
+        jack_port_t *port = app->midi_in[i].port;
+        if (strcmp(app->midi_in[i].name, name)) continue;
+        rt_cmd_call(midi_in_del_rt, &i);
+        /* The JACK thread no longer refers to it. */
+        jack_port_unregister(client, port);
+        app_through_update(app, through_rule, through_nb_rules);
+        return 0;
+    }
+    return -1;
+}
+/* Outputs can't be removed, as routes refer to them by index. */
+int app_midi_out_add(struct app *app, const char *name) {
+    if ((strlen(name) >= HUB_PORT_NAME) ||
+        (app->nb_midi_out == HUB_NB_MIDI_OUT)) {
+        return -1;
+    }
+    jack_port_t *port = jack_port_register(
+        client, name, JACK_DEFAULT_MIDI_TYPE, JackPortIsOutput, 0);
+    if (!port) return -1;
+    struct midi_out_add_cmd c = { .port = port, .name = name };
+    rt_cmd_call(midi_out_add_rt, &c);
+    return app->nb_midi_out - 1;
+}
+static int app_midi_out_find(struct app *app, const char *name) {
+    for (uint32_t i = 0; i < app->nb_midi_out; i++) {
+        if (!strcmp(app->midi_out[i].name, name)) return i;
+    }
+    return -1;
+}
+
+/* The port name is in the binary payload. */
+static int port_name_payload(struct tag_u32 *req, char *name) {
+    if ((req->nb_bytes == 0) || (req->nb_bytes >= HUB_PORT_NAME)) return -1;
+    memcpy(name, req->bytes, req->nb_bytes);
+    name[req->nb_bytes] = 0;
+    return 0;
+}
+int handle_midi_in_add(struct tag_u32 *req) {
+    TAG_U32_UNPACK(req, 0, m, handler, erl_port) {
+        char name[HUB_PORT_NAME];
+        if (port_name_payload(req, name)) return reply_error(req);
+        int i = app_midi_in_add(&app_state, name, m->handler, m->erl_port);
+        if (i < 0) {
+            LOG("midi_in_add: can't add %s\n", name);
+            return reply_error(req);
+        }
+        return reply_ok_1(req, i);
+    }
+    return -1;
+}
+int handle_midi_in_del(struct tag_u32 *req) {
+    char name[HUB_PORT_NAME];
+    if (port_name_payload(req, name) ||
+        app_midi_in_del(&app_state, name)) {
+        return reply_error(req);
+    }
+    return reply_ok(req);
+}
+int handle_midi_out_add(struct tag_u32 *req) {
+    char name[HUB_PORT_NAME];
+    if (port_name_payload(req, name)) return reply_error(req);
+    int i = app_midi_out_add(&app_state, name);
+    if (i < 0) {
+        LOG("midi_out_add: can't add %s\n", name);
+        return reply_error(req);
+    }
+    return reply_ok_1(req, i);
+}
+/* Names of the input handlers in midi_in_add numbering, newline
+   separated. */
+int handle_midi_in_handlers(struct tag_u32 *req) {
+    SEND_REPLY_TAG_U32_BYTES(req, (const uint8_t*)midi_in_handler_names,
+                             sizeof(midi_in_handler_names) - 1, 0 /* ok */);
+    return 0;
+}
+/* Inputs in processing order, one "name handler" line each. */
+int handle_midi_ins(struct tag_u32 *req) {
+    struct app *app = &app_state;
+    char buf[HUB_NB_MIDI_IN * (HUB_PORT_NAME + 4)];
+    uint32_t nb = 0;
+    for (uint32_t i = 0; i < app->nb_midi_in; i++) {
+        nb += snprintf(buf + nb, sizeof(buf) - nb, "%s %d\n",
+                       app->midi_in[i].name, app->midi_in[i].handler);
+    }
+    SEND_REPLY_TAG_U32_BYTES(req, (const uint8_t*)buf, nb, 0 /* ok */);
+    return 0;
+}
+/* Names of the outputs in route numbering, newline separated. */
+int handle_midi_outs(struct tag_u32 *req) {
+    struct app *app = &app_state;
+    char buf[HUB_NB_MIDI_OUT * HUB_PORT_NAME];
+    uint32_t nb = 0;
+    for (uint32_t i = 0; i < app->nb_midi_out; i++) {
+        nb += snprintf(buf + nb, sizeof(buf) - nb, "%s\n", app->midi_out[i].name);
+    }
+    SEND_REPLY_TAG_U32_BYTES(req, (const uint8_t*)buf, nb, 0 /* ok */);
+    return 0;
+}
+
+/* Replaces the through rules.  The payload is a sequence of rules:
+
+     name_len, name[name_len], out, chan_mask:16be, status_mask,
+     chan, transpose, curve, vel_min, vel_max
+
+   where name is the input name and out is the route number of the
+   output.  Rules can name inputs that are not registered yet. */
+#define THROUGH_RULE_BYTES 9
+int handle_midi_through(struct tag_u32 *req) {
+    static struct through_rule tr[MIDI_THROUGH_NB_ROUTES];
+    const uint8_t *b = req->bytes;
+    uint32_t left = req->nb_bytes;
+    uint32_t nb = 0;
+    while (left) {
+        uint32_t len = b[0];
+        if ((nb == MIDI_THROUGH_NB_ROUTES) || (len >= HUB_PORT_NAME) ||
+            (left < 1 + len + THROUGH_RULE_BYTES)) {
+            return reply_error(req);
+        }
+        memcpy(tr[nb].in, b + 1, len);
+        tr[nb].in[len] = 0;
+        const uint8_t *r = b + 1 + len;
+        tr[nb].rule = (struct midi_through_rule){
+            .out = r[0],
+            .chan_mask = read_be(r + 1, 2),
+            .status_mask = r[3],
+            .chan = r[4],
+            .transpose = (int8_t)r[5],
+            .curve = r[6],
+            .vel_min = r[7],
+            .vel_max = r[8],
+        };
+        nb++;
+        b += 1 + len + THROUGH_RULE_BYTES;
+        left -= 1 + len + THROUGH_RULE_BYTES;
+    }
+    if (app_through_update(&app_state, tr, nb)) {
+        LOG("midi_through: bad rules\n");
+        return reply_error(req);
+    }
+    memcpy(through_rule, tr, nb * sizeof(tr[0]));
+    through_nb_rules = nb;
+    return reply_ok(req);
+}
+
+/* Live recorder mode: overdub merges all loop passes into one
+   pattern, optionally snapped to a grid of MIDI clocks.  A recording
+   keeps the mode it was opened with, so a change takes effect at
+   the next one. */
+struct record_mode_cmd {
+    uint8_t overdub;
+    dtime_t grid;
+};
+static void record_mode_rt(struct app *app, void *ctx) {
+    struct record_mode_cmd *c = ctx;
+    app->sequencer.cursor.overdub = c->overdub;
+    app->sequencer.cursor.grid = c->grid;
+}
+int handle_record_mode(struct tag_u32 *req) {
+    TAG_U32_UNPACK(req, 0, m, overdub, grid) {
+        if (m->grid > 0xFFFF) {
+            return reply_error(req);
+        }
+        struct record_mode_cmd c = {
+            .overdub = !!m->overdub, .grid = m->grid
+        };
+        rt_cmd_call(record_mode_rt, &c);
+        return reply_ok(req);
+    }
+    return -1;
+}
+
+/* Sequencer instrumentation.  The copy is made on the JACK thread, so
+   all values belong to the same period.  Scalars are in the reply
+   arguments, the two histograms follow as little endian u32 arrays:
+   events per tick, then microseconds per tick. */
+struct stats_cmd {
+    int reset;
+    struct sequencer_stats seq;
+    uint32_t free_steps;
+    uint32_t free_patterns;
+    uint32_t timer_nb;
+    uint32_t tick_max_us;
+    uint32_t tick_over_budget;
+    uint32_t hist[2][SEQUENCER_STATS_HIST];
+};
+static void stats_rt(struct app *app, void *ctx) {
+    struct stats_cmd *c = ctx;
+    struct sequencer *s = &app->sequencer;
+    c->seq              = s->stats;
+    c->free_steps       = sequencer_stats_free_steps(s);
+    c->free_patterns    = sequencer_stats_free_patterns(s);
+    c->timer_nb         = sequencer_stats_timer_nb(s);
+    c->tick_max_us      = app->tick_max_us;
+    c->tick_over_budget = app->tick_over_budget;
+    memcpy(c->hist[0], s->stats.events_hist, sizeof(c->hist[0]));
+    memcpy(c->hist[1], app->tick_us_hist, sizeof(c->hist[1]));
+    if (c->reset) {
+        sequencer_stats_reset(s);
+        app->tick_max_us = 0;
+        app->tick_over_budget = 0;
+        memset(app->tick_us_hist, 0, sizeof(app->tick_us_hist));
+    }
+}
+int handle_stats(struct tag_u32 *req) {
+    TAG_U32_UNPACK(req, 0, m, reset) {
+        struct stats_cmd c = { .reset = m->reset };
+        rt_cmd_call(stats_rt, &c);
+        SEND_REPLY_TAG_U32_BYTES(req, (uint8_t*)c.hist, sizeof(c.hist),
+                                 0 /* ok */,
+                                 c.seq.nb_ticks,
+                                 c.seq.nb_events,
+                                 c.seq.max_events,
+                                 c.seq.max_chain,
+                                 c.timer_nb,
+                                 c.seq.max_timer_nb,
+                                 c.free_steps,
+                                 c.seq.min_free_steps,
+                                 c.free_patterns,
+                                 c.seq.min_free_patterns,
+                                 c.tick_max_us,
+                                 c.tick_over_budget);
+        return 0;
+    }
+    return -1;
+}
+
+/* Load of the process callback, see struct jack_load.  Read without
+   going through the command ring, so this works when the JACK thread
+   is stuck. */
+int handle_jack_load(struct tag_u32 *req) {
+    TAG_U32_UNPACK(req, 0, m, reset) {
+        struct jack_load_snapshot l;
+        jack_load_read(&jack_load, &l, m->reset);
+        SEND_REPLY_TAG_U32_BYTES(req, (uint8_t*)l.hist, sizeof(l.hist),
+                                 0 /* ok */,
+                                 l.nb_cycles,
+                                 l.max_us,
+                                 l.nb_xruns,
+                                 l.nframes,
+                                 jack_get_sample_rate(client));
+        return 0;
+    }
+    return -1;
+}
+
 int map_root(struct tag_u32 *req) {
     const struct tag_u32_entry map[] = {
         {"clock_div",     t_cmd, handle_clock_div, 1},
@@ -842,8 +2582,35 @@ int map_root(struct tag_u32 *req) {
         {"list_patterns", t_cmd, handle_list_patterns, 0},
         {"save_pattern",  t_cmd, handle_save_pattern, 1},
         {"load_pattern",  t_cmd, handle_load_pattern, 0},
+        {"load_patterns", t_cmd, handle_load_patterns, 0},
+        {"clear_pattern", t_cmd, handle_clear_pattern, 1},
         {"fire_update",   t_cmd, handle_fire_update, 0},
         {"fire_button",   t_cmd, handle_fire_button, 2},
+        {"erl_out",       t_cmd, handle_erl_out, 0},
+        {"snapshot",      t_cmd, handle_snapshot, 0},
+        {"stats",         t_cmd, handle_stats, 1},
+        {"jack_load",     t_cmd, handle_jack_load, 1},
+        {"record_mode",   t_cmd, handle_record_mode, 2},
+        {"route",         t_cmd, handle_route, 3},
+        {"midi_outs",     t_cmd, handle_midi_outs, 0},
+        {"midi_ins",      t_cmd, handle_midi_ins, 0},
+        {"midi_in_handlers", t_cmd, handle_midi_in_handlers, 0},
+        {"midi_in_add",   t_cmd, handle_midi_in_add, 2},
+        {"midi_in_del",   t_cmd, handle_midi_in_del, 0},
+        {"midi_out_add",  t_cmd, handle_midi_out_add, 0},
+        {"midi_through",  t_cmd, handle_midi_through, 0},
+        {"cv_slew",       t_cmd, handle_cv_slew, 2},
+        {"clock_est",     t_cmd, handle_clock_est, 0},
+        {"scene_set",     t_cmd, handle_scene_set, 1},
+        {"scene_switch",  t_cmd, handle_scene_switch, 2},
+        {"groove",        t_cmd, handle_groove, 3},
+        {"pattern_groove", t_cmd, handle_pattern_groove, 2},
+        {"pattern_rotate", t_cmd, handle_pattern_rotate, 2},
+        {"pattern_scale", t_cmd, handle_pattern_scale, 3},
+        {"pattern_reverse", t_cmd, handle_pattern_reverse, 1},
+        {"pattern_transpose", t_cmd, handle_pattern_transpose, 2},
+        {"smf_save",      t_cmd, handle_smf_save, 2},
+        {"smf_load",      t_cmd, handle_smf_load, 0},
     };
     return HANDLE_TAG_U32_MAP(req, map);
 }
@@ -866,7 +2633,7 @@ static void port_register(jack_port_id_t port_id, int reg, void *arg) {
     jack_port_t *port = jack_port_by_id(client, port_id);
     int flags = jack_port_flags(port);
     const char *port_name = jack_port_name(port);
-    to_erl_ptermf("{jack_control,{port,%s,%s,\"%s\"}}",
+    to_erl_ptermf_nrt("{jack_control,{port,%s,%s,\"%s\"}}",
                   reg ? "reg" : "unreg",
                   flags & JackPortIsInput ? "in" : "out",
                   port_name);
@@ -875,7 +2642,7 @@ static void port_register(jack_port_id_t port_id, int reg, void *arg) {
     char *const alias[2] = {alias0, alias1};
     int nb_alias = jack_port_get_aliases(port, alias);
     for (int i = 0; i<nb_alias; i++) {
-        to_erl_ptermf("{jack_control,{alias,\"%s\",\"%s\"}}", port_name, alias[i]);
+        to_erl_ptermf_nrt("{jack_control,{alias,\"%s\",\"%s\"}}", port_name, alias[i]);
     }
 }
 static void port_connect(jack_port_id_t a, jack_port_id_t b, int connect, void *arg) {
@@ -883,12 +2650,18 @@ static void port_connect(jack_port_id_t a, jack_port_id_t b, int connect, void *
     jack_port_t *pb = jack_port_by_id(client, b);
     const char *na = jack_port_name(pa);
     const char *nb = jack_port_name(pb);
-    to_erl_ptermf("{jack_control,{connect,%s,\"%s\",\"%s\"}}",
+    to_erl_ptermf_nrt("{jack_control,{connect,%s,\"%s\",\"%s\"}}",
                   connect  ? "true" : "false", na, nb);
 
 }
+/* The JACK thread won't run again.  Edits are now applied by the main
+   thread, see rt_cmd_call(). */
+static void client_shutdown(void *arg) {
+    __atomic_store_n(&client_active, 0, __ATOMIC_RELEASE);
+    LOG("hub: JACK server shut down the client\n");
+}
 static void client_registration(const char *name, int reg, void *arg) {
-    to_erl_ptermf("{jack,{client,%s,\"%s\"}}", reg ? "reg" : "unreg", name);
+    to_erl_ptermf_nrt("{jack,{client,%s,\"%s\"}}", reg ? "reg" : "unreg", name);
 }
 
 /* Cross-link */
@@ -913,6 +2686,8 @@ void app_pattern_state(struct sequencer *s, pattern_t pat, int state) {
     struct app *app = sequencer_to_app(s);
     int row = pat / 16;
     int col = pat % 16;
+    /* Only the first patterns have a pad. */
+    if (row >= AKAI_FIRE_ROWS) return;
     app->fire.pads[row][col] = state;
     app->fire.need_update = 1;
 }
@@ -932,14 +2707,29 @@ void app_fire_button_notify(struct akai_fire *fire, int row, int col) {
     struct pattern_phase *pp = sequencer_pattern(&app->sequencer, pat);
     if (pattern_phase_used == pattern_phase_lifecycle(pp)) {
         pp->mute ^= 1;
+        if (pp->mute) {
+            app_release_pattern(app, pat);
+        }
         app_pattern_state(&app->sequencer, pat, !pp->mute);
     }
 }
 
 void app_init(struct app *app) {
+    for (int i = 0; i < ROUTE_NB_CV; i++) app->route.cv[i] = ROUTE_NONE;
+    app->scene_pending = SCENE_NONE;
+    app->through = &through_map[0];
+
     /* Initialize the components. */
     akai_fire_init(&app->fire);
-    sequencer_init(&app->sequencer, app_sequencer_tick);
+    app->arena.size = sequencer_arena_bytes(HUB_NB_STEPS, HUB_NB_PATTERNS);
+    app->arena.buf = malloc(app->arena.size);
+    ASSERT(app->arena.buf);
+    sequencer_init(&app->sequencer, app_sequencer_tick,
+                   &app->arena, HUB_NB_STEPS, HUB_NB_PATTERNS);
+    /* Keep patterns contiguous in the step pool.  A pass costs
+       HUB_NB_PATTERNS units plus the number of used steps.  It runs
+       from the tick, or once per period while stopped. */
+    app->sequencer.compact.budget = 256;
     sequencer_restart(&app->sequencer);
 
     /* Cross-link */
@@ -949,6 +2739,97 @@ void app_init(struct app *app) {
 
 }
 
+/* Default ports, registered before the JACK client is activated.  The
+   order of the outputs is the route numbering that existing setups
+   use. */
+static const struct midi_in_default {
+    const char *name;
+    uint8_t handler;
+    uint8_t erl_port;
+} midi_in_default[] = {
+    {"clock_in",       midi_in_clock,       0},
+    {"easycontrol",    midi_in_easycontrol, 0},
+    {"keystation_in1", midi_in_keystation1, 1},
+    {"keystation_in2", midi_in_keystation2, 2},
+    {"remote_in",      midi_in_remote,      3},
+    {"uma_in",         midi_in_uma,         6},
+    {"fire_in",        midi_in_fire,        0},
+    {"z_debug",        midi_in_debug,       0},
+};
+static const char *const midi_out_default[] = {
+    "tb03", "fire_out", "volca_keys", "volca_bass",
+    "volca_beats", "synth", "pd_out", "transport",
+};
+void app_ports_init(struct app *app) {
+    for (uint32_t i = 0; i < ARRAY_SIZE(midi_in_default); i++) {
+        const struct midi_in_default *d = &midi_in_default[i];
+        ASSERT(0 <= app_midi_in_add(app, d->name, d->handler, d->erl_port));
+    }
+    for (uint32_t i = 0; i < ARRAY_SIZE(midi_out_default); i++) {
+        ASSERT(0 <= app_midi_out_add(app, midi_out_default[i]));
+    }
+    int pd_out = app_midi_out_find(app, "pd_out");
+    app->pd_out_buf    = &app->midi_out[pd_out];
+    app->transport_buf = &app->midi_out[app_midi_out_find(app, "transport")];
+    app->fire_out_buf  = &app->midi_out[app_midi_out_find(app, "fire_out")];
+
+    /* All MIDI ports go to Pd until configured otherwise. */
+    for (int i = 0; i < ROUTE_NB_MIDI; i++) app->route.midi[i] = pd_out;
+    app_route_resolve(app);
+}
+
+/* Called before the JACK client is activated, so this can access the
+   sequencer directly. */
+void app_snapshot_load(struct app *app, const char *path) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        LOG("snapshot: no %s\n", path);
+        return;
+    }
+    struct stat st;
+    ASSERT(0 == fstat(fd, &st));
+    void *image = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (image == MAP_FAILED) {
+        LOG("snapshot: can't map %s\n", path);
+        return;
+    }
+    struct sequencer *s = &app->sequencer;
+    if (sequencer_snapshot_load(s, image, st.st_size)) {
+        LOG("snapshot: bad image %s\n", path);
+    }
+    else {
+        LOG("snapshot: loaded %s\n", path);
+        FOR_SEQUENCER_PATTERNS(s, ip) {
+            struct pattern_phase *pp = sequencer_pattern(s, ip.pattern_nb);
+            if (pattern_phase_used == pattern_phase_lifecycle(pp)) {
+                app_pattern_state(s, ip.pattern_nb, !pp->mute);
+            }
+        }
+    }
+    munmap(image, st.st_size);
+}
+
+/* Requests from Erlang, see packet4_reader.  All packets that came in
+   with one read() are handled before the next one. */
+static struct packet4_reader stdin_reader = { .fd = 0 };
+
+static void handle_packet(struct app *app, const uint8_t *buf, uint32_t size) {
+    ASSERT(size >= 2);
+    uint16_t tag = read_be(buf, 2);
+    switch(tag) {
+    case TAG_U32: {
+        tag_u32_dispatch(handle_tag_u32,
+                         send_reply_tag_u32,
+                         app,
+                         buf, size);
+        break;
+    }
+    default:
+        ERROR("unknown tag 0x%04x\n", tag);
+    }
+}
+
 void synth_tools_rs_init(void);
 void synth_tools_zig_init(void);
 
@@ -962,6 +2843,11 @@ int main(int argc, char **argv) {
 
     struct app *app = &app_state;
     app_init(app);
+    /* Optional snapshot to restore the sequencer from. */
+    if (argc > 1) {
+        app_snapshot_load(app, argv[1]);
+    }
+    erl_out_init(&erl_out);
 
     /* Jack client setup */
     const char *client_name = "hub"; // argv[1];
@@ -974,11 +2860,14 @@ int main(int argc, char **argv) {
     ASSERT(0 == jack_set_port_connect_callback(client, port_connect, NULL));
     ASSERT(0 == jack_set_client_registration_callback(client, client_registration, NULL));
 
-    FOR_MIDI_IN(REGISTER_JACK_MIDI_IN);
-    FOR_MIDI_OUT(REGISTER_JACK_MIDI_OUT);
+    app_ports_init(app);
+    FOR_CV_OUT(REGISTER_JACK_AUDIO_OUT);
 
     jack_set_process_callback (client, process, 0);
+    jack_load_init(&jack_load, client);
     ASSERT(!mlockall(MCL_CURRENT | MCL_FUTURE));
+    jack_on_shutdown(client, client_shutdown, NULL);
+    __atomic_store_n(&client_active, 1, __ATOMIC_RELEASE);
     ASSERT(!jack_activate(client));
 
 
@@ -986,24 +2875,13 @@ int main(int argc, char **argv) {
     /* Use the generic {packet,4} + tag protocol on stdin, since hub.c
        might be hosting a lot of in-image functionality later. */
     for(;;) {
-        uint8_t size_be[4];
-        assert_read(0, size_be, 4);
-        uint32_t size = read_be(size_be, 4);
-        uint8_t buf[size];
-        assert_read(0, buf, size);
-        ASSERT(size >= 2);
-        uint16_t tag = read_be(buf, 2);
-        switch(tag) {
-        case TAG_U32: {
-            tag_u32_dispatch(handle_tag_u32,
-                             send_reply_tag_u32,
-                             app,
-                             buf, size);
-            break;
-        }
-        default:
-            ERROR("unknown tag 0x%04x\n", tag);
+        uint32_t size;
+        const uint8_t *packet = packet4_reader_next(&stdin_reader, &size);
+        if (!packet) {
+            LOG("hub: stdin closed\n");
+            exit(0);
         }
+        handle_packet(app, packet, size);
     }
     return 0;
 }
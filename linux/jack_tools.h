@@ -3,6 +3,7 @@
 
 #define _GNU_SOURCE
 #include <unistd.h>
+#include <string.h>
 #include <jack/jack.h>
 #include <jack/midiport.h>
 #include "macros.h"
@@ -53,6 +54,92 @@ void midi_cursor_update(struct midi_cursor *cur) {
         midi_cursor_update(&cur))
 
 
+/* Process callback load.  Wrap the body of process() in
+   jack_load_begin() / jack_load_end() to time each invocation, and
+   call jack_load_init() before jack_activate() to count xruns.
+
+   The JACK thread is the only writer of the timing fields and the
+   xrun callback the only writer of nb_xruns, so the counters need no
+   locks.  A reader in another thread takes a jack_load_read()
+   snapshot.  A reset is a request that the JACK thread carries out at
+   the next cycle, so it does not race with the counter updates.
+
+   Bucket b of the histogram counts cycles that took less than 2^b
+   microseconds, the last bucket counts everything longer. */
+#define JACK_LOAD_HIST 16
+struct jack_load {
+    uint32_t nb_cycles;
+    uint32_t max_us;
+    uint32_t nframes;
+    uint32_t hist[JACK_LOAD_HIST];
+    uint32_t nb_xruns;
+    uint32_t reset_req, reset_ack;
+};
+struct jack_load_snapshot {
+    uint32_t nb_cycles;
+    uint32_t max_us;
+    uint32_t nframes;
+    uint32_t nb_xruns;
+    uint32_t hist[JACK_LOAD_HIST];
+};
+static inline int jack_load_xrun(void *arg) {
+    struct jack_load *l = arg;
+    __atomic_fetch_add(&l->nb_xruns, 1, __ATOMIC_RELAXED);
+    return 0;
+}
+static inline void jack_load_init(struct jack_load *l, jack_client_t *client) {
+    memset(l, 0, sizeof(*l));
+    ASSERT(0 == jack_set_xrun_callback(client, jack_load_xrun, l));
+}
+static inline jack_time_t jack_load_begin(struct jack_load *l) {
+    if (__atomic_load_n(&l->reset_req, __ATOMIC_ACQUIRE) != l->reset_ack) {
+        l->nb_cycles = 0;
+        l->max_us = 0;
+        memset(l->hist, 0, sizeof(l->hist));
+        __atomic_store_n(&l->reset_ack, l->reset_req, __ATOMIC_RELEASE);
+    }
+    return jack_get_time();
+}
+static inline void jack_load_end(struct jack_load *l, jack_time_t t0, jack_nframes_t nframes) {
+    jack_time_t us = jack_get_time() - t0;
+    uint32_t bucket = us ? 64 - __builtin_clzll(us) : 0;
+    if (bucket >= JACK_LOAD_HIST) bucket = JACK_LOAD_HIST - 1;
+    __atomic_store_n(&l->hist[bucket], l->hist[bucket] + 1, __ATOMIC_RELAXED);
+    if (us > l->max_us) __atomic_store_n(&l->max_us, us, __ATOMIC_RELAXED);
+    __atomic_store_n(&l->nframes, nframes, __ATOMIC_RELAXED);
+    __atomic_store_n(&l->nb_cycles, l->nb_cycles + 1, __ATOMIC_RELEASE);
+}
+/* Non-RT side.  The fields are read one by one, so the snapshot can
+   be off by the cycle that is running while it is taken.  The xrun
+   count is reset right away, the timing fields at the next cycle. */
+static inline void jack_load_read(struct jack_load *l, struct jack_load_snapshot *s, int reset) {
+    s->nb_cycles = __atomic_load_n(&l->nb_cycles, __ATOMIC_ACQUIRE);
+    s->max_us    = __atomic_load_n(&l->max_us, __ATOMIC_RELAXED);
+    s->nframes   = __atomic_load_n(&l->nframes, __ATOMIC_RELAXED);
+    for (int i = 0; i < JACK_LOAD_HIST; i++) {
+        s->hist[i] = __atomic_load_n(&l->hist[i], __ATOMIC_RELAXED);
+    }
+    if (reset) {
+        s->nb_xruns = __atomic_exchange_n(&l->nb_xruns, 0, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&l->reset_req, 1, __ATOMIC_RELEASE);
+    }
+    else {
+        s->nb_xruns = __atomic_load_n(&l->nb_xruns, __ATOMIC_RELAXED);
+    }
+}
+static inline void jack_load_log(struct jack_load *l, const char *name) {
+    struct jack_load_snapshot s;
+    jack_load_read(l, &s, 0);
+    LOG("%s: %d cycles of %d frames, max %d us, %d xruns\n",
+        name, s.nb_cycles, s.nframes, s.max_us, s.nb_xruns);
+    for (int i = 0; i < JACK_LOAD_HIST - 1; i++) {
+        if (s.hist[i]) LOG("%s: <  %6d us: %d\n", name, 1 << i, s.hist[i]);
+    }
+    LOG("%s: >= %6d us: %d\n", name, 1 << (JACK_LOAD_HIST - 2),
+        s.hist[JACK_LOAD_HIST - 1]);
+}
+
+
 /* Some default is necessary for apps that have a main thread and a
    jack thread.  To keep it simple, standarize on a pipe each way.
    This uses pipe2. */
@@ -274,10 +274,13 @@ static inline void process_audio(jack_nframes_t nframes) {
     }
 #endif
 }
+static struct jack_load jack_load;
 static int process (jack_nframes_t nframes, void *arg) {
+    jack_time_t t0 = jack_load_begin(&jack_load);
     /* Order is important. */
     process_midi(nframes);
     process_audio(nframes);
+    jack_load_end(&jack_load, t0, nframes);
     return 0;
 }
 
@@ -295,6 +298,7 @@ int main(int argc, char **argv) {
     FOR_AUDIO_OUT(REGISTER_JACK_AUDIO_OUT);
 
     jack_set_process_callback (client, process, 0);
+    jack_load_init(&jack_load, client);
     ASSERT(!mlockall(MCL_CURRENT | MCL_FUTURE));
     ASSERT(!jack_activate(client));
 
@@ -306,6 +310,8 @@ int main(int argc, char **argv) {
         // FIXME: only used to signal exit
         uint8_t buf[4];
         assert_read(0, buf, sizeof(buf));
+        /* There is no reply channel, so the load goes to the log. */
+        jack_load_log(&jack_load, "synth");
         exit(1);
     }
     return 0;
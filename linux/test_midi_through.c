@@ -0,0 +1,113 @@
+/* MIDI through routing matrix, see mod_midi_through.c */
+#include "mod_midi_through.c"
+#include "macros.h"
+
+struct midi_through_map map;
+
+struct sent {
+    uint32_t out;
+    uint32_t len;
+    uint8_t msg[3];
+} sent[16];
+uint32_t nb_sent;
+void collect(void *ctx, uint32_t out, const uint8_t *msg, uint32_t len) {
+    ASSERT(nb_sent < ARRAY_SIZE(sent));
+    sent[nb_sent].out = out;
+    sent[nb_sent].len = len;
+    memcpy(sent[nb_sent].msg, msg, len);
+    nb_sent++;
+}
+uint32_t route(uint32_t in, uint8_t s, uint8_t d1, uint8_t d2, uint32_t len) {
+    const uint8_t msg[] = {s, d1, d2};
+    nb_sent = 0;
+    uint32_t nb = midi_through_event(&map, in, msg, len, collect, NULL);
+    ASSERT(nb == nb_sent);
+    return nb;
+}
+void expect(uint32_t i, uint32_t out, uint8_t s, uint8_t d1, uint8_t d2) {
+    ASSERT(i < nb_sent);
+    ASSERT(sent[i].out == out);
+    ASSERT(sent[i].msg[0] == s);
+    ASSERT(sent[i].msg[1] == d1);
+    if (sent[i].len == 3) ASSERT(sent[i].msg[2] == d2);
+}
+
+#define NOTES 0x07  // note off, note on, poly aftertouch
+
+int main(int argc, char **argv) {
+    struct midi_through_rule rule[] = {
+        /* Input 2, channel 0 notes to output 5 channel 9, an octave up. */
+        { .in = 2, .out = 5, .chan_mask = 0x0001, .status_mask = NOTES,
+          .chan = 9, .transpose = 12, .vel_max = 127 },
+        /* Everything on input 2 to output 1 unchanged, with fixed
+           velocity. */
+        { .in = 2, .out = 1, .chan_mask = 0xFFFF, .status_mask = 0x7F,
+          .chan = MIDI_THROUGH_CHAN_KEEP, .vel_min = 100, .vel_max = 100 },
+        /* Soft curve on input 3. */
+        { .in = 3, .out = 0, .chan_mask = 0xFFFF, .status_mask = NOTES,
+          .chan = MIDI_THROUGH_CHAN_KEEP, .curve = midi_through_curve_soft,
+          .vel_max = 127 },
+        /* Not registered. */
+        { .in = 0xFF, .out = 0, .chan_mask = 0xFFFF, .status_mask = 0x7F },
+    };
+    ASSERT(0 == midi_through_compile(&map, rule, ARRAY_SIZE(rule)));
+    ASSERT(map.in_mask == ((1 << 2) | (1 << 3)));
+
+    ASSERT(2 == route(2, 0x90, 60, 64, 3));
+    expect(0, 5, 0x99, 72, 64);
+    expect(1, 1, 0x90, 60, 100);
+
+    /* Note on with velocity 0 is a note off and keeps it. */
+    ASSERT(2 == route(2, 0x90, 60, 0, 3));
+    expect(0, 5, 0x99, 72, 0);
+    expect(1, 1, 0x90, 60, 0);
+
+    /* Other channels and statuses only match the second rule. */
+    ASSERT(1 == route(2, 0x93, 60, 64, 3));
+    expect(0, 1, 0x93, 60, 100);
+    ASSERT(1 == route(2, 0xB0, 7, 99, 3));
+    expect(0, 1, 0xB0, 7, 99);
+    ASSERT(1 == route(2, 0xC4, 12, 0, 2));
+    expect(0, 1, 0xC4, 12, 0);
+
+    /* Transpose drops notes that go out of range. */
+    ASSERT(1 == route(2, 0x80, 120, 0, 3));
+    expect(0, 1, 0x80, 120, 0);
+
+    /* Soft curve keeps the end points, lowers the middle, and does
+       not turn a note on into a note off. */
+    ASSERT(1 == route(3, 0x90, 60, 127, 3));
+    expect(0, 0, 0x90, 60, 127);
+    ASSERT(1 == route(3, 0x90, 60, 64, 3));
+    ASSERT(sent[0].msg[2] < 64);
+    ASSERT(1 == route(3, 0x90, 60, 1, 3));
+    expect(0, 0, 0x90, 60, 1);
+
+    /* Unrouted inputs, system and incomplete messages. */
+    ASSERT(0 == route(1, 0x90, 60, 64, 3));
+    ASSERT(0 == route(2, 0xF8, 0, 0, 1));
+    ASSERT(0 == route(2, 0x90, 60, 0, 2));
+    ASSERT(0 == route(MIDI_THROUGH_NB_IN, 0x90, 60, 64, 3));
+
+    /* Fanout is bounded. */
+    struct midi_through_rule many[MIDI_THROUGH_FANOUT + 1];
+    for (uint32_t i = 0; i < ARRAY_SIZE(many); i++) {
+        many[i] = rule[1];
+        many[i].out = i;
+    }
+    ASSERT(0 == midi_through_compile(&map, many, MIDI_THROUGH_FANOUT));
+    ASSERT(MIDI_THROUGH_FANOUT == route(2, 0x90, 60, 64, 3));
+    ASSERT(-1 == midi_through_compile(&map, many, ARRAY_SIZE(many)));
+    ASSERT(map.in_mask == 0);
+    ASSERT(0 == route(2, 0x90, 60, 64, 3));
+
+    /* Bad parameters. */
+    struct midi_through_rule bad = rule[0];
+    bad.chan = 16;
+    ASSERT(-1 == midi_through_compile(&map, &bad, 1));
+    bad = rule[0];
+    bad.vel_min = 100;
+    bad.vel_max = 50;
+    ASSERT(-1 == midi_through_compile(&map, &bad, 1));
+    return 0;
+}
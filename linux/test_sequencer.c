@@ -3,7 +3,7 @@
 #define STEP_POOL_SIZE 10
 #define PATTERN_POOL_SIZE 10
 
-/* Works up to size 64 */
+/* Works up to size 64, see step_pool_info() */
 #define STEP_ALL_FREE ((1<<STEP_POOL_SIZE)-1)
 #define PATTERN_ALL_FREE ((1<<PATTERN_POOL_SIZE)-1)
 
@@ -26,7 +26,7 @@ pattern_t test_pattern_1(struct sequencer *s) {
     sequencer_add_step_cv(s, pat, 0, 100, 12);
     sequencer_add_step_cv(s, pat, 0, 200,  8);
     sequencer_add_step_cv(s, pat, 0, 150,  8);
-    swtimer_schedule(&s->swtimer, 0, pat);
+    sequencer_schedule(s, 0, pat);
     sequencer_info_pattern(s, pat);
     return pat;
 }
@@ -34,7 +34,7 @@ pattern_t test_pattern_2(struct sequencer *s) {
     LOG("alloc pat2\n");
     pattern_t pat = sequencer_pattern_alloc(s);
     sequencer_add_step_cv(s, pat, 0, 1001, 4);
-    swtimer_schedule(&s->swtimer, 0, pat);
+    sequencer_schedule(s, 0, pat);
     sequencer_info_pattern(s, pat);
     return pat;
 }
@@ -43,7 +43,7 @@ pattern_t test_pattern_3(struct sequencer *s) {
     LOG("alloc pat3\n");
     pattern_t pat = sequencer_pattern_alloc(s);
     sequencer_add_step_cv(s, pat, 0, 1002, 8);
-    swtimer_schedule(&s->swtimer, 0, pat);
+    sequencer_schedule(s, 0, pat);
     sequencer_info_pattern(s, pat);
     return pat;
 }
@@ -147,6 +147,414 @@ void test_record_empty(struct sequencer *s) {
     }
 }
 
+/* Offline rendering should produce the same event stream as ticking
+   the sequencer one MIDI clock at a time. */
+struct sequencer_event ref_buf[100];
+uintptr_t ref_nb;
+void ref_dispatch(struct sequencer *seq, const union pattern_event *ev) {
+    ASSERT(ref_nb < ARRAY_SIZE(ref_buf));
+    ref_buf[ref_nb].time = seq->time;
+    ref_buf[ref_nb].event = *ev;
+    ref_nb++;
+}
+void test_render(void) {
+    struct sequencer ref, ren;
+    sequencer_init(&ref, ref_dispatch);
+    sequencer_init(&ren, NULL);
+    test_pattern_1(&ref); test_pattern_2(&ref); test_pattern_3(&ref);
+    test_pattern_1(&ren); test_pattern_2(&ren); test_pattern_3(&ren);
+
+    uintptr_t nb_ticks = 200;
+    for(uintptr_t i=0; i<nb_ticks; i++) sequencer_tick(&ref);
+
+    /* Use a small buffer to exercise chunking. */
+    struct sequencer_event buf[7];
+    struct sequencer_render r = {
+        .buf = buf, .size = ARRAY_SIZE(buf), .reserve = 3
+    };
+    uintptr_t done = 0, nb = 0;
+    while(done < nb_ticks) {
+        r.nb = 0;
+        done += sequencer_render(&ren, &r, nb_ticks - done);
+        for(uintptr_t i=0; i<r.nb; i++) {
+            ASSERT(nb < ref_nb);
+            ASSERT(buf[i].time == ref_buf[nb].time);
+            ASSERT(buf[i].event.u32 == ref_buf[nb].event.u32);
+            nb++;
+        }
+    }
+    LOG("render: %d events\n", (int)nb);
+    ASSERT(nb == ref_nb);
+    ASSERT(r.nb_drop == 0);
+    ASSERT(ren.time == ref.time);
+}
+
+/* Patterns of the same length share a timer entry after restart.
+   Playback should not change, apart from the order of events that
+   happen at the same time. */
+int event_cmp(const void *va, const void *vb) {
+    const struct sequencer_event *a = va, *b = vb;
+    if (a->time != b->time) return a->time < b->time ? -1 : 1;
+    if (a->event.u32 != b->event.u32) return a->event.u32 < b->event.u32 ? -1 : 1;
+    return 0;
+}
+void test_group_patterns(struct sequencer *s) {
+    test_pattern_1(s);
+    test_pattern_3(s);
+    /* Same length as pattern 1 */
+    pattern_t pat = sequencer_pattern_alloc(s);
+    sequencer_add_step_cv(s, pat, 0, 1003, 20);
+    sequencer_add_step_cv(s, pat, 0, 1004, 8);
+    sequencer_schedule(s, 0, pat);
+}
+void test_group(void) {
+    struct sequencer_event grp_buf[ARRAY_SIZE(ref_buf)];
+    struct sequencer ref, grp;
+    uintptr_t nb_ticks = 100;
+
+    ref_nb = 0;
+    sequencer_init(&ref, ref_dispatch);
+    test_group_patterns(&ref);
+    /* Scheduled at the same time, so they share a timer entry. */
+    ASSERT(sequencer_timer_nb(&ref.timer) == 1);
+    for(uintptr_t i=0; i<nb_ticks; i++) sequencer_tick(&ref);
+    uintptr_t nb = ref_nb;
+    memcpy(grp_buf, ref_buf, sizeof(grp_buf));
+
+    ref_nb = 0;
+    sequencer_init(&grp, ref_dispatch);
+    test_group_patterns(&grp);
+    sequencer_restart(&grp);
+    ASSERT(sequencer_timer_nb(&grp.timer) == 2);
+    sequencer_check_invariants(&grp);
+    for(uintptr_t i=0; i<nb_ticks; i++) sequencer_tick(&grp);
+    sequencer_check_invariants(&grp);
+
+    ASSERT(nb == ref_nb);
+    qsort(grp_buf, nb, sizeof(grp_buf[0]), event_cmp);
+    qsort(ref_buf, nb, sizeof(ref_buf[0]), event_cmp);
+    for(uintptr_t i=0; i<nb; i++) {
+        ASSERT(grp_buf[i].time == ref_buf[i].time);
+        ASSERT(grp_buf[i].event.u32 == ref_buf[i].event.u32);
+    }
+    LOG("group: %d events\n", (int)nb);
+
+    /* Patterns are split after steps that are not due together, and
+       join again where they are.  After 100 ticks they are all due at
+       the same time. */
+    uint32_t nb_groups = sequencer_timer_nb(&grp.timer);
+    ASSERT(nb_groups == 1);
+
+    /* A recording duplicated 5 ticks into a pass is not due with the
+       original, so it gets its own timer entry. */
+    sequencer_cursor_open(&grp, 24);
+    union pattern_event ev = {.u8 = {1,2,3,4}};
+    sequencer_cursor_write(&grp, &ev);
+    sequencer_ntick(&grp, 5);
+    sequencer_cursor_dup(&grp);
+    sequencer_cursor_write(&grp, &ev);
+    sequencer_cursor_close(&grp);
+    ASSERT(sequencer_timer_nb(&grp.timer) == nb_groups + 2);
+    /* Both loops play twice, 5 ticks apart. */
+    ref_nb = 0;
+    sequencer_ntick(&grp, 24 * 2 + 1);
+    uintptr_t nb_rec = 0;
+    for(uintptr_t i=0; i<ref_nb; i++) {
+        if (ref_buf[i].event.u32 == ev.u32) nb_rec++;
+    }
+    ASSERT(nb_rec == 4);
+}
+
+/* Patterns of the same length but a different rhythm split up after
+   the first step, and meet again at the start of each loop, where they
+   share a timer entry again. */
+void test_group_passes(void) {
+    struct sequencer seq, *s = &seq;
+    sequencer_init(s, ref_dispatch);
+    for (int i = 0; i < 4; i++) {
+        pattern_t pat = sequencer_pattern_alloc(s);
+        sequencer_add_step_cv(s, pat, 0, i, 4 + i);
+        sequencer_add_step_cv(s, pat, 0, i, 20 - i);
+    }
+    sequencer_restart(s);
+    ASSERT(sequencer_timer_nb(&s->timer) == 1);
+    for (int pass = 0; pass < 3; pass++) {
+        sequencer_ntick(s, 1);
+        ASSERT(sequencer_timer_nb(&s->timer) == 4);
+        sequencer_ntick(s, 23);
+        ASSERT(sequencer_timer_nb(&s->timer) == 1);
+        sequencer_check_invariants(s);
+    }
+
+    /* Each pass of a live recording is duplicated at its header, so
+       the new pass is due together with the one before it. */
+    sequencer_init(s, ref_dispatch);
+    sequencer_cursor_open(s, 24);
+    sequencer_ntick(s, 24 + 5);
+    union pattern_event ev = {.u8 = {1,2,3,4}};
+    for (int pass = 0; pass < 3; pass++) {
+        sequencer_cursor_write(s, &ev);
+        sequencer_ntick(s, 24);
+        sequencer_check_invariants(s);
+    }
+    /* The recorded passes are due at their event, the open pass at
+       its header. */
+    ASSERT(sequencer_timer_nb(&s->timer) == 2);
+    sequencer_cursor_close(s);
+    ref_nb = 0;
+    sequencer_ntick(s, 24);
+    ASSERT(ref_nb == 3);
+    ASSERT(sequencer_timer_nb(&s->timer) == 1);
+    ASSERT(sequencer_stats_free_patterns(s) == PATTERN_POOL_SIZE - 3);
+    LOG("group passes: ok\n");
+}
+
+/* Overdub merges all loop passes into one pattern, snapped to the
+   grid. */
+void test_overdub(void) {
+    struct sequencer seq, *s = &seq;
+    sequencer_init(s, ref_dispatch);
+    s->cursor.overdub = 1;
+    s->cursor.grid = 6;
+    pattern_t pat = sequencer_cursor_open(s, 24);
+    /* The open recording keeps its mode. */
+    s->cursor.overdub = 0;
+    s->cursor.grid = 0;
+    union pattern_event ev[3] = {
+        {.u8 = {0, 0x90, 60, 100}},
+        {.u8 = {0, 0x90, 62, 100}},
+        {.u8 = {0, 0x90, 64, 100}},
+    };
+    /* Headers are at 24, 48, 72, 96.  The cursor is 1 clock past the
+       header right after it. */
+    sequencer_ntick(s, 29);  // 5 -> 6
+    sequencer_cursor_write(s, &ev[0]);
+    sequencer_ntick(s, 32);  // 13 -> 12
+    sequencer_cursor_write(s, &ev[1]);
+    sequencer_ntick(s, 34);  // 23 -> 0 of the next pass
+    sequencer_cursor_write(s, &ev[2]);
+    ASSERT(sequencer_pattern(s, pat)->nb_steps == 4);
+    ASSERT(sequencer_stats_free_patterns(s) == PATTERN_POOL_SIZE - 1);
+
+    sequencer_ntick(s, 1);
+    ref_nb = 0;
+    sequencer_ntick(s, 24);
+    sequencer_cursor_close(s);
+    sequencer_check_invariants(s);
+    ASSERT(ref_nb == 3);
+    ASSERT(ref_buf[0].time ==  96 && ref_buf[0].event.u32 == ev[2].u32);
+    ASSERT(ref_buf[1].time == 102 && ref_buf[1].event.u32 == ev[0].u32);
+    ASSERT(ref_buf[2].time == 108 && ref_buf[2].event.u32 == ev[1].u32);
+    LOG("overdub: %d events\n", (int)ref_nb);
+}
+
+/* Only sounding notes get a note off. */
+struct sequencer_notes notes;
+void notes_dispatch(struct sequencer *seq, const union pattern_event *ev) {
+    sequencer_notes_update(&notes, ev);
+}
+void notes_off(void *ctx, const union pattern_event *ev) {
+    ASSERT(ref_nb < ARRAY_SIZE(ref_buf));
+    ref_buf[ref_nb++].event = *ev;
+}
+void test_notes(void) {
+    struct sequencer seq, *s = &seq;
+    sequencer_init(s, notes_dispatch);
+    pattern_t a = sequencer_pattern_alloc(s);
+    union pattern_event a_ev[3] = {
+        PAT_MIDI(1, 0x92, 60, 100),
+        PAT_MIDI(1, 0x82, 60, 0),
+        PAT_MIDI(1, 0x92, 64, 100),
+    };
+    for (int i=0; i<3; i++) sequencer_add_step_event(s, a, &a_ev[i], 4);
+    sequencer_schedule(s, 0, a);
+    pattern_t b = sequencer_pattern_alloc(s);
+    union pattern_event b_ev = PAT_MIDI(0, 0x90, 67, 100);
+    sequencer_add_step_event(s, b, &b_ev, 16);
+    sequencer_schedule(s, 0, b);
+
+    /* 64 and 67 are sounding. */
+    sequencer_ntick(s, 10);
+    ref_nb = 0;
+    sequencer_notes_release_pattern(s, &notes, a, notes_off, NULL);
+    ASSERT(ref_nb == 1);
+    union pattern_event off_64 = PAT_MIDI(1, 0x82, 64, 0);
+    ASSERT(ref_buf[0].event.u32 == off_64.u32);
+    ref_nb = 0;
+    sequencer_notes_release_port(&notes, 1, notes_off, NULL);
+    ASSERT(ref_nb == 0);
+    sequencer_notes_release_port(&notes, 0, notes_off, NULL);
+    ASSERT(ref_nb == 1);
+    union pattern_event off_67 = PAT_MIDI(0, 0x80, 67, 0);
+    ASSERT(ref_buf[0].event.u32 == off_67.u32);
+    ref_nb = 0;
+    sequencer_notes_release_all(&notes, notes_off, NULL);
+    ASSERT(ref_nb == 0);
+    LOG("notes: ok\n");
+}
+
+/* Groove slots follow the position in the loop, and restart with
+   each loop of a pattern that is not a whole bar. */
+uint16_t groove_slot[32];
+uintptr_t groove_nb;
+void groove_dispatch(struct sequencer *seq, const union pattern_event *ev) {
+    ASSERT(groove_nb < ARRAY_SIZE(groove_slot));
+    groove_slot[groove_nb++] = seq->groove_slot;
+}
+void test_groove(void) {
+    struct sequencer seq, *s = &seq;
+    sequencer_init(s, groove_dispatch);
+    pattern_t a = sequencer_pattern_alloc(s);
+    dtime_t a_delay[] = {3, 3, 6, 8};
+    for (int i=0; i<4; i++) sequencer_add_step_cv(s, a, 0, i, a_delay[i]);
+    sequencer_pattern(s, a)->groove = 2;
+    pattern_t b = sequencer_pattern_alloc(s);
+    for (int i=0; i<6; i++) sequencer_add_step_cv(s, b, 1, i, 20);
+    sequencer_restart(s);
+
+    groove_nb = 0;
+    sequencer_ntick(s, 40);
+    uint16_t expect_a[] = {32, 32, 33, 34, 32, 32, 33, 34};
+    uint16_t expect_b[] = {0, 3};
+    uintptr_t ia = 0, ib = 0;
+    for (uintptr_t i=0; i<groove_nb; i++) {
+        if (groove_slot[i] >= 32) { ASSERT(groove_slot[i] == expect_a[ia++]); }
+        else                      { ASSERT(groove_slot[i] == expect_b[ib++]); }
+    }
+    ASSERT(ia == 8);
+    ASSERT(ib == 2);
+    /* The last step of b is past the bar, and b restarts at slot 0
+       when it loops. */
+    groove_nb = 0;
+    sequencer_ntick(s, 90);
+    ib = 0;
+    uint16_t expect_b2[] = {6, 10, 13, 0, 0};
+    for (uintptr_t i=0; i<groove_nb; i++) {
+        if (groove_slot[i] < 32) { ASSERT(groove_slot[i] == expect_b2[ib++]); }
+    }
+    ASSERT(ib == ARRAY_SIZE(expect_b2));
+    LOG("groove: ok\n");
+}
+
+/* Play a number of ticks and compare to pairs of time, relative to
+   the start, and CV value. */
+void transform_expect(struct sequencer *s, uintptr_t nb_ticks,
+                      const uint16_t *expect, uintptr_t nb) {
+    uint32_t t0 = s->time;
+    ref_nb = 0;
+    sequencer_ntick(s, nb_ticks);
+    ASSERT(ref_nb == nb);
+    for (uintptr_t i=0; i<nb; i++) {
+        ASSERT(ref_buf[i].time - t0 == expect[2*i]);
+        ASSERT(ref_buf[i].event.u16[1] == expect[2*i+1]);
+    }
+}
+void test_transform(void) {
+    struct sequencer seq, *s = &seq;
+    sequencer_init(s, ref_dispatch);
+    pattern_t a = sequencer_pattern_alloc(s);
+    dtime_t delay[] = {2, 3, 5};
+    for (int i=0; i<3; i++) sequencer_add_step_cv(s, a, 0, i, delay[i]);
+    sequencer_restart(s);
+
+    /* Nothing lands on the start, so a head step is added. */
+    ASSERT(0 == sequencer_pattern_rotate(s, a, 4));
+    sequencer_check_invariants(s);
+    ASSERT(sequencer_pattern(s, a)->nb_steps == 4);
+    uint16_t rot[] = {4,0, 6,1, 9,2, 14,0, 16,1, 19,2};
+    transform_expect(s, 20, rot, ARRAY_SIZE(rot)/2);
+
+    /* Rotating back removes it. */
+    ASSERT(0 == sequencer_pattern_rotate(s, a, 6));
+    sequencer_check_invariants(s);
+    ASSERT(sequencer_pattern(s, a)->nb_steps == 3);
+    uint16_t orig[] = {0,0, 2,1, 5,2};
+    transform_expect(s, 10, orig, ARRAY_SIZE(orig)/2);
+
+    ASSERT(0 == sequencer_pattern_reverse(s, a));
+    sequencer_check_invariants(s);
+    uint16_t rev[] = {0,0, 5,2, 8,1};
+    transform_expect(s, 10, rev, ARRAY_SIZE(rev)/2);
+
+    ASSERT(-1 == sequencer_pattern_scale(s, a, 0, 2));
+    ASSERT(0 == sequencer_pattern_scale(s, a, 1, 2));
+    sequencer_check_invariants(s);
+    ASSERT(sequencer_pattern_length(s, a) == 5);
+    uint16_t half[] = {0,0, 3,2, 4,1, 5,0, 8,2, 9,1};
+    transform_expect(s, 10, half, ARRAY_SIZE(half)/2);
+
+    /* While playing, the loop position is kept.  The step that is
+       due right now comes before the old head, so it waits for the
+       next pass. */
+    sequencer_ntick(s, 1);
+    ASSERT(0 == sequencer_pattern_rotate(s, a, 1));
+    sequencer_check_invariants(s);
+    uint16_t live[] = {3,2, 4,1, 5,0, 8,2, 9,1};
+    transform_expect(s, 10, live, ARRAY_SIZE(live)/2);
+
+    pattern_t b = sequencer_pattern_alloc(s);
+    union pattern_event note[] = {
+        PAT_MIDI(0, 0x90, 60, 100), PAT_MIDI(0, 0x80, 60, 0),
+        PAT_MIDI(0, 0x90, 125, 100),
+    };
+    for (int i=0; i<3; i++) sequencer_add_step_event(s, b, &note[i], 4);
+    ASSERT(0 == sequencer_pattern_transpose(s, b, 5));
+    uint8_t key[] = {65, 65, 125};
+    int i = 0;
+    FOR_SEQUENCER_STEPS(s, b, is) { ASSERT(is.step->event.u8[2] == key[i++]); }
+
+    /* A loop without length has no position to keep. */
+    pattern_t c = sequencer_pattern_alloc(s);
+    for (int i=0; i<2; i++) sequencer_add_step_cv(s, c, 0, i, 0);
+    ASSERT(-1 == sequencer_pattern_rotate(s, c, 1));
+    ASSERT(-1 == sequencer_pattern_reverse(s, c));
+
+    ASSERT(-1 == sequencer_pattern_rotate(s, 9, 1));
+    ASSERT(-1 == sequencer_pattern_reverse(s, 9));
+    LOG("transform: ok\n");
+}
+
+/* A sequencer restored from a snapshot plays on in phase. */
+void test_snapshot(void) {
+    struct sequencer_event cont_buf[ARRAY_SIZE(ref_buf)];
+    struct sequencer ref, res;
+    uintptr_t nb_ticks = 100;
+
+    sequencer_init(&ref, ref_dispatch);
+    test_group_patterns(&ref);
+    test_pattern_2(&ref);
+    sequencer_ntick(&ref, 37);
+    uint8_t image[sequencer_snapshot_bytes(&ref)];
+    ASSERT(0 == sequencer_snapshot_save(&ref, image, sizeof(image) - 1));
+    ASSERT(sizeof(image) == sequencer_snapshot_save(&ref, image, sizeof(image)));
+
+    ref_nb = 0;
+    sequencer_ntick(&ref, nb_ticks);
+    uintptr_t nb = ref_nb;
+    memcpy(cont_buf, ref_buf, sizeof(cont_buf));
+
+    sequencer_init(&res, ref_dispatch);
+    /* Run for a bit to make sure time base is different. */
+    sequencer_ntick(&res, 5);
+    image[0] ^= 1;
+    ASSERT(-1 == sequencer_snapshot_load(&res, image, sizeof(image)));
+    image[0] ^= 1;
+    ASSERT(0 == sequencer_snapshot_load(&res, image, sizeof(image)));
+    sequencer_check_invariants(&res);
+    ASSERT(sequencer_timer_nb(&res.timer) == sequencer_timer_nb(&ref.timer));
+    ref_nb = 0;
+    sequencer_ntick(&res, nb_ticks);
+
+    ASSERT(nb == ref_nb);
+    qsort(cont_buf, nb, sizeof(cont_buf[0]), event_cmp);
+    qsort(ref_buf, nb, sizeof(ref_buf[0]), event_cmp);
+    for(uintptr_t i=0; i<nb; i++) {
+        ASSERT(cont_buf[i].time == ref_buf[i].time);
+        ASSERT(cont_buf[i].event.u32 == ref_buf[i].event.u32);
+    }
+    LOG("snapshot: %d events\n", (int)nb);
+}
+
 
 int main(int argc, char **argv) {
     LOG("test_drum.c\n");
@@ -155,6 +563,14 @@ int main(int argc, char **argv) {
     s->verbose = 1;
     //test_pool_and_play(s);
     test_record(s);
+    test_render();
+    test_group();
+    test_group_passes();
+    test_snapshot();
+    test_overdub();
+    test_notes();
+    test_groove();
+    test_transform();
     //test_record_empty(s);
     return 0;
 }
@@ -0,0 +1,135 @@
+/* Run-time sized pools, as used by hub.c.  Capacities are well past
+   the 32/64 entry range of the pool_info() bitmasks. */
+#define SEQUENCER_POOL_ARENA
+#include "mod_sequencer.c"
+#include "macros.h"
+#include <stdlib.h>
+
+#define NB_STEPS    20000
+#define NB_PATTERNS 300
+
+uintptr_t nb_events;
+void count_dispatch(struct sequencer *seq, const union pattern_event *ev) {
+    nb_events++;
+}
+
+/* The compactor should not change playback.  Both sequencers get the
+   same fragmented patterns, only one of them is compacted. */
+struct sequencer ref, cmp;
+uint32_t hash[2];
+void hash_dispatch(struct sequencer *seq, const union pattern_event *ev) {
+    uint32_t *h = &hash[seq == &cmp];
+    *h = (*h * 31) + ev->u32 + seq->time;
+}
+void fragment(struct sequencer *s) {
+    pattern_t pat[8];
+    for (int p=0; p<8; p++) pat[p] = sequencer_pattern_alloc(s);
+    /* Interleave the steps of all patterns. */
+    for (int i=0; i<10; i++) {
+        for (int p=0; p<8; p++) {
+            sequencer_add_step_cv(s, pat[p], p, i, 1 + (p+i)%5);
+        }
+    }
+    /* Punch holes and reuse some of them. */
+    sequencer_clear_pattern(s, pat[1]);
+    sequencer_clear_pattern(s, pat[4]);
+    pattern_t extra = sequencer_pattern_alloc(s);
+    for (int i=0; i<15; i++) sequencer_add_step_cv(s, extra, 9, i, 3);
+    sequencer_restart(s);
+}
+void test_compact(void) {
+    struct sequencer *s[2] = {&ref, &cmp};
+    for (int i=0; i<2; i++) {
+        struct sequencer_arena a = { .size = sequencer_arena_bytes(200, 16) };
+        a.buf = malloc(a.size);
+        ASSERT(a.buf);
+        sequencer_init(s[i], hash_dispatch, &a, 200, 16);
+        fragment(s[i]);
+    }
+    cmp.compact.budget = 8;
+    for (int t=0; t<1000; t++) {
+        sequencer_tick(&ref);
+        sequencer_tick(&cmp);
+        ASSERT(hash[0] == hash[1]);
+    }
+    LOG("compact: %d moves %d passes\n",
+        cmp.compact.nb_moves, cmp.compact.nb_passes);
+    ASSERT(cmp.compact.nb_passes > 0);
+    ASSERT(cmp.compact.phase == sequencer_compact_idle);
+    /* Each pattern is now a contiguous run. */
+    FOR_SEQUENCER_PATTERNS(&cmp, ip) {
+        struct pattern_phase *pp = sequencer_pattern(&cmp, ip.pattern_nb);
+        if (pattern_phase_used != pattern_phase_lifecycle(pp)) continue;
+        struct pattern_step *prev = NULL;
+        FOR_SEQUENCER_STEPS(&cmp, ip.pattern_nb, is) {
+            ASSERT(!prev || (is.step == prev + 1));
+            prev = is.step;
+        }
+    }
+    sequencer_check_invariants(&cmp);
+
+    /* Edits made while a pass is running don't restart it, so passes
+       still complete when something is added at every tick. */
+    uint32_t nb_passes = cmp.compact.nb_passes;
+    pattern_t rec = sequencer_pattern_alloc(&cmp);
+    sequencer_add_step_cv(&cmp, rec, 10, 0, 1);
+    sequencer_schedule(&cmp, 0, rec);
+    for (int t=1; t<100; t++) {
+        sequencer_add_step_cv(&cmp, rec, 10, t, 1);
+        sequencer_tick(&cmp);
+    }
+    sequencer_check_invariants(&cmp);
+    ASSERT(cmp.compact.nb_passes > nb_passes + 1);
+}
+
+int main(int argc, char **argv) {
+    struct sequencer_arena arena = {
+        .size = sequencer_arena_bytes(NB_STEPS, NB_PATTERNS)
+    };
+    arena.buf = malloc(arena.size);
+    ASSERT(arena.buf);
+    struct sequencer _s, *s = &_s;
+    sequencer_init(s, count_dispatch, &arena, NB_STEPS, NB_PATTERNS);
+    ASSERT(arena.used <= arena.size);
+
+    /* Fill both pools completely. */
+    uintptr_t steps_per_pattern = NB_STEPS / NB_PATTERNS;
+    struct pattern_step step[steps_per_pattern];
+    memset(step, 0, sizeof(step));
+    for (uintptr_t i=0; i<steps_per_pattern; i++) {
+        step[i].event.u32 = i;
+        step[i].delay = 1;
+    }
+    for (uintptr_t p=0; p<NB_PATTERNS; p++) {
+        ASSERT(p == sequencer_load_pattern(s, step, steps_per_pattern));
+    }
+    ASSERT(PATTERN_NONE == sequencer_load_pattern(s, step, steps_per_pattern));
+    ASSERT(0 == pattern_pool_info(&s->pattern_pool));
+    ASSERT(0 == sequencer_stats_free_patterns(s));
+    ASSERT(0 == s->stats.min_free_patterns);
+    ASSERT(NB_STEPS - NB_PATTERNS * steps_per_pattern == s->stats.min_free_steps);
+
+    /* All patterns have the same length, so they share one timer
+       entry after restart. */
+    sequencer_restart(s);
+    ASSERT(sequencer_timer_nb(&s->timer) == 1);
+    sequencer_ntick(s, 1000);
+    LOG("arena: %d events\n", (int)nb_events);
+    ASSERT(nb_events == 1000 * NB_PATTERNS);
+    ASSERT(s->stats.nb_events == nb_events);
+    ASSERT(s->stats.max_events == NB_PATTERNS);
+    ASSERT(s->stats.events_hist[SEQUENCER_STATS_HIST-1] == 1000);
+
+    /* Free everything.  The first 64 entries show up in the masks. */
+    FOR_SEQUENCER_PATTERNS(s, ip) {
+        sequencer_clear_pattern(s, ip.pattern_nb);
+    }
+    sequencer_ntick(s, steps_per_pattern);
+    ASSERT(~0ULL == pattern_pool_info(&s->pattern_pool));
+    ASSERT(~0ULL == step_pool_info(&s->step_pool));
+    ASSERT(NB_STEPS == sequencer_stats_free_steps(s));
+    ASSERT(NB_PATTERNS == sequencer_stats_free_patterns(s));
+
+    test_compact();
+    return 0;
+}
@@ -0,0 +1,3 @@
+/* Same tests, using the timing wheel scheduler. */
+#define SEQUENCER_TIMER_WHEEL
+#include "test_sequencer.c"
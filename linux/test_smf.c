@@ -0,0 +1,137 @@
+/* SMF import and export of sequencer patterns, see mod_smf.c */
+#define SEQUENCER_POOL_ARENA
+#include "mod_sequencer.c"
+#include "mod_smf.c"
+#include "macros.h"
+#include <stdlib.h>
+
+/* Use small chunks on both sides to exercise buffer boundaries. */
+uint8_t file[4096];
+uint32_t file_nb;
+int file_flush(struct smf_writer *w) {
+    ASSERT(file_nb + w->nb <= sizeof(file));
+    memcpy(file + file_nb, w->buf, w->nb);
+    file_nb += w->nb;
+    return 0;
+}
+int file_fill(struct smf_reader *r) {
+    uint32_t offset = (const uint8_t*)r->buf - file + r->nb;
+    uint32_t nb = file_nb - offset;
+    if (nb > 5) nb = 5;
+    r->buf = file + offset;
+    r->nb = nb;
+    return nb;
+}
+
+struct smf_event event[100];
+uint32_t nb_events;
+int collect(void *ctx, uint32_t time, const union pattern_event *ev) {
+    if (nb_events == ARRAY_SIZE(event)) return -1;
+    event[nb_events].time = time;
+    event[nb_events].order = nb_events;
+    event[nb_events].event = *ev;
+    nb_events++;
+    return 0;
+}
+uint32_t decode(uint32_t ppq, struct smf_info *info, struct pattern_step *step) {
+    struct smf_reader r = { .buf = file, .fill = file_fill };
+    nb_events = 0;
+    ASSERT(0 == smf_decode(&r, ppq, collect, NULL, info));
+    ASSERT(r.offset == file_nb);
+    return smf_events_to_steps(event, nb_events, info->length, step);
+}
+
+/* Export a pattern from a sequencer and read it back. */
+void test_roundtrip(uint32_t format) {
+    struct sequencer_arena a = { .size = sequencer_arena_bytes(32, 4) };
+    a.buf = malloc(a.size);
+    ASSERT(a.buf);
+    struct sequencer _s, *s = &_s;
+    sequencer_init(s, NULL, &a, 32, 4);
+    struct pattern_step in[] = {
+        { .event = {.u8 = {PAT_SEQ_CMD, PAT_SEQ_CMD_HEAD}}, .delay = 5 },
+        { .event = PAT_MIDI(0, 0x90, 60, 100), .delay = 0 },
+        { .event = PAT_MIDI(2, 0xC1, 7),       .delay = 0 },
+        { .event = PAT_CV(1, 0x1234),          .delay = 200 },
+        { .event = PAT_MIDI(0, 0x80, 60, 0),   .delay = 1 },
+        { .event = PAT_MIDI(2, 0xB1, 1, 64),   .delay = 0x8000 },
+    };
+    pattern_t pat = sequencer_load_pattern(s, in, ARRAY_SIZE(in));
+    ASSERT(pat != PATTERN_NONE);
+    struct pattern_step copy[ARRAY_SIZE(in)];
+    uint32_t nb = 0;
+    FOR_SEQUENCER_STEPS(s, pat, is) copy[nb++] = *is.step;
+    ASSERT(nb == ARRAY_SIZE(in));
+
+    uint8_t buf[7];
+    struct smf_writer w = { .buf = buf, .size = sizeof(buf), .flush = file_flush };
+    file_nb = 0;
+    ASSERT(0 == smf_encode(&w, copy, nb, format, 24));
+    ASSERT(w.count == file_nb);
+
+    struct smf_info info;
+    struct pattern_step out[ARRAY_SIZE(event) + 1];
+    ASSERT(nb == decode(24, &info, out));
+    ASSERT(info.format == format);
+    ASSERT(info.nb_tracks == (format ? 3 : 1));
+    ASSERT(info.length == 5 + 200 + 1 + 0x8000);
+    ASSERT(PATTERN_NONE != sequencer_load_pattern(s, out, nb));
+    /* Same time events of different tracks are merged in track
+       order, which matches the port order used here. */
+    for (uint32_t i = 0; i < nb; i++) {
+        ASSERT(out[i].event.u32 == in[i].event.u32);
+        ASSERT(out[i].delay == in[i].delay);
+    }
+    LOG("smf type %d: %d bytes\n", format, file_nb);
+    free(a.buf);
+}
+
+/* A file written elsewhere: 96 ticks per quarter, running status,
+   sysex, an unknown chunk and no event at time 0. */
+void test_import(void) {
+    const uint8_t smf[] = {
+        'M','T','h','d', 0,0,0,6, 0,1, 0,2, 0,96,
+        'X','Y','Z','W', 0,0,0,2, 0xAA, 0xBB,
+        'M','T','r','k', 0,0,0,17,
+        0x30, 0x91, 60, 100,         // 48: note on, ch 1
+        0x30, 62, 100,               // 96: running status
+        0x00, 0xF0, 2, 0x7E, 0xF7,   // sysex is skipped
+        0x81, 0x40, 0xFF, 0x2F, 0,   // 288: end of track
+        'M','T','r','k', 0,0,0,13,
+        0x00, 0xFF, 0x21, 1, 3,      // port 3
+        0x18, 0xE0, 0, 64,           // 24: pitch bend
+        0x00, 0xFF, 0x2F, 0,
+    };
+    memcpy(file, smf, sizeof(smf));
+    file_nb = sizeof(smf);
+    struct smf_info info;
+    struct pattern_step out[ARRAY_SIZE(event) + 1];
+    ASSERT(4 == decode(24, &info, out));
+    ASSERT(info.nb_tracks == 2);
+    ASSERT(info.division == 96);
+    ASSERT(info.length == 72);
+    union pattern_event ev[] = {
+        {.u8 = {PAT_SEQ_CMD, PAT_SEQ_CMD_HEAD}},
+        PAT_MIDI(3, 0xE0, 0, 64),
+        PAT_MIDI(0, 0x91, 60, 100),
+        PAT_MIDI(0, 0x91, 62, 100),
+    };
+    dtime_t delay[] = {6, 6, 12, 48};
+    for (int i = 0; i < 4; i++) {
+        ASSERT(out[i].event.u32 == ev[i].u32);
+        ASSERT(out[i].delay == delay[i]);
+    }
+    /* Truncated input is an error. */
+    file_nb -= 3;
+    struct smf_reader r = { .buf = file, .fill = file_fill };
+    nb_events = 0;
+    ASSERT(-1 == smf_decode(&r, 24, collect, NULL, &info));
+    LOG("smf import: ok\n");
+}
+
+int main(int argc, char **argv) {
+    test_roundtrip(0);
+    test_roundtrip(1);
+    test_import();
+    return 0;
+}
@@ -97,6 +97,15 @@ HOST_ELF := \
 	linux/pd.dynamic.host.elf \
 	linux/envy24.dynamic.host.elf \
 	linux/test_sequencer.dynamic.host.elf \
+	linux/test_sequencer_wheel.dynamic.host.elf \
+	linux/test_sequencer_arena.dynamic.host.elf \
+	linux/test_smf.dynamic.host.elf \
+	linux/test_midi_through.dynamic.host.elf \
+	linux/bench_sequencer.dynamic.host.elf \
+	linux/bench_sequencer_wheel.dynamic.host.elf \
+	linux/bench_sequencer_hub.dynamic.host.elf \
+	linux/fuzz_sequencer.dynamic.host.elf \
+	linux/fuzz_sequencer_wheel.dynamic.host.elf \
 	linux/gen_max11300.dynamic.host.elf \
 	linux/tether_bl_midi.dynamic.host.elf \
 	linux/a2jmidid.dynamic.host.elf \